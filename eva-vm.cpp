@@ -35,30 +35,124 @@ void singleTest (bool showDisassembler, bool showStacks) {
     std::cout << "All done" << std::endl;
 }
 
+void printUsage() {
+    std::cout << "\nUsage: eva-vm [options] \n\n"
+            << "Options: \n"
+            << "  -e, --expression 'Expression to parse'\n"
+            << "  -f, --file       File to parse\n"
+            << "  --stacks         Dump the stack before every instruction\n"
+            << "  --profile        Print opcode and opcode pair counts\n"
+            << "  --feedback       Print operand types, callees and branch ratios seen\n"
+            << "  --registers      Run on the register tier\n"
+            << "  --jit            Compile hot functions and loops to native code\n"
+            << "  --jit-threshold  Calls plus loop iterations before compiling (default "
+            << JIT_THRESHOLD << ")\n"
+            << "  --stencils       Compile every function to native code from stencils\n"
+            << "  --trace-jit      Record and compile hot while loops (threshold: --jit-threshold)\n"
+            << "  --max-call-depth Maximum number of active calls (default "
+            << MAX_CALL_DEPTH << ")\n"
+            << "  --stack-size     Operand stack size in values (default "
+            << STACK_SIZE << ")\n"
+            << "  --gc-threshold   Heap bytes before the first collection (default "
+            << GC_THRESHOLD << ")\n"
+            << "  --gc-growth      Heap growth over the live bytes before the next one (default "
+            << GC_GROWTH << ")\n"
+            << "  --nursery-size   Young generation bytes, 0 for none (default "
+            << NURSERY_SIZE << ")\n"
+            << "  --gc-slice       Objects marked or swept per incremental slice, 0 for\n"
+            << "                   stop-the-world collections (default 0)\n"
+            << "  --gc-slice-interval Allocations and loop back-edges between slices (default "
+            << GC_SLICE_INTERVAL << ")\n"
+            << "  --gc-stats       Print collections, bytes allocated and freed, pause histogram\n\n";
+}
+
 void commandLine(int argc, char const *argv[]) {
-    if (argc != 3) {
-        std::cout << "\nUsage: eva-vm [options] \n\n"
-                << "Options: \n"
-                << "  -e, --expression 'Expression to parse'\n"
-                << "  -f, --file       File to parse\n\n";
+    // Expression mode
+    std::string mode;
+
+    // Expression or file name
+    std::string source;
+
+    // Trace mode of the eval loop
+    TraceMode trace = TraceMode::NONE;
+
+    // Bytecode format
+    BytecodeTier tier = BytecodeTier::STACK;
+
+    // VM construction options
+    VMOptions options;
+
+    // Print the heap counters at exit
+    bool gcStats = false;
+
+    for (auto i = 1; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "--stacks") {
+            trace = TraceMode::STACK;
+        } else if (option == "--profile") {
+            trace = TraceMode::PROFILE;
+        } else if (option == "--feedback") {
+            trace = TraceMode::FEEDBACK;
+        } else if (option == "--registers") {
+            tier = BytecodeTier::REGISTER;
+        } else if (option == "--jit") {
+            options.jit = JitTier::BASELINE;
+        } else if (option == "--stencils") {
+            options.jit = JitTier::STENCIL;
+        } else if (option == "--trace-jit") {
+            options.jit = JitTier::TRACE;
+        } else if (option == "--jit-threshold" && i + 1 < argc) {
+            options.jitThreshold = std::stoul(argv[++i]);
+        } else if (option == "--max-call-depth" && i + 1 < argc) {
+            options.maxCallDepth = std::stoul(argv[++i]);
+        } else if (option == "--stack-size" && i + 1 < argc) {
+            options.stackSize = std::stoul(argv[++i]);
+        } else if (option == "--gc-threshold" && i + 1 < argc) {
+            options.gcThreshold = std::stoul(argv[++i]);
+        } else if (option == "--gc-growth" && i + 1 < argc) {
+            options.gcGrowth = std::stoul(argv[++i]);
+        } else if (option == "--nursery-size" && i + 1 < argc) {
+            options.nurserySize = std::stoul(argv[++i]);
+        } else if (option == "--gc-slice" && i + 1 < argc) {
+            options.gcSlice = std::stoul(argv[++i]);
+        } else if (option == "--gc-slice-interval" && i + 1 < argc) {
+            options.gcSliceInterval = std::stoul(argv[++i]);
+        } else if (option == "--gc-stats") {
+            gcStats = true;
+        } else if (i + 1 < argc && (option == "-e" || option == "--expression" ||
+                                    option == "-f" || option == "--file")) {
+            mode = option;
+            source = argv[++i];
+        } else {
+            printUsage();
+            return;
+        }
+    }
+
+    if (mode.empty()) {
+        printUsage();
         return;
     }
 
-    // Expression mode
-    std::string mode = argv[1];
+#ifndef EVA_JIT
+    if (options.jit != JitTier::NONE) {
+        std::cerr << "--jit/--stencils/--trace-jit: not supported on this platform, interpreting\n";
+    }
+#endif
 
     // Program declaration
     std::string program;
 
     // Simple expression
-    if (mode == "-e") {
-        program = argv[2];
+    if (mode == "-e" || mode == "--expression") {
+        program = source;
     }
 
     // Eva file
-    else if (mode == "-f") {
+    else {
         // Read the file
-        std::ifstream programFile(argv[2]);
+        std::ifstream programFile(source);
         std::stringstream buffer;
         buffer << programFile.rdbuf() << "\n";
 
@@ -67,13 +161,25 @@ void commandLine(int argc, char const *argv[]) {
     }
 
     // VM instance
-    EvaVM vm;
+    EvaVM vm(options);
+    vm.tier = tier;
 
 
     bool showDisassembler = true;
-    bool showStacks = false;
-    auto result = vm.exec(program, showDisassembler, showStacks);
+    auto result = vm.exec(program, showDisassembler, trace);
     log(result);
+
+    if (trace == TraceMode::PROFILE) {
+        vm.profile.dump();
+    }
+
+    if (trace == TraceMode::FEEDBACK) {
+        vm.dumpFeedback();
+    }
+
+    if (gcStats) {
+        vm.dumpHeapStats();
+    }
 }
 
 int main(int argc, char const *argv[]) {
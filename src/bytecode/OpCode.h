@@ -25,7 +25,8 @@
 #define OP_COMPARE 0x06
 
 /**
- *  Control flow: jump if the value on the stack is false.
+ *  Control flow: jump if the value on the stack is false.  Jumps take a
+ *  signed 32-bit offset from the end of the instruction, see jumpTarget.
  */
 #define OP_JMP_IF_FALSE 0x07
 
@@ -74,6 +75,20 @@
  */
 #define OP_RETURN 0x16
 
+/**
+ *  Function call in tail position: replaces the current frame
+ *  with the callee's, then behaves like OP_CALL
+ */
+#define OP_TAIL_CALL 0x1A
+
+/**
+ *  Wide operand prefix: OP_WIDE <opcode> <hi> <lo> runs <opcode> with a
+ *  two-byte operand.  Only the compiler's single index or count operands
+ *  widen (CONST, GET/SET_GLOBAL, GET/SET_LOCAL, GET/SET_CELL, LOAD_CELL,
+ *  SCOPE_EXIT, MAKE_FUNCTION), and only past 255.
+ */
+#define OP_WIDE 0x1B
+
 /**
  *  Returns a cell variable
  */
@@ -94,12 +109,157 @@
  */
 #define OP_MAKE_FUNCTION 0x20
 
+/**
+ *  Compare and branch: pops two values and jumps unless the opposite
+ *  relation holds (JMP_IF_GE: unless a < b; so a NaN operand jumps).
+ *  The compiler emits the opposite of a test's operator for its false
+ *  edge.  Same order as the OP_COMPARE operators, so OP_JMP_IF_LT + op
+ *  works.
+ */
+#define OP_JMP_IF_LT 0x21
+#define OP_JMP_IF_GT 0x22
+#define OP_JMP_IF_EQ 0x23
+#define OP_JMP_IF_GE 0x24
+#define OP_JMP_IF_LE 0x25
+#define OP_JMP_IF_NE 0x26
+
+//--------------------------------------
+// Quickened instructions.
+//
+// Written over a generic instruction by the VM once it has seen the
+// operand types, same size and operands as the original.  Each guards
+// its types and rewrites itself back to the generic instruction if the
+// guard fails.
+
+/**
+ *  OP_ADD of two numbers / two strings
+ */
+#define OP_ADD_NUM 0x40
+#define OP_ADD_STR 0x41
+
+/**
+ *  OP_COMPARE of two numbers, one per operator (OP_LT_NUM + op)
+ */
+#define OP_LT_NUM 0x42
+#define OP_GT_NUM 0x43
+#define OP_EQ_NUM 0x44
+#define OP_GE_NUM 0x45
+#define OP_LE_NUM 0x46
+#define OP_NE_NUM 0x47
+
+//--------------------------------------
+// Superinstructions.
+//
+// Fused hot opcode pairs, produced by EvaPeephole after compilation.
+// Operands are those of the original pair, in order.
+
+/**
+ *  GET_LOCAL a, GET_LOCAL b
+ */
+#define OP_GET_LOCAL2 0x30
+
+/**
+ *  GET_LOCAL a, CONST k
+ */
+#define OP_GET_LOCAL_CONST 0x31
+
+/**
+ *  GET_GLOBAL g, CONST k
+ */
+#define OP_GET_GLOBAL_CONST 0x32
+
+/**
+ *  SET_LOCAL a, POP
+ */
+#define OP_SET_LOCAL_POP 0x33
+
+/**
+ *  SET_GLOBAL g, POP
+ */
+#define OP_SET_GLOBAL_POP 0x34
+
+//--------------------------------------
+// Register tier.
+//
+// Operands are registers (slots relative to the frame base pointer),
+// constant and global indices, one byte each.  Jumps take a signed 32-bit
+// offset from the end of the instruction, as in the stack tier.
+
+/**
+ *  Stops the program, returns register A:           HALT A
+ */
+#define ROP_HALT 0x80
+
+/**
+ *  Loads constant K into register A:                LOADK A K
+ */
+#define ROP_LOADK 0x81
+
+/**
+ *  Copies register B into register A:               MOVE A B
+ */
+#define ROP_MOVE 0x82
+
+/**
+ *  Binary math, A = B op C:                         ADD A B C
+ */
+#define ROP_ADD 0x83
+#define ROP_SUB 0x84
+#define ROP_MUL 0x85
+#define ROP_DIV 0x86
+
+/**
+ *  Comparison, A = B <op> C:                        COMPARE A B C op
+ */
+#define ROP_COMPARE 0x87
+
+/**
+ *  Jump if register A is false:                     JMP_IF_FALSE A off
+ */
+#define ROP_JMP_IF_FALSE 0x88
+
+/**
+ *  Unconditional jump:                              JMP off
+ */
+#define ROP_JMP 0x89
+
+/**
+ *  Loads global G into register A:                  GET_GLOBAL A G
+ */
+#define ROP_GET_GLOBAL 0x8A
+
+/**
+ *  Stores register A into global G:                 SET_GLOBAL G A
+ */
+#define ROP_SET_GLOBAL 0x8B
+
+/**
+ *  Calls the function in register A with N args
+ *  in A+1..A+N, result is stored in A:              CALL A N
+ */
+#define ROP_CALL 0x8C
+
+/**
+ *  Returns register A to the caller:                RETURN A
+ */
+#define ROP_RETURN 0x8D
+
+/**
+ *  CALL in tail position, the callee replaces
+ *  the current frame:                               TAIL_CALL A N
+ */
+#define ROP_TAIL_CALL 0x8E
+
 
 //--------------------------------------
 #define OP_STR(op)      \
     case OP_##op:       \
         return #op
 
+#define ROP_STR(op)     \
+    case ROP_##op:      \
+        return "R_" #op
+
 std::string opcodeToString(uint8_t opcode) {
     switch (opcode) {
        OP_STR(HALT); 
@@ -119,14 +279,142 @@ std::string opcodeToString(uint8_t opcode) {
        OP_STR(SCOPE_EXIT); 
        OP_STR(CALL); 
        OP_STR(RETURN); 
+       OP_STR(TAIL_CALL);
+       OP_STR(WIDE);
        OP_STR(GET_CELL); 
        OP_STR(SET_CELL); 
        OP_STR(LOAD_CELL); 
        OP_STR(MAKE_FUNCTION); 
+       OP_STR(JMP_IF_LT);
+       OP_STR(JMP_IF_GT);
+       OP_STR(JMP_IF_EQ);
+       OP_STR(JMP_IF_GE);
+       OP_STR(JMP_IF_LE);
+       OP_STR(JMP_IF_NE);
+       OP_STR(ADD_NUM);
+       OP_STR(ADD_STR);
+       OP_STR(LT_NUM);
+       OP_STR(GT_NUM);
+       OP_STR(EQ_NUM);
+       OP_STR(GE_NUM);
+       OP_STR(LE_NUM);
+       OP_STR(NE_NUM);
+       OP_STR(GET_LOCAL2);
+       OP_STR(GET_LOCAL_CONST);
+       OP_STR(GET_GLOBAL_CONST);
+       OP_STR(SET_LOCAL_POP);
+       OP_STR(SET_GLOBAL_POP);
+       ROP_STR(HALT);
+       ROP_STR(LOADK);
+       ROP_STR(MOVE);
+       ROP_STR(ADD);
+       ROP_STR(SUB);
+       ROP_STR(MUL);
+       ROP_STR(DIV);
+       ROP_STR(COMPARE);
+       ROP_STR(JMP_IF_FALSE);
+       ROP_STR(JMP);
+       ROP_STR(GET_GLOBAL);
+       ROP_STR(SET_GLOBAL);
+       ROP_STR(CALL);
+       ROP_STR(RETURN);
+       ROP_STR(TAIL_CALL);
        default:
             DIE << "opcodeToString: unknown opcode: " << std::hex << (int)opcode;
     }
     return "Unknown";
 }
 
-#endif
\ No newline at end of file
+/**
+ *  Operand of the OP_WIDE instruction at `offset`
+ */
+inline uint16_t wideOperand(const uint8_t* code, size_t offset) {
+    return (uint16_t)((code[offset + 2] << 8) | code[offset + 3]);
+}
+
+/**
+ *  Jump offset (big-endian int32) at `operand`
+ */
+inline int32_t readJumpOffset(const uint8_t* operand) {
+    return (int32_t)((uint32_t)operand[0] << 24 | operand[1] << 16 | operand[2] << 8 |
+                     operand[3]);
+}
+
+/**
+ *  Offset jumped to by the jump whose offset operand is at `operand`,
+ *  always the last operand of the instruction
+ */
+inline size_t jumpTarget(const uint8_t* code, size_t operand) {
+    return operand + 4 + readJumpOffset(code + operand);
+}
+
+/**
+ *  Points the jump operand at `operand` to `target`
+ */
+inline void patchJumpTarget(uint8_t* code, size_t operand, size_t target) {
+    auto offset = (uint32_t)(int32_t)(target - (operand + 4));
+    code[operand] = (offset >> 24) & 0xff;
+    code[operand + 1] = (offset >> 16) & 0xff;
+    code[operand + 2] = (offset >> 8) & 0xff;
+    code[operand + 3] = offset & 0xff;
+}
+
+/**
+ *  Instruction size in bytes (opcode and operands), stack tier
+ */
+size_t opcodeSize(uint8_t opcode) {
+    switch (opcode) {
+        case OP_HALT:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_POP:
+        case OP_RETURN:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            return 1;
+        case OP_CONST:
+        case OP_COMPARE:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SCOPE_EXIT:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_GET_CELL:
+        case OP_SET_CELL:
+        case OP_LOAD_CELL:
+        case OP_MAKE_FUNCTION:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+        case OP_LT_NUM:
+        case OP_GT_NUM:
+        case OP_EQ_NUM:
+        case OP_GE_NUM:
+        case OP_LE_NUM:
+        case OP_NE_NUM:
+            return 2;
+        case OP_GET_LOCAL2:
+        case OP_GET_LOCAL_CONST:
+        case OP_GET_GLOBAL_CONST:
+            return 3;
+        case OP_WIDE:
+            return 4;
+        case OP_JMP_IF_FALSE:
+        case OP_JMP:
+        case OP_JMP_IF_LT:
+        case OP_JMP_IF_GT:
+        case OP_JMP_IF_EQ:
+        case OP_JMP_IF_GE:
+        case OP_JMP_IF_LE:
+        case OP_JMP_IF_NE:
+            return 5;
+        default:
+            DIE << "opcodeSize: unknown opcode: " << std::hex << (int)opcode;
+    }
+    return 0;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define EvaCompiler_h
 
 #include <map>
+#include <set>
 #include <string>
 
 #include "../parser/EvaParser.h"
@@ -9,6 +10,8 @@
 #include "../bytecode/OpCode.h"
 #include "../disassembler/EvaDisassembler.h"
 #include "../vm/Global.h"
+#include "EvaPeephole.h"
+#include "EvaVerifier.h"
 #include "Scope.h"
 
 
@@ -40,8 +43,9 @@
         for (auto i=1; i<exp.list.size(); i++) {        \
             gen(exp.list[i]);                           \
         }                                               \
-        emit(OP_CALL);                                  \
-        emit(exp.list.size() - 1);                      \
+        auto liftedCount = genLiftedArgs(exp);          \
+        emit(tailCalls_.count(&exp) != 0 ? OP_TAIL_CALL : OP_CALL); \
+        emit(argsCount(exp.list.size() - 1 + liftedCount)); \
     } while (false)
 
 
@@ -52,24 +56,46 @@ class EvaCompiler {
     public:
         EvaCompiler(std::shared_ptr<Global> global) 
             : global(global),
-              disassembler(std::make_unique<EvaDisassembler>(global)) {}
+              disassembler(std::make_unique<EvaDisassembler>(global)),
+              verifier(global) {}
 
         /**
          *  Main compile API
          */ 
         void compile(const Exp& exp) {
+            // Code objects of earlier programs are reachable, if at all,
+            // from the globals they defined
+            codeObjects_.clear();
+
             // Allocate new code object:
             co = AS_CODE(createCodeObjectValue("main"));
             main = AS_FUNCTION(ALLOC_FUNCTION(co));
 
-            // Scope analysis
+            // Scope analysis, again with the local functions that
+            // don't escape lambda-lifted
+            localFunctions_.clear();
+            lifted_.clear();
+            liftedCalls_.clear();
+            statements_.clear();
+            tailCalls_.clear();
             analyze(exp, nullptr);
+            if (findLiftable()) {
+                localFunctions_.clear();
+                analyze(exp, nullptr);
+            }
 
             // Generate recursively from top
             gen(exp);
 
             // Explicit Halt market
             emit(OP_HALT);
+
+            // Superinstructions, then checks and stack depths on the
+            // final code.  Functions enter with the callee and arguments.
+            for (auto unit : codeObjects_) {
+                peephole.optimize(unit);
+                verifier.verify(unit, unit == main->co ? 0 : unit->arity + 1);
+            }
         }
 
         /**
@@ -87,7 +113,12 @@ class EvaCompiler {
                 if (exp.string == "true" || exp.string == "false") {
                     // Do nothing
                 } else {
-                    scope->maybePromote(exp.string);
+                    // Natives and constants not declared in the program
+                    // are globals
+                    if (scope->defines(exp.string) || !global->exists(exp.string)) {
+                        scope->maybePromote(exp.string);
+                    }
+                    noteReference(exp.string, scope.get(), nullptr);
                 }
             }
 
@@ -112,7 +143,12 @@ class EvaCompiler {
                             scope == nullptr ? ScopeType::GLOBAL : ScopeType::BLOCK, scope);
 
                         scopeInfo_[&exp] = newScope;
-                        for (auto i = 1; i < exp.list.size(); ++i) {
+                        for (size_t i = 1; i < exp.list.size(); ++i) {
+                            // All but the last are statements, whose
+                            // value is dropped
+                            if (i + 1 < exp.list.size()) {
+                                statements_.insert(&exp.list[i]);
+                            }
                             analyze(exp.list[i], newScope);
                         }
                     }
@@ -121,6 +157,9 @@ class EvaCompiler {
                     // Variable declaration:
                     else if (op == "var") {
                         scope->addLocal(exp.list[1].string);
+                        if (isLambda(exp.list[2])) {
+                            declareFunction(exp.list[1].string, exp, exp.list[2], scope.get());
+                        }
                         analyze(exp.list[2], scope);
                     }
 
@@ -130,11 +169,13 @@ class EvaCompiler {
                         auto fnName = exp.list[1].string;
 
                         scope->addLocal(fnName);
+                        declareFunction(fnName, exp, exp, scope.get());
 
                         auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
                         scopeInfo_[&exp] = newScope;
 
                         newScope->addLocal(fnName);
+                        newScope->functions[fnName] = &exp;
 
                         auto arity = exp.list[2].list.size();
 
@@ -142,6 +183,7 @@ class EvaCompiler {
                         for (auto i = 0; i<arity; i++) {
                             newScope->addLocal(exp.list[2].list[i].string);
                         }
+                        addLiftedParams(exp, newScope.get());
 
                         // Body
                         analyze(exp.list[3], newScope);
@@ -157,12 +199,19 @@ class EvaCompiler {
                         for (auto i=0; i<arity; i++) {
                             newScope->addLocal(exp.list[1].list[i].string);
                         }
+                        addLiftedParams(exp, newScope.get());
 
                         // Body
                         analyze(exp.list[2], newScope);
                     }
 
                     else {
+                        // Callee declared in the program (natives and
+                        // operators are resolved as globals):
+                        if (scope->defines(op)) {
+                            scope->maybePromote(op);
+                        }
+                        noteReference(op, scope.get(), &exp);
                         for (auto i=1; i<exp.list.size(); ++i) {
                             analyze(exp.list[i], scope);
                         }
@@ -176,6 +225,176 @@ class EvaCompiler {
             }
         }
 
+        /**
+         *  Escape analysis
+         *
+         *  A function declared in a block, which is only ever the callee
+         *  of direct calls from its own function (or itself), doesn't
+         *  escape: it's lambda-lifted.  Its free variables become extra
+         *  parameters, passed by every call, so they stay on the stack
+         *  instead of being promoted to cells.  Passing by value is
+         *  only safe if the function doesn't assign them and no closure
+         *  inside it captures them.
+         */
+        struct LocalFunction {
+            const Exp* body = nullptr;
+            Scope* scope = nullptr;
+            bool escapes = false;
+
+            /**
+             * Direct calls: the call, the scope it's made in, and the
+             * scope declaring the callee
+             */
+            struct Call {
+                const Exp* exp;
+                Scope* scope;
+                Scope* target;
+            };
+            std::vector<Call> calls;
+        };
+
+        /**
+         * Registers the local function `fn`, declared by `declaration`
+         */
+        void declareFunction(const std::string& name, const Exp& declaration, const Exp& fn,
+                             Scope* scope) {
+            if (scope->type == ScopeType::GLOBAL) {
+                return;
+            }
+            scope->functions[name] = &fn;
+            auto& info = localFunctions_[&fn];
+            info.body = isLambda(fn) ? &fn.list[2] : &fn.list[3];
+
+            // The value of a declaration in any other position is used
+            info.escapes = statements_.count(&declaration) == 0;
+        }
+
+        /**
+         * Notes a reference to `name` from `scope`, as the callee of
+         * `call` or as a value (nullptr).  Calls to lifted functions
+         * reference their extra arguments.
+         */
+        void noteReference(const std::string& name, Scope* scope, const Exp* call) {
+            bool crossed;
+            auto target = scope->declaring(name, crossed);
+            if (target == nullptr || target->functions.count(name) == 0) {
+                return;
+            }
+            auto fn = target->functions[name];
+            auto& info = localFunctions_[fn];
+
+            if (call == nullptr || crossed) {
+                info.escapes = true;
+                return;
+            }
+            info.calls.push_back({call, scope, target});
+
+            auto lifted = lifted_.find(fn);
+            if (lifted != lifted_.end()) {
+                liftedCalls_[call] = &lifted->second;
+                for (const auto& var : lifted->second) {
+                    scope->maybePromote(var);
+                }
+            }
+        }
+
+        /**
+         * Picks the local functions to lift from the first analysis,
+         * returns whether there are any
+         */
+        bool findLiftable() {
+            for (auto& [fn, info] : localFunctions_) {
+                info.scope = scopeInfo_.at(fn).get();
+                const auto& free = info.scope->free;
+                if (free.empty() || info.escapes || assigns(*info.body, free) ||
+                    captures(*info.body, free)) {
+                    continue;
+                }
+
+                // Each call has to see the same variables as the function
+                auto shadowed = false;
+                for (const auto& call : info.calls) {
+                    for (auto scope = call.scope; scope != call.target; scope = scope->parent.get()) {
+                        for (const auto& var : free) {
+                            shadowed |= scope->declared.count(var) != 0;
+                        }
+                    }
+                }
+                if (!shadowed) {
+                    lifted_[fn] = std::vector<std::string>(free.begin(), free.end());
+                }
+            }
+            return !lifted_.empty();
+        }
+
+        /**
+         * Whether `exp` sets any of `vars`
+         */
+        bool assigns(const Exp& exp, const std::set<std::string>& vars) {
+            if (exp.type != ExpType::LIST) {
+                return false;
+            }
+            if (isTaggedList(exp, "set") && vars.count(exp.list[1].string) != 0) {
+                return true;
+            }
+            for (const auto& child : exp.list) {
+                if (assigns(child, vars)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Whether a function inside `exp` captures any of `vars`
+         */
+        bool captures(const Exp& exp, const std::set<std::string>& vars) {
+            if (exp.type != ExpType::LIST) {
+                return false;
+            }
+            if (isLambda(exp) || isFunctionDeclaration(exp)) {
+                for (const auto& var : scopeInfo_.at(&exp)->free) {
+                    if (vars.count(var) != 0) {
+                        return true;
+                    }
+                }
+            }
+            for (const auto& child : exp.list) {
+                if (captures(child, vars)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Declares the extra parameters of a lifted function
+         */
+        void addLiftedParams(const Exp& fn, Scope* scope) {
+            auto lifted = lifted_.find(&fn);
+            if (lifted == lifted_.end()) {
+                return;
+            }
+            for (const auto& var : lifted->second) {
+                scope->addLocal(var);
+            }
+        }
+
+        /**
+         * Emits the extra arguments of a call to a lifted function,
+         * returns how many
+         */
+        size_t genLiftedArgs(const Exp& call) {
+            auto lifted = liftedCalls_.find(&call);
+            if (lifted == liftedCalls_.end()) {
+                return 0;
+            }
+            for (auto var : *lifted->second) {
+                gen(Exp(var));
+            }
+            return lifted->second->size();
+        }
+
 
 
         /**
@@ -187,15 +406,13 @@ class EvaCompiler {
                  *  Numbers
                  */ 
                 case ExpType::NUMBER:
-                    emit(OP_CONST);
-                    emit(numericConstIdx(exp.number));
+                    emitIndexed(OP_CONST, numericConstIdx(exp.number));
                     break;
                 /**
                  *  Strings
                  */ 
                 case ExpType::STRING:
-                    emit(OP_CONST);
-                    emit(stringConstIdx(exp.string));
+                    emitIndexed(OP_CONST, stringConstIdx(exp.string));
                     break;
                 /**
                  *  Symbols (variables, operators)
@@ -203,23 +420,21 @@ class EvaCompiler {
                 case ExpType::SYMBOL:
                     // Booleans
                     if (exp.string == "true" || exp.string == "false") {
-                        emit(OP_CONST);
-                        emit(booleanConstIdx(exp.string == "true" ? true : false));
+                        emitIndexed(OP_CONST, booleanConstIdx(exp.string == "true" ? true : false));
                     } else {
                         // Variables
                         auto varName = exp.string;
 
                         auto opCodeGetter = scopeStack_.top()->getNameGetter(varName);
-                        emit(opCodeGetter);
 
                         // 1. Local vars:
                         if (opCodeGetter == OP_GET_LOCAL) {
-                            emit(co->getLocalIndex(varName));
+                            emitIndexed(opCodeGetter, co->getLocalIndex(varName));
                         }
 
                         // 2. Global vars:
                         else if (opCodeGetter == OP_GET_CELL) {
-                            emit(co->getCellIndex(varName));
+                            emitIndexed(opCodeGetter, co->getCellIndex(varName));
                         }
 
                         // 3. Global vars:
@@ -227,7 +442,7 @@ class EvaCompiler {
                             if (!global->exists(varName)) {
                                 DIE << "[EvaCompiler]: Reference error: " << varName;
                             }
-                            emit(global->getGlobalIndex(varName));
+                            emitIndexed(opCodeGetter, global->getGlobalIndex(varName));
                         }
                     }
                     break;
@@ -269,32 +484,24 @@ class EvaCompiler {
                         //----------------------------------
                         // Branch instructions:
                         else if (op == "if") {
-                            // Emit <test>:
-                            gen(exp.list[1]);
-
-                            // Else branch.  Init with a 0 address
-                            emit(OP_JMP_IF_FALSE);
-                            // NOTE: we use 2-byte addresses:
-                            emit(0);
-                            emit(0);
-                            auto elseJmpAddr = getOffset() - 2;
+                            // Emit <test>, else branch.  Init with a 0 address
+                            auto elseJmpAddr = genJumpIfFalse(exp.list[1]);
 
                             // Emit <consequent>
                             gen(exp.list[2]);
 
                             emit(OP_JMP);
-                            // NOTE: we use 2-byte addresses:
-                            emit(0);
-                            emit(0);
-                            auto endAddr = getOffset() - 2;
+                            auto endAddr = emitJumpOperand();
 
                             // Patch the else branch address
                             auto elseBranchAddr = getOffset();
                             patchJumpAddress(elseJmpAddr, elseBranchAddr);
 
-                            // Emit <alternate> if we have it
+                            // Emit <alternate>, false without one
                             if (exp.list.size() == 4) {
                                 gen(exp.list[3]);
+                            } else {
+                                emitIndexed(OP_CONST, booleanConstIdx(false));
                             }
 
                             auto endBranchAddr = getOffset();
@@ -309,29 +516,24 @@ class EvaCompiler {
                         else if (op == "while") {
                             auto loopStartAddr = getOffset();
 
-                            // Emit <test>:
-                            gen(exp.list[1]);
+                            // Emit <test>, loop end.  Init with 0 address, will be patched
+                            auto loopEndJmpAddr = genJumpIfFalse(exp.list[1]);
 
-                            // Loop end.  Init with 0 address, will be patched
-                            emit(OP_JMP_IF_FALSE);
-                            // NOTE: we use 2-byte addresses:
-                            emit(0);
-                            emit(0);
-                            auto loopEndJmpAddr = getOffset() - 2;
-
-                            // Emit <body>
+                            // Emit <body>, its value is not used
                             gen(exp.list[2]);
+                            emit(OP_POP);
 
                             // Goto loop start:
                             emit(OP_JMP);
-                            emit(0);
-                            emit(0);
-                            patchJumpAddress(getOffset() - 2, loopStartAddr);
+                            patchJumpAddress(emitJumpOperand(), loopStartAddr);
 
                             // Patch the end
                             auto loopEndAddr =  getOffset();
                             patchJumpAddress(loopEndJmpAddr, loopEndAddr);
 
+                            // The loop itself evaluates to the failed <test>
+                            emitIndexed(OP_CONST, booleanConstIdx(false));
+
                         }                        
 
 
@@ -357,16 +559,14 @@ class EvaCompiler {
                             // 1. Global vars:
                             if (opCodeSetter == OP_SET_GLOBAL) {
                                 global->define(varName);
-                                emit(OP_SET_GLOBAL);
-                                emit(global->getGlobalIndex(varName));
+                                emitIndexed(OP_SET_GLOBAL, global->getGlobalIndex(varName));
                                 emit(OP_POP);
                             }
                             // 2. Cells:
                             else if (opCodeSetter == OP_SET_CELL) {
                                 co->cellNames.push_back(varName);
-                                emit(OP_SET_CELL);
                                 //showCellNames();
-                                emit(co->cellNames.size()-1);
+                                emitIndexed(OP_SET_CELL, co->cellNames.size()-1);
 
                                 // Explicitly po the value from the stack,
                                 // since it's promoted to the heap:
@@ -390,14 +590,12 @@ class EvaCompiler {
 
                             // 1. Local vars:
                             if (opCodeSetter == OP_SET_LOCAL) {
-                                emit(OP_SET_LOCAL);
-                                emit(co->getLocalIndex(varName));
+                                emitIndexed(OP_SET_LOCAL, co->getLocalIndex(varName));
                             }
 
                             // 1. Local vars:
                             else if (opCodeSetter == OP_SET_CELL) {
-                                emit(OP_SET_CELL);
-                                emit(co->getCellIndex(varName));
+                                emitIndexed(OP_SET_CELL, co->getCellIndex(varName));
                             }
 
                             // 3. Global vars:  
@@ -406,8 +604,7 @@ class EvaCompiler {
                                 if (globalIndex == -1) {
                                     DIE << "Reference error: " << varName << " is not defined.";
                                 }
-                                emit(OP_SET_GLOBAL);
-                                emit(globalIndex);
+                                emitIndexed(OP_SET_GLOBAL, globalIndex);
                             }
                         }
 
@@ -436,8 +633,18 @@ class EvaCompiler {
                                     emit(OP_POP);
                                 }
 
+                                // The block evaluates to the declared value:
+                                // globals and cells leave it under their
+                                // OP_POP, a local is copied from its slot
                                 if (isLast && isDecl) {
-                                    co->code.pop_back();
+                                    auto name = exp.list[i].list[1].string;
+                                    auto setter = scopeStack_.top()->getNameSetter(name);
+                                    if (setter == OP_SET_GLOBAL ||
+                                        (setter == OP_SET_CELL && isVarDeclaration(exp.list[i]))) {
+                                        co->code.pop_back();
+                                    } else {
+                                        emitIndexed(OP_GET_LOCAL, co->getLocalIndex(name));
+                                    }
                                 }
                             }
                             blockExit();
@@ -459,8 +666,7 @@ class EvaCompiler {
                             // Define the function as a variable in our co:
                             if (isGlobalScope()) {
                                 global->define(fnName);
-                                emit(OP_SET_GLOBAL);
-                                emit(global->getGlobalIndex(fnName));
+                                emitIndexed(OP_SET_GLOBAL, global->getGlobalIndex(fnName));
                                 emit(OP_POP);
                             } else {
                                 co->addLocal(fnName);
@@ -485,6 +691,9 @@ class EvaCompiler {
                         // Function calls:
                         else {
                             // Named function calls
+                            if (scopeStack_.top()->getNameGetter(op) == OP_GET_GLOBAL) {
+                                global->checkNativeCall(op, exp.list.size() - 1);
+                            }
                             FUNCTION_CALL(exp);
                         }
                     }
@@ -512,11 +721,43 @@ class EvaCompiler {
             }
         } 
 
+        /**
+         * All compiled code units
+         */
+        const std::vector<CodeObject*>& getCodeObjects() { return codeObjects_; }
+
         /**
          * Returns main function (entry point).
          */
         FunctionObject* getMainFunction() { return main; } 
 
+        /**
+         *  Comparison map
+         */ 
+        static std::map<std::string, uint8_t> compareOps_;
+
+        /**
+         * Collects the calls in tail position of a function body (both
+         * tiers compile them to a tail call, which reuses the frame).
+         */
+        static void markTailCalls(const Exp& exp, std::set<const Exp*>& tailCalls) {
+            if (exp.type != ExpType::LIST || exp.list.empty()) {
+                return;
+            }
+            auto& tag = exp.list[0];
+            if (tag.type == ExpType::SYMBOL && tag.string == "if") {
+                for (size_t i = 2; i < exp.list.size(); i++) {
+                    markTailCalls(exp.list[i], tailCalls);
+                }
+            } else if (tag.type == ExpType::SYMBOL && tag.string == "begin") {
+                markTailCalls(exp.list.back(), tailCalls);
+            } else if (tag.type != ExpType::SYMBOL ||
+                       (specialForms_.count(tag.string) == 0 &&
+                        compareOps_.count(tag.string) == 0)) {
+                tailCalls.insert(&exp);
+            }
+        }
+
     private:
 
         /**
@@ -529,6 +770,16 @@ class EvaCompiler {
          */
         std::unique_ptr<EvaDisassembler> disassembler;
 
+        /**
+         * Superinstruction pass.
+         */
+        EvaPeephole peephole;
+
+        /**
+         * Bytecode verifier.
+         */
+        EvaVerifier verifier;
+
         /**
          * Compiles a function
          */
@@ -540,8 +791,17 @@ class EvaCompiler {
 
             auto scopeInfo = scopeInfo_.at(&exp);
             scopeStack_.push(scopeInfo);
-            
-            auto arity = params.list.size();
+
+            // A lifted function takes its free variables as parameters
+            auto allParams = params;
+            auto lifted = lifted_.find(&exp);
+            if (lifted != lifted_.end()) {
+                for (auto var : lifted->second) {
+                    allParams.list.push_back(Exp(var));
+                }
+            }
+
+            auto arity = allParams.list.size();
 
             // Save previous code object
             auto prevCo = co;
@@ -569,27 +829,34 @@ class EvaCompiler {
 
             // Parameters are added as variables.
             for (auto i = 0; i < arity; i++) {
-                auto argName = params.list[i].string;
+                auto argName = allParams.list[i].string;
                 co->addLocal(argName);
-                // NOTE: if the param is captured by cell, emit the code
-                // for it.  We also don't pop the param value in this
-                // case, since OP_SCOPE_EXIT would pop it.
+                // NOTE: if the param is captured by cell, copy it to the
+                // cell.  The param value stays on the stack, since
+                // OP_SCOPE_EXIT pops it.
                 auto cellIndex = co->getCellIndex(argName);
                 if (cellIndex != -1) {
-                    emit(OP_SET_CELL);
-                    emit(cellIndex);
+                    emitIndexed(OP_GET_LOCAL, i + 1);
+                    emitIndexed(OP_SET_CELL, cellIndex);
+                    emit(OP_POP);
                 }
             }
 
-            // Compile body in the new code object:
+            // Compile body in the new code object.  A body that is not
+            // a block takes the block's level, so blocks nested in it
+            // are not taken for the function body (isFunctionBody):
+            markTailCalls(body, tailCalls_);
+            if (!isBlock(body)) {
+                co->scopeLevel++;
+            }
             gen(body);
 
             // If we don't have explicit block which pops locals,
             // we should pop arguments (if any) - callee cleanup.
             // +1 is for the function itself which is set as a local.
             if (!isBlock(body)) {
-                emit(OP_SCOPE_EXIT);
-                emit(arity + 1);
+                co->scopeLevel--;
+                emitIndexed(OP_SCOPE_EXIT, arity + 1);
             }
 
             // Explicit return to restore caller address.
@@ -612,8 +879,7 @@ class EvaCompiler {
                 co->addConst(fn);
 
                 // And emit code for this new constant:
-                emit(OP_CONST);
-                emit(co->constants.size() - 1);
+                emitIndexed(OP_CONST, co->constants.size() - 1);
             }
 
             // Closures:
@@ -630,24 +896,47 @@ class EvaCompiler {
                 co = prevCo;
 
                 for (const auto& freeVar : scopeInfo->free) {
-                    emit(OP_LOAD_CELL);
-                    emit(prevCo->getCellIndex(freeVar));
+                    emitIndexed(OP_LOAD_CELL, prevCo->getCellIndex(freeVar));
                 }
 
                 // Load code object:
-                emit(OP_CONST);
-                emit(co->constants.size() - 1);
-
-                // Create the function
-                emit(OP_MAKE_FUNCTION);
+                emitIndexed(OP_CONST, co->constants.size() - 1);
 
-                // How many cells to capture
-                emit(scopeInfo->free.size());
+                // Create the function, capturing this many cells
+                emitIndexed(OP_MAKE_FUNCTION, scopeInfo->free.size());
             }
 
             scopeStack_.pop();
         }
 
+        /**
+         * Emits <test> and a jump taken when it is false.  Comparisons
+         * branch directly (OP_JMP_IF_<negated op>), without a boolean.
+         * Returns the offset of the address to patch.
+         */
+        size_t genJumpIfFalse(const Exp& test) {
+            if (isComparison(test)) {
+                gen(test.list[1]);
+                gen(test.list[2]);
+                auto negatedOp = (compareOps_[test.list[0].string] + 3) % 6;
+                emit(OP_JMP_IF_LT + negatedOp);
+            } else {
+                gen(test);
+                emit(OP_JMP_IF_FALSE);
+            }
+            return emitJumpOperand();
+        }
+
+        /**
+         * Emits a jump offset to patch, returns its position
+         */
+        size_t emitJumpOperand() {
+            for (auto i = 0; i < 4; i++) {
+                emit(0);
+            }
+            return getOffset() - 4;
+        }
+
         /**
          * Creates a new code object.
          */
@@ -670,22 +959,18 @@ class EvaCompiler {
             // Pop vars from the stack if they were declared
             // within this specific scope
             auto varsCount = 0;
-            if (co->locals.size() > 0) {
-                while (co->locals.back().scopeLevel ==  co->scopeLevel) {
-                    co->locals.pop_back();
-                    varsCount++;
-                }
+            while (!co->locals.empty() && co->locals.back().scopeLevel == co->scopeLevel) {
+                co->locals.pop_back();
+                varsCount++;
             }
 
-            if (varsCount > 0 || co->arity > 0) {
-                emit(OP_SCOPE_EXIT);
-
+            if (varsCount > 0 || isFunctionBody()) {
                 // +1 for the function itself
                 if (isFunctionBody()) {
                     varsCount += co->arity + 1;
                 }
 
-                emit(varsCount);
+                emitIndexed(OP_SCOPE_EXIT, varsCount);
             }
 
             co->scopeLevel--; 
@@ -700,8 +985,7 @@ class EvaCompiler {
 
         bool isDeclaration(const Exp& exp) { 
             return isVarDeclaration(exp) || 
-                isFunctionDeclaration(exp) ||
-                isLambda(exp)
+                isFunctionDeclaration(exp)
             ; }
 
         bool isVarDeclaration(const Exp& exp) { return isTaggedList(exp, "var"); }
@@ -712,8 +996,15 @@ class EvaCompiler {
 
         bool isBlock(const Exp& exp) { return isTaggedList(exp, "begin"); }
 
+        bool isComparison(const Exp& exp) {
+            return exp.type == ExpType::LIST && exp.list.size() == 3
+                && exp.list[0].type == ExpType::SYMBOL
+                && compareOps_.count(exp.list[0].string) != 0;
+        }
+
         bool isTaggedList(const Exp& exp, const std::string& tag) {
             return exp.type == ExpType::LIST 
+                && !exp.list.empty()
                 && exp.list[0].type == ExpType::SYMBOL 
                 && exp.list[0].string == tag;
         }
@@ -735,8 +1026,8 @@ class EvaCompiler {
         /**
          *  Allocates a numeric constant
          */ 
-        size_t numericConstIdx(double value) {
-            ALLOC_CONST(IS_NUMBER, AS_NUMBER, NUMBER, value);
+        size_t numericConstIdx(int value) {
+            ALLOC_CONST(IS_INTEGER, AS_INTEGER, INTEGER, value);
             return co->constants.size() - 1;
         }
 
@@ -758,6 +1049,36 @@ class EvaCompiler {
 
         void emit(uint8_t code) { co->code.push_back(code); }
 
+        /**
+         * Emits an instruction with one index or count operand: a byte,
+         * or OP_WIDE opcode hi lo when it does not fit
+         */
+        void emitIndexed(uint8_t opcode, size_t operand) {
+            if (operand > 0xffff) {
+                DIE << "[EvaCompiler]: operand " << operand << " of "
+                    << opcodeToString(opcode) << " does not fit in 16 bits, in " << co->name;
+            }
+            if (operand > 0xff) {
+                emit(OP_WIDE);
+                emit(opcode);
+                emit((operand >> 8) & 0xff);
+                emit(operand & 0xff);
+            } else {
+                emit(opcode);
+                emit(operand);
+            }
+        }
+
+        /**
+         * Argument count of a call, one byte
+         */
+        size_t argsCount(size_t count) {
+            if (count > 0xff) {
+                DIE << "[EvaCompiler]: more than 255 arguments in a call in " << co->name;
+            }
+            return count;
+        }
+
         /**
          * Write byte at offset
          */
@@ -766,11 +1087,10 @@ class EvaCompiler {
         }
 
         /**
-         * Patches jump address
+         * Patches the jump offset at `offset` to land on `address`
          */
-        void patchJumpAddress(size_t offset, uint16_t value) {
-            writeByteAtOffset(offset, (value >> 8) & 0xff);
-            writeByteAtOffset(offset + 1, value & 0xff);
+        void patchJumpAddress(size_t offset, size_t address) {
+            patchJumpTarget(co->code.data(), offset, address);
         }
 
         /**
@@ -778,6 +1098,29 @@ class EvaCompiler {
          */ 
         std::map<const Exp*, std::shared_ptr<Scope> > scopeInfo_;
 
+        /**
+         *  Operators and special forms, i.e. lists which are not calls
+         */
+        static std::set<std::string> specialForms_;
+
+        /**
+         *  Calls in tail position, see markTailCalls
+         */
+        std::set<const Exp*> tailCalls_;
+
+        /**
+         *  Escape analysis: local functions by their lambda/def, and the
+         *  ones lifted with their extra parameters, see LocalFunction
+         */
+        std::map<const Exp*, LocalFunction> localFunctions_;
+        std::map<const Exp*, std::vector<std::string>> lifted_;
+        std::map<const Exp*, const std::vector<std::string>*> liftedCalls_;
+
+        /**
+         *  Non-last expressions of blocks
+         */
+        std::set<const Exp*> statements_;
+
         /**
          *  Scope stack
          */ 
@@ -791,18 +1134,13 @@ class EvaCompiler {
         /**
          *  Main entry point for function
          */ 
-        FunctionObject* main;
+        FunctionObject* main = nullptr;
 
         /**
          *  All code objects
          */ 
         std::vector<CodeObject*> codeObjects_;
 
-        /**
-         *  Comparison map
-         */ 
-        static std::map<std::string, uint8_t> compareOps_;
-
         void showCellNames() {
             std::cout << "========" << std::endl 
                 << "SHOWING co->cellNames" << std::endl;
@@ -819,4 +1157,8 @@ std::map<std::string, uint8_t> EvaCompiler::compareOps_ = {
     {"<", 0}, {">", 1}, {"==", 2}, {">=", 3}, {"<=", 4}, {"!=", 5}, 
 };
 
+std::set<std::string> EvaCompiler::specialForms_ = {
+    "+", "-", "*", "/", "if", "while", "var", "set", "begin", "def", "lambda",
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+/**
+ * Peephole pass: fuses hot opcode pairs into superinstructions.
+ */
+
+#ifndef EvaPeephole_h
+#define EvaPeephole_h
+
+#include <vector>
+
+#include "../bytecode/OpCode.h"
+#include "../vm/EvaValue.h"
+
+/**
+ * A pair of instructions and the superinstruction replacing it.
+ */
+struct Fusion {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+};
+
+/**
+ *  EvaPeephole
+ *
+ *  Runs over CodeObject::code after compilation.  A pair is fused only
+ *  if no jump lands on its second instruction; jump offsets are
+ *  recomputed for the new layout.
+ */
+class EvaPeephole {
+    public:
+        /**
+         * Fuses instruction pairs in place
+         */
+        void optimize(CodeObject* co) {
+            auto& code = co->code;
+
+            // 1. Offsets jumped to:
+            std::vector<bool> isJumpTarget(code.size() + 1, false);
+            for (size_t offset = 0; offset < code.size(); offset += opcodeSize(code[offset])) {
+                if (isJump(code[offset])) {
+                    isJumpTarget[jumpTarget(code.data(), offset + 1)] = true;
+                }
+            }
+
+            // 2. Rewrite, recording where each old instruction went:
+            std::vector<uint8_t> out;
+            out.reserve(code.size());
+            std::vector<size_t> newOffsets(code.size() + 1, 0);
+            // Jumps in `out`, with their offset in `code`
+            std::vector<std::pair<size_t, size_t>> jumps;
+
+            size_t offset = 0;
+            while (offset < code.size()) {
+                newOffsets[offset] = out.size();
+
+                auto opcode = code[offset];
+                auto size = opcodeSize(opcode);
+                auto next = offset + size;
+
+                if (next < code.size() && !isJumpTarget[next]) {
+                    auto fused = getFused(opcode, code[next]);
+                    if (fused != -1) {
+                        auto nextSize = opcodeSize(code[next]);
+                        out.push_back(fused);
+                        out.insert(out.end(), &code[offset + 1], &code[offset + size]);
+                        out.insert(out.end(), &code[next + 1], &code[next + nextSize]);
+                        offset = next + nextSize;
+                        continue;
+                    }
+                }
+
+                if (isJump(opcode)) {
+                    jumps.push_back({out.size(), offset});
+                }
+                out.insert(out.end(), &code[offset], &code[next]);
+                offset = next;
+            }
+            newOffsets[code.size()] = out.size();
+
+            // 3. Patch jump offsets:
+            for (auto& jump : jumps) {
+                auto target = newOffsets[jumpTarget(code.data(), jump.second + 1)];
+                patchJumpTarget(out.data(), jump.first + 1, target);
+            }
+
+            code = std::move(out);
+        }
+
+    private:
+        /**
+         * Returns the superinstruction for the pair, or -1
+         */
+        int getFused(uint8_t first, uint8_t second) {
+            for (const auto& fusion : fusions_) {
+                if (fusion.first == first && fusion.second == second) {
+                    return fusion.fused;
+                }
+            }
+            return -1;
+        }
+
+        bool isJump(uint8_t opcode) {
+            return opcode == OP_JMP || opcode == OP_JMP_IF_FALSE ||
+                   (opcode >= OP_JMP_IF_LT && opcode <= OP_JMP_IF_NE);
+        }
+
+        /**
+         * Fused pairs, by measured pair frequency on benchmarks/
+         * (see `eva-vm --profile`)
+         */
+        static std::vector<Fusion> fusions_;
+};
+
+std::vector<Fusion> EvaPeephole::fusions_ = {
+    {OP_GET_LOCAL, OP_CONST, OP_GET_LOCAL_CONST},
+    {OP_GET_LOCAL, OP_GET_LOCAL, OP_GET_LOCAL2},
+    {OP_SET_GLOBAL, OP_POP, OP_SET_GLOBAL_POP},
+    {OP_GET_GLOBAL, OP_CONST, OP_GET_GLOBAL_CONST},
+    {OP_SET_LOCAL, OP_POP, OP_SET_LOCAL_POP},
+};
+
+#endif
@@ -0,0 +1,700 @@
+/**
+ * Register tier compiler
+ */
+
+#ifndef EvaRegisterCompiler_h
+#define EvaRegisterCompiler_h
+
+#include <string>
+#include <vector>
+
+#include "../parser/EvaParser.h"
+#include "../vm/EvaValue.h"
+#include "../bytecode/OpCode.h"
+#include "../disassembler/EvaDisassembler.h"
+#include "../vm/Global.h"
+#include "EvaCompiler.h"
+
+/**
+ * Register limit per frame (operands are one byte)
+ */
+#define REGISTER_LIMIT 256
+
+/**
+ * Target of an expression whose value is not used
+ */
+#define NO_TARGET -1
+
+/**
+ * Local variable bound to a register
+ */
+struct RegisterLocal {
+    std::string name;
+    uint8_t reg;
+    size_t scopeLevel;
+};
+
+/**
+ * Compiles an AST to three-operand register code.
+ *
+ * Locals and temporaries live in registers of the frame (slots relative
+ * to bp), so (+ x (* y z)) is two instructions instead of six pushes and
+ * pops.  Frame layout matches the stack tier: r0 is the function itself,
+ * r1..rN are the arguments, locals and temporaries follow.
+ *
+ * Closures (cells) are not supported: compile() returns false and the VM
+ * falls back to the stack tier.
+ */
+class EvaRegisterCompiler {
+    public:
+        EvaRegisterCompiler(std::shared_ptr<Global> global)
+            : global(global),
+              disassembler(std::make_unique<EvaDisassembler>(global)) {}
+
+        /**
+         *  Main compile API.  Returns false if the program uses
+         *  forms the register tier doesn't support.
+         */
+        bool compile(const Exp& exp) {
+            unsupportedReason_.clear();
+            codeObjects_.clear();
+
+            // Allocate new code object:
+            co = AS_CODE(createCodeObjectValue("main"));
+            main = AS_FUNCTION(ALLOC_FUNCTION(co));
+
+            locals_.clear();
+            enclosing_.clear();
+            tailCalls_.clear();
+            scopeLevel_ = 0;
+            freeReg_ = 0;
+
+            auto result = allocReg();
+            gen(exp, result);
+
+            emit(ROP_HALT);
+            emit(result);
+
+            return unsupportedReason_.empty();
+        }
+
+        /**
+         *  Why the last compile failed
+         */
+        const std::string& getUnsupportedReason() { return unsupportedReason_; }
+
+        /**
+         *  Disassemble all compilation units
+         */
+        void disassembleBytecode() {
+            for (auto& co_ : codeObjects_) {
+                disassembler->disassembleRegisters(co_);
+            }
+        }
+
+        /**
+         * Returns main function (entry point).
+         */
+        FunctionObject* getMainFunction() { return main; }
+
+        const std::vector<CodeObject*>& getCodeObjects() { return codeObjects_; }
+
+    private:
+        /**
+         *  Generates code which leaves the value of exp in register `target`,
+         *  or only its side effects for NO_TARGET.
+         */
+        void gen(const Exp& exp, int target) {
+            // Only statements handle NO_TARGET, others get a scratch register
+            if (target == NO_TARGET && !isStatement(exp)) {
+                auto mark = freeReg_;
+                gen(exp, allocReg());
+                freeReg_ = mark;
+                return;
+            }
+
+            switch (exp.type) {
+                /**
+                 *  Numbers
+                 */
+                case ExpType::NUMBER:
+                    emit(ROP_LOADK);
+                    emit(target);
+                    emit(numericConstIdx(exp.number));
+                    break;
+                /**
+                 *  Strings
+                 */
+                case ExpType::STRING:
+                    emit(ROP_LOADK);
+                    emit(target);
+                    emit(stringConstIdx(exp.string));
+                    break;
+                /**
+                 *  Symbols (variables, booleans)
+                 */
+                case ExpType::SYMBOL:
+                    if (exp.string == "true" || exp.string == "false") {
+                        emit(ROP_LOADK);
+                        emit(target);
+                        emit(booleanConstIdx(exp.string == "true"));
+                    } else {
+                        auto localReg = resolveLocal(exp.string);
+                        if (localReg != -1) {
+                            emitMove(target, localReg);
+                        } else {
+                            emit(ROP_GET_GLOBAL);
+                            emit(target);
+                            emit(globalIdx(exp.string));
+                        }
+                    }
+                    break;
+                /**
+                 *  Lists
+                 */
+                case ExpType::LIST:
+                    genList(exp, target);
+                    break;
+            }
+        }
+
+        void genList(const Exp& exp, int target) {
+            auto tag = exp.list[0];
+
+            if (tag.type != ExpType::SYMBOL) {
+                // Inline lambda call.
+                genCall(exp, target);
+                return;
+            }
+
+            auto op = tag.string;
+
+            //-----------------------------------
+            //  Binary math operations:
+            if (op == "+" || op == "-" || op == "*" || op == "/") {
+                auto mark = freeReg_;
+                auto op1 = operand(exp.list[1], &exp.list[2]);
+                auto op2 = operand(exp.list[2]);
+                emit(op == "+" ? ROP_ADD : op == "-" ? ROP_SUB : op == "*" ? ROP_MUL : ROP_DIV);
+                emit(target);
+                emit(op1);
+                emit(op2);
+                freeReg_ = mark;
+            }
+
+            //----------------------------------
+            // Compare operations: (> 5 10)
+            else if (EvaCompiler::compareOps_.count(op) != 0) {
+                auto mark = freeReg_;
+                auto op1 = operand(exp.list[1], &exp.list[2]);
+                auto op2 = operand(exp.list[2]);
+                emit(ROP_COMPARE);
+                emit(target);
+                emit(op1);
+                emit(op2);
+                emit(EvaCompiler::compareOps_[op]);
+                freeReg_ = mark;
+            }
+
+            //----------------------------------
+            // Branch instructions:
+            else if (op == "if") {
+                auto mark = freeReg_;
+                auto test = operand(exp.list[1]);
+                freeReg_ = mark;
+
+                emit(ROP_JMP_IF_FALSE);
+                emit(test);
+                auto elseJmpAddr = emitJumpOperand();
+
+                gen(exp.list[2], target);
+
+                emit(ROP_JMP);
+                auto endAddr = emitJumpOperand();
+
+                patchJumpAddress(elseJmpAddr, getOffset());
+
+                if (exp.list.size() == 4) {
+                    gen(exp.list[3], target);
+                } else if (target != NO_TARGET) {
+                    emit(ROP_LOADK);
+                    emit(target);
+                    emit(booleanConstIdx(false));
+                }
+
+                patchJumpAddress(endAddr, getOffset());
+            }
+
+            //----------------------------------
+            // While loop: (while <test> <body>)
+            else if (op == "while") {
+                auto loopStartAddr = getOffset();
+
+                auto mark = freeReg_;
+                auto test = operand(exp.list[1]);
+                freeReg_ = mark;
+
+                emit(ROP_JMP_IF_FALSE);
+                emit(test);
+                auto loopEndJmpAddr = emitJumpOperand();
+
+                // Body value is not used
+                gen(exp.list[2], NO_TARGET);
+
+                emit(ROP_JMP);
+                patchJumpAddress(emitJumpOperand(), loopStartAddr);
+
+                patchJumpAddress(loopEndJmpAddr, getOffset());
+
+                // The loop itself evaluates to the failed <test>
+                if (target != NO_TARGET) {
+                    emit(ROP_LOADK);
+                    emit(target);
+                    emit(booleanConstIdx(false));
+                }
+            }
+
+            //----------------------------------
+            // Assignment: (set <name> <value>)
+            else if (op == "set") {
+                auto varName = exp.list[1].string;
+                auto localReg = resolveLocal(varName);
+
+                if (localReg != -1) {
+                    gen(exp.list[2], localReg);
+                    emitMove(target, localReg);
+                } else {
+                    auto mark = freeReg_;
+                    auto valueReg = target == NO_TARGET ? allocReg() : target;
+                    gen(exp.list[2], valueReg);
+                    auto globalIndex = global->getGlobalIndex(varName);
+                    if (globalIndex == -1) {
+                        DIE << "Reference error: " << varName << " is not defined.";
+                    }
+                    emit(ROP_SET_GLOBAL);
+                    emit(globalOperand(globalIndex));
+                    emit(valueReg);
+                    freeReg_ = mark;
+                }
+            }
+
+            //----------------------------------
+            // Blocks:
+            else if (op == "begin") {
+                scopeLevel_++;
+                auto blockStart = freeReg_;
+
+                for (size_t i = 1; i < exp.list.size(); i++) {
+                    bool isLast = i == exp.list.size() - 1;
+                    auto& item = exp.list[i];
+
+                    if (isDeclaration(item)) {
+                        auto declReg = genDeclaration(item);
+                        if (isLast && target != NO_TARGET) {
+                            if (declReg != -1) {
+                                emitMove(target, declReg);
+                            } else {
+                                emit(ROP_GET_GLOBAL);
+                                emit(target);
+                                emit(globalIdx(item.list[1].string));
+                            }
+                        }
+                    } else {
+                        gen(item, isLast ? target : NO_TARGET);
+                    }
+                }
+
+                // Free the registers of the block locals
+                while (!locals_.empty() && locals_.back().scopeLevel == scopeLevel_) {
+                    locals_.pop_back();
+                }
+                freeReg_ = blockStart;
+                scopeLevel_--;
+            }
+
+            //----------------------------------
+            // Declarations are only allowed directly in blocks
+            else if (op == "var" || op == "def") {
+                unsupported("declaration outside of a block");
+            }
+
+            //----------------------------------
+            // Lambda expression: (lambda (a b) (+ a b))
+            else if (op == "lambda") {
+                emit(ROP_LOADK);
+                emit(target);
+                emit(compileFunction("lambda", exp.list[1], exp.list[2]));
+            }
+
+            //----------------------------------
+            // Function calls:
+            else {
+                genCall(exp, target);
+            }
+        }
+
+        /**
+         *  Compiles (var ...) or (def ...) in a block.  Returns the
+         *  register of the new local, or -1 for globals.
+         */
+        int genDeclaration(const Exp& exp) {
+            auto varName = exp.list[1].string;
+            bool isDef = isTaggedList(exp, "def");
+
+            auto valueReg = allocReg();
+
+            if (isDef) {
+                emit(ROP_LOADK);
+                emit(valueReg);
+                emit(compileFunction(varName, exp.list[2], exp.list[3]));
+            } else if (isTaggedList(exp.list[2], "lambda")) {
+                // Capture the function name from the variable:
+                emit(ROP_LOADK);
+                emit(valueReg);
+                emit(compileFunction(varName, exp.list[2].list[1], exp.list[2].list[2]));
+            } else {
+                gen(exp.list[2], valueReg);
+            }
+
+            if (isGlobalScope()) {
+                global->define(varName);
+                emit(ROP_SET_GLOBAL);
+                emit(globalOperand(global->getGlobalIndex(varName)));
+                emit(valueReg);
+                freeReg_ = valueReg;
+                return -1;
+            }
+
+            // Bound after the initializer, which still sees outer names
+            locals_.push_back({varName, valueReg, scopeLevel_});
+            return valueReg;
+        }
+
+        /**
+         *  Function call: callee in A, args in A+1..A+N
+         */
+        void genCall(const Exp& exp, int target) {
+            auto mark = freeReg_;
+
+            // Call in place if the target is the topmost temporary
+            auto inPlace = target != NO_TARGET && (size_t)(target + 1) == freeReg_ && !isLocalReg(target);
+            auto base = inPlace ? target : allocReg();
+            auto& callee = exp.list[0];
+            if (callee.type == ExpType::SYMBOL && resolveLocal(callee.string) == -1) {
+                global->checkNativeCall(callee.string, exp.list.size() - 1);
+            }
+            gen(callee, base);
+            for (size_t i = 1; i < exp.list.size(); i++) {
+                gen(exp.list[i], allocReg());
+            }
+            emit(tailCalls_.count(&exp) != 0 ? ROP_TAIL_CALL : ROP_CALL);
+            emit(base);
+            emit(exp.list.size() - 1);
+            emitMove(target, base);
+            freeReg_ = mark;
+        }
+
+        /**
+         *  Returns the register holding the value of exp: the local's own
+         *  register for local variables, a new temporary otherwise.  A
+         *  local that the `later` operand may assign is copied first.
+         */
+        uint8_t operand(const Exp& exp, const Exp* later = nullptr) {
+            if (exp.type == ExpType::SYMBOL) {
+                auto localReg = resolveLocal(exp.string);
+                if (localReg != -1 && (later == nullptr || !mayAssign(*later, exp.string))) {
+                    return localReg;
+                }
+            }
+            auto reg = allocReg();
+            gen(exp, reg);
+            return reg;
+        }
+
+        /**
+         *  Compiles a function, returns its constant index.
+         */
+        uint8_t compileFunction(const std::string& fnName, const Exp& params,
+                                const Exp& body) {
+            auto arity = params.list.size();
+
+            // Save the state of the enclosing function
+            auto prevCo = co;
+            auto prevLocals = locals_;
+            auto prevScopeLevel = scopeLevel_;
+            auto prevFreeReg = freeReg_;
+            enclosing_.push_back(prevLocals);
+
+            co = AS_CODE(createCodeObjectValue(fnName, arity));
+            locals_.clear();
+            scopeLevel_ = 0;
+            freeReg_ = 0;
+
+            // r0 is the function itself (recursive calls), then params
+            locals_.push_back({fnName, allocReg(), 0});
+            for (size_t i = 0; i < arity; i++) {
+                locals_.push_back({params.list[i].string, allocReg(), 0});
+            }
+
+            auto result = allocReg();
+            EvaCompiler::markTailCalls(body, tailCalls_);
+            gen(body, result);
+            emit(ROP_RETURN);
+            emit(result);
+
+            auto fn = ALLOC_FUNCTION(co);
+
+            // Restore the enclosing function
+            co = prevCo;
+            locals_ = prevLocals;
+            scopeLevel_ = prevScopeLevel;
+            freeReg_ = prevFreeReg;
+            enclosing_.pop_back();
+
+            co->addConst(fn);
+            return constIdx(co->constants.size() - 1);
+        }
+
+        /**
+         *  Register of a local in the current function, -1 if it's not
+         *  a local.  Locals of enclosing functions would need cells.
+         */
+        int resolveLocal(const std::string& name) {
+            for (auto i = (int)locals_.size() - 1; i >= 0; i--) {
+                if (locals_[i].name == name) {
+                    return locals_[i].reg;
+                }
+            }
+            for (auto& locals : enclosing_) {
+                for (auto& local : locals) {
+                    if (local.name == name) {
+                        unsupported("closure over '" + name + "'");
+                        return 0;
+                    }
+                }
+            }
+            return -1;
+        }
+
+        /**
+         *  Global index of a variable, which must be defined
+         */
+        uint8_t globalIdx(const std::string& name) {
+            if (!global->exists(name)) {
+                DIE << "[EvaRegisterCompiler]: Reference error: " << name;
+            }
+            return globalOperand(global->getGlobalIndex(name));
+        }
+
+        uint8_t globalOperand(int index) {
+            if (index > 255) {
+                unsupported("more than 256 globals");
+            }
+            return index;
+        }
+
+        /**
+         *  Allocates a temporary register
+         */
+        uint8_t allocReg() {
+            if (freeReg_ >= REGISTER_LIMIT) {
+                unsupported("more than 256 registers in " + co->name);
+                return 0;
+            }
+            auto reg = freeReg_++;
+            if (freeReg_ > co->registerCount) {
+                co->registerCount = freeReg_;
+            }
+            return reg;
+        }
+
+        void emitMove(int to, uint8_t from) {
+            if (to == NO_TARGET || to == from) {
+                return;
+            }
+            emit(ROP_MOVE);
+            emit(to);
+            emit(from);
+        }
+
+        void unsupported(const std::string& reason) {
+            if (unsupportedReason_.empty()) {
+                unsupportedReason_ = reason;
+            }
+        }
+
+        /**
+         * Creates a new code object.
+         */
+        EvaValue createCodeObjectValue(const std::string &name, size_t arity = 0) {
+            auto coValue = ALLOC_CODE(name, arity);
+            codeObjects_.push_back(AS_CODE(coValue));
+            return coValue;
+        }
+
+        /**
+         *  Whether a register is bound to a live local
+         */
+        bool isLocalReg(int reg) {
+            for (auto& local : locals_) {
+                if (local.reg == reg) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         *  Whether evaluating exp may assign the variable `name` (of any
+         *  scope).  Only a `set` can: closures fall back to the stack tier.
+         */
+        bool mayAssign(const Exp& exp, const std::string& name) {
+            if (exp.type != ExpType::LIST) {
+                return false;
+            }
+            if (isTaggedList(exp, "set") && exp.list[1].string == name) {
+                return true;
+            }
+            for (auto& item : exp.list) {
+                if (mayAssign(item, name)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         *  Forms which handle NO_TARGET themselves
+         */
+        bool isStatement(const Exp& exp) {
+            return isTaggedList(exp, "set") || isTaggedList(exp, "begin") ||
+                   isTaggedList(exp, "while") || isTaggedList(exp, "if");
+        }
+
+        bool isGlobalScope() { return co->name == "main" && scopeLevel_ == 1; }
+
+        bool isDeclaration(const Exp& exp) {
+            return isTaggedList(exp, "var") || isTaggedList(exp, "def");
+        }
+
+        bool isTaggedList(const Exp& exp, const std::string& tag) {
+            return exp.type == ExpType::LIST
+                && exp.list[0].type == ExpType::SYMBOL
+                && exp.list[0].string == tag;
+        }
+
+        size_t getOffset() { return co->code.size(); }
+
+        uint8_t constIdx(size_t index) {
+            if (index > 255) {
+                unsupported("more than 256 constants in " + co->name);
+            }
+            return index;
+        }
+
+        /**
+         *  Allocates a numeric constant
+         */
+        uint8_t numericConstIdx(int value) { return constIdx(numericConst(value)); }
+
+        size_t numericConst(int value) {
+            ALLOC_CONST(IS_INTEGER, AS_INTEGER, INTEGER, value);
+            return co->constants.size() - 1;
+        }
+
+        /**
+         *  Allocates a string constant
+         */
+        uint8_t stringConstIdx(const std::string& value) { return constIdx(stringConst(value)); }
+
+        size_t stringConst(const std::string& value) {
+            ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
+            return co->constants.size() - 1;
+        }
+
+        /**
+         *  Allocates a boolean constant
+         */
+        uint8_t booleanConstIdx(bool value) { return constIdx(booleanConst(value)); }
+
+        size_t booleanConst(bool value) {
+            ALLOC_CONST(IS_BOOLEAN, AS_BOOLEAN, BOOLEAN, value);
+            return co->constants.size() - 1;
+        }
+
+        void emit(uint8_t code) { co->code.push_back(code); }
+
+        /**
+         * Emits a jump offset to patch, returns its position
+         */
+        size_t emitJumpOperand() {
+            for (auto i = 0; i < 4; i++) {
+                emit(0);
+            }
+            return getOffset() - 4;
+        }
+
+        /**
+         * Patches the jump offset at `offset` to land on `address`
+         */
+        void patchJumpAddress(size_t offset, size_t address) {
+            patchJumpTarget(co->code.data(), offset, address);
+        }
+
+        /**
+         * Global object
+         */
+        std::shared_ptr<Global> global;
+
+        /**
+         * Disassembler.
+         */
+        std::unique_ptr<EvaDisassembler> disassembler;
+
+        /**
+         *  Compiling code object
+         */
+        CodeObject* co;
+
+        /**
+         *  Main entry point for function
+         */
+        FunctionObject* main = nullptr;
+
+        /**
+         *  Locals of the compiling function
+         */
+        std::vector<RegisterLocal> locals_;
+
+        /**
+         *  Locals of the enclosing functions
+         */
+        std::vector<std::vector<RegisterLocal>> enclosing_;
+
+        /**
+         *  Current block nesting
+         */
+        size_t scopeLevel_;
+
+        /**
+         *  First free register
+         */
+        size_t freeReg_;
+
+        /**
+         *  All code objects
+         */
+        std::vector<CodeObject*> codeObjects_;
+
+        /**
+         *  Calls in tail position, see EvaCompiler::markTailCalls
+         */
+        std::set<const Exp*> tailCalls_;
+
+        /**
+         *  Set when the program can't run on the register tier
+         */
+        std::string unsupportedReason_;
+};
+
+#endif
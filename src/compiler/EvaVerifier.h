@@ -0,0 +1,324 @@
+/**
+ * Bytecode verifier: checks a code object once, after compilation.
+ */
+
+#ifndef EvaVerifier_h
+#define EvaVerifier_h
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../Logger.h"
+#include "../bytecode/OpCode.h"
+#include "../vm/EvaValue.h"
+#include "../vm/Global.h"
+
+/**
+ *  EvaVerifier
+ *
+ *  Follows every path through CodeObject::code with the stack height
+ *  on it and checks that:
+ *
+ *    - instructions are known and end within the code
+ *    - jumps land on an instruction
+ *    - constant, global, cell and compare operands are in range
+ *    - locals are below the top of the stack
+ *    - no instruction pops more than the frame holds, and paths meet
+ *      with the same height
+ *    - no path falls off the end of the code
+ *
+ *  and sets CodeObject::maxStack.  The interpreter then reserves
+ *  maxStack once per frame and pushes and pops without checks.
+ */
+class EvaVerifier {
+    public:
+        EvaVerifier(std::shared_ptr<Global> global) : global(global) {}
+
+        /**
+         * Verifies `co`, entered with `height` values in its frame (the
+         * callee and its arguments); DIEs on the first error
+         */
+        void verify(CodeObject* co, size_t height) {
+            co_ = co;
+            const auto& code = co->code;
+
+            // 1. Instruction boundaries:
+            isInstruction_.assign(code.size() + 1, false);
+            for (size_t offset = 0; offset < code.size(); offset += opcodeSize(code[offset])) {
+                isInstruction_[offset] = true;
+                if (offset + opcodeSize(code[offset]) > code.size()) {
+                    DIE << at(offset) << "truncated " << opcodeToString(code[offset]);
+                }
+            }
+
+            // 2. Stack heights along every path:
+            heights_.assign(code.size(), UNVISITED);
+            entry_ = height;
+            max_ = height;
+            std::vector<size_t> pending;
+            reach(0, height, 0, pending);
+
+            while (!pending.empty()) {
+                auto offset = pending.back();
+                pending.pop_back();
+                step(offset, pending);
+            }
+
+            co->maxStack = max_ - entry_;
+        }
+
+    private:
+        /**
+         * Runs the instruction at `offset` on its stack height, queues
+         * its successors
+         */
+        void step(size_t offset, std::vector<size_t>& pending) {
+            const auto& code = co_->code;
+            auto opcode = code[offset];
+            auto height = heights_[offset];
+            auto next = offset + opcodeSize(opcode);
+            auto operand = [&](size_t index) -> size_t { return code[offset + index]; };
+
+            switch (opcode) {
+                case OP_HALT:
+                    pops(offset, height, 1);
+                    return;
+
+                case OP_RETURN:
+                    if (height != 1) {
+                        DIE << at(offset) << "returns with " << height << " values in the frame";
+                    }
+                    return;
+
+                case OP_TAIL_CALL:
+                    pops(offset, height, operand(1) + 1);
+                    return;
+
+                case OP_JMP:
+                    reach(jumpTarget(code.data(), offset + 1), height, offset, pending);
+                    return;
+
+                case OP_JMP_IF_FALSE:
+                    pops(offset, height, 1);
+                    height -= 1;
+                    reach(jumpTarget(code.data(), offset + 1), height, offset, pending);
+                    break;
+
+                case OP_JMP_IF_LT:
+                case OP_JMP_IF_GT:
+                case OP_JMP_IF_EQ:
+                case OP_JMP_IF_GE:
+                case OP_JMP_IF_LE:
+                case OP_JMP_IF_NE:
+                    pops(offset, height, 2);
+                    height -= 2;
+                    reach(jumpTarget(code.data(), offset + 1), height, offset, pending);
+                    break;
+
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_ADD_NUM:
+                case OP_ADD_STR:
+                    pops(offset, height, 2);
+                    height -= 1;
+                    break;
+
+                case OP_COMPARE:
+                case OP_LT_NUM:
+                case OP_GT_NUM:
+                case OP_EQ_NUM:
+                case OP_GE_NUM:
+                case OP_LE_NUM:
+                case OP_NE_NUM:
+                    if (operand(1) > 5) {
+                        DIE << at(offset) << "compare operator " << operand(1);
+                    }
+                    pops(offset, height, 2);
+                    height -= 1;
+                    break;
+
+                case OP_POP:
+                    pops(offset, height, 1);
+                    height -= 1;
+                    break;
+
+                case OP_CALL:
+                    pops(offset, height, operand(1) + 1);
+                    height -= operand(1);
+                    break;
+
+                case OP_WIDE:
+                    height = indexed(offset, code[offset + 1], wideOperand(code.data(), offset),
+                                     height);
+                    break;
+
+                case OP_GET_LOCAL2:
+                    local(offset, operand(1), height);
+                    local(offset, operand(2), height + 1);
+                    height += 2;
+                    break;
+
+                case OP_GET_LOCAL_CONST:
+                    local(offset, operand(1), height);
+                    constant(offset, operand(2));
+                    height += 2;
+                    break;
+
+                case OP_GET_GLOBAL_CONST:
+                    globalVar(offset, operand(1));
+                    constant(offset, operand(2));
+                    height += 2;
+                    break;
+
+                case OP_SET_LOCAL_POP:
+                    height = indexed(offset, OP_SET_LOCAL, operand(1), height) - 1;
+                    break;
+
+                case OP_SET_GLOBAL_POP:
+                    height = indexed(offset, OP_SET_GLOBAL, operand(1), height) - 1;
+                    break;
+
+                default:
+                    height = indexed(offset, opcode, operand(1), height);
+                    break;
+            }
+
+            if (next >= code.size()) {
+                DIE << at(offset) << "falls off the end of the code";
+            }
+            reach(next, height, offset, pending);
+        }
+
+        /**
+         * Instructions with an index operand, one byte or OP_WIDE:
+         * checks the index, returns the height after
+         */
+        size_t indexed(size_t offset, uint8_t opcode, size_t index, size_t height) {
+            switch (opcode) {
+                case OP_CONST:
+                    constant(offset, index);
+                    return height + 1;
+
+                case OP_GET_GLOBAL:
+                    globalVar(offset, index);
+                    return height + 1;
+
+                case OP_SET_GLOBAL:
+                    globalVar(offset, index);
+                    pops(offset, height, 1);
+                    return height;
+
+                case OP_GET_LOCAL:
+                    local(offset, index, height);
+                    return height + 1;
+
+                case OP_SET_LOCAL:
+                    pops(offset, height, 1);
+                    local(offset, index, height);
+                    return height;
+
+                case OP_GET_CELL:
+                case OP_LOAD_CELL:
+                    cell(offset, index);
+                    return height + 1;
+
+                case OP_SET_CELL:
+                    cell(offset, index);
+                    pops(offset, height, 1);
+                    return height;
+
+                case OP_SCOPE_EXIT:
+                    pops(offset, height, index + 1);
+                    return height - index;
+
+                case OP_MAKE_FUNCTION:
+                    pops(offset, height, index + 1);
+                    return height - index;
+
+                default:
+                    DIE << at(offset) << "unexpected " << opcodeToString(opcode);
+            }
+            return height;
+        }
+
+        /**
+         * Enters `offset` with `height`, first time queued, else checked
+         * against the height already there
+         */
+        void reach(size_t offset, size_t height, size_t from, std::vector<size_t>& pending) {
+            if (offset >= co_->code.size() || !isInstruction_[offset]) {
+                DIE << at(from) << "jumps to " << offset << ", not an instruction";
+            }
+            if (heights_[offset] == UNVISITED) {
+                heights_[offset] = height;
+                max_ = std::max(max_, height);
+                pending.push_back(offset);
+            } else if (heights_[offset] != height) {
+                DIE << at(from) << "reaches " << offset << " with " << height
+                    << " values, other paths with " << heights_[offset];
+            }
+        }
+
+        void pops(size_t offset, size_t height, size_t count) {
+            if (height < count) {
+                DIE << at(offset) << "pops " << count << " of " << height << " values";
+            }
+        }
+
+        void local(size_t offset, size_t index, size_t height) {
+            if (index >= height) {
+                DIE << at(offset) << "local " << index << " above the top of the stack ("
+                    << height << ")";
+            }
+        }
+
+        void constant(size_t offset, size_t index) {
+            if (index >= co_->constants.size()) {
+                DIE << at(offset) << "constant " << index << " of " << co_->constants.size();
+            }
+        }
+
+        void globalVar(size_t offset, size_t index) {
+            if (index >= global->globals.size()) {
+                DIE << at(offset) << "global " << index << " of " << global->globals.size();
+            }
+        }
+
+        void cell(size_t offset, size_t index) {
+            if (index >= co_->cellNames.size()) {
+                DIE << at(offset) << "cell " << index << " of " << co_->cellNames.size();
+            }
+        }
+
+        /**
+         * Error prefix: "verify square at 1A: "
+         */
+        std::string at(size_t offset) {
+            std::stringstream ss;
+            ss << "verify " << co_->name << " at " << std::uppercase << std::hex << offset << ": ";
+            return ss.str();
+        }
+
+        static constexpr size_t UNVISITED = (size_t)-1;
+
+        std::shared_ptr<Global> global;
+
+        CodeObject* co_ = nullptr;
+
+        /**
+         * Instruction starts, and the stack height on entry to each
+         * instruction reached
+         */
+        std::vector<bool> isInstruction_;
+        std::vector<size_t> heights_;
+
+        size_t entry_ = 0;
+        size_t max_ = 0;
+};
+
+#endif
@@ -8,6 +8,8 @@
 #include <map>
 #include <set>
 
+#include "../parser/EvaParser.h"
+
 /**
  * Scope type
  */
@@ -60,13 +62,41 @@ struct Scope {
      */
     std::set<std::string> cells;
 
+    /**
+     * Names declared in this scope: vars, params and functions
+     */
+    std::set<std::string> declared;
+
+    /**
+     * Functions declared in this scope (def, or var of a lambda), by
+     * name.  A function also declares itself in its own scope.
+     */
+    std::map<std::string, const Exp*> functions;
+
     /**
      * Registers a local
      */
     void addLocal(const std::string& name) {
+        declared.insert(name);
         allocInfo[name] = (type == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL);
     }
 
+    /**
+     * Scope declaring `name` as seen from here, nullptr if the program
+     * doesn't (natives).  `crossed` tells whether the lookup left a
+     * function on the way.
+     */
+    Scope* declaring(const std::string& name, bool& crossed) {
+        crossed = false;
+        for (auto scope = this; scope != nullptr; scope = scope->parent.get()) {
+            if (scope->declared.count(name) != 0) {
+                return scope;
+            }
+            crossed |= scope->type == ScopeType::FUNCTION;
+        }
+        return nullptr;
+    }
+
     /**
      * Registers own cell
      */
@@ -83,6 +113,18 @@ struct Scope {
         allocInfo[name] = AllocType::CELL;
     }
 
+    /**
+     * Whether `name` is declared in this scope or an enclosing one
+     */
+    bool defines(const std::string& name) {
+        for (auto scope = this; scope != nullptr; scope = scope->parent.get()) {
+            if (scope->allocInfo.count(name) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     /** 
      * Potentially promotes a variable from local to cell
      */
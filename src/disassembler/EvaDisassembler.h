@@ -7,6 +7,7 @@
 #include "../bytecode/OpCode.h"
 #include "../vm/EvaValue.h"
 #include "../vm/Global.h"
+#include "../vm/TypeFeedback.h"
 
 /**
  *  EvaDisassembler
@@ -16,19 +17,137 @@ class EvaDisassembler {
         EvaDisassembler(std::shared_ptr<Global> global) : global(global) {}
         
         /**
-         * Disassembles a code unit
+         * Disassembles a code unit, with its type feedback if collected
          */ 
         void disassemble(CodeObject* co) {
             std::cout << "\n----------------Disassembly: " << co->name
                     << " -----------------\n\n";
             size_t offset = 0;
             while (offset < co->code.size()) {
-                offset = disassembleInstruction(co, offset);
+                auto next = disassembleInstruction(co, offset);
+                if (!co->feedback.empty() && co->feedback[offset].count != 0) {
+                    std::cout << "  ; " << feedbackToString(co->feedback[offset], co->code[offset]);
+                }
                 std::cout << "\n";
+                offset = next;
             } 
         }
 
+        /**
+         * Disassembles a register tier code unit
+         */
+        void disassembleRegisters(CodeObject* co) {
+            std::cout << "\n----------------Disassembly (registers): " << co->name
+                    << "/" << co->registerCount << " -----------------\n\n";
+            size_t offset = 0;
+            while (offset < co->code.size()) {
+                offset = disassembleRegisterInstruction(co, offset);
+                std::cout << "\n";
+            }
+        }
+
     private:
+        /**
+         * Disassembles individual register tier instruction
+         */
+        size_t disassembleRegisterInstruction(CodeObject* co, size_t offset) {
+            std::ios_base::fmtflags f(std::cout.flags());
+
+            //Print bytecode offset:
+            std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
+                << std::setw(4) << offset << "           ";
+            std::cout.flags(f);
+
+            auto opcode = co->code[offset];
+
+            switch (opcode) {
+                case ROP_HALT:
+                case ROP_RETURN:
+                    return disassembleRegisterOperands(co, opcode, offset, 1);
+                case ROP_MOVE:
+                    return disassembleRegisterOperands(co, opcode, offset, 2);
+                case ROP_CALL:
+                case ROP_TAIL_CALL: {
+                    dumpBytes(co, offset, 3);
+                    printOpCode(opcode);
+                    std::cout << "r" << (int)co->code[offset + 1] << ", "
+                              << (int)co->code[offset + 2] << " args";
+                    return offset + 3;
+                }
+                case ROP_ADD:
+                case ROP_SUB:
+                case ROP_MUL:
+                case ROP_DIV:
+                    return disassembleRegisterOperands(co, opcode, offset, 3);
+                case ROP_LOADK: {
+                    auto next = disassembleRegisterOperands(co, opcode, offset, 1);
+                    auto constIndex = co->code[offset + 2];
+                    std::cout << ", k" << (int)constIndex << " ("
+                              << evaValueToConstantString(co->constants[constIndex]) << ")";
+                    return next + 1;
+                }
+                case ROP_COMPARE: {
+                    auto next = disassembleRegisterOperands(co, opcode, offset, 3);
+                    std::cout << " (" << inverseCompareOps_[co->code[offset + 4]] << ")";
+                    return next + 1;
+                }
+                case ROP_GET_GLOBAL: {
+                    dumpBytes(co, offset, 3);
+                    printOpCode(opcode);
+                    auto globalIndex = co->code[offset + 2];
+                    std::cout << "r" << (int)co->code[offset + 1] << ", g" << (int)globalIndex
+                              << " (" << global->get(globalIndex).name << ")";
+                    return offset + 3;
+                }
+                case ROP_SET_GLOBAL: {
+                    dumpBytes(co, offset, 3);
+                    printOpCode(opcode);
+                    auto globalIndex = co->code[offset + 1];
+                    std::cout << "g" << (int)globalIndex << " (" << global->get(globalIndex).name
+                              << "), r" << (int)co->code[offset + 2];
+                    return offset + 3;
+                }
+                case ROP_JMP: {
+                    dumpBytes(co, offset, 5);
+                    printOpCode(opcode);
+                    printAddress(jumpTarget(co->code.data(), offset + 1));
+                    return offset + 5;
+                }
+                case ROP_JMP_IF_FALSE: {
+                    dumpBytes(co, offset, 6);
+                    printOpCode(opcode);
+                    std::cout << "r" << (int)co->code[offset + 1] << ", ";
+                    printAddress(jumpTarget(co->code.data(), offset + 2));
+                    return offset + 6;
+                }
+                default:
+                    DIE << "disassembleRegisterInstruction: no disassembly for "
+                        << opcodeToString(opcode);
+            }
+            return 0;
+        }
+
+        /**
+         * Disassembles a register instruction with `count` register operands
+         */
+        size_t disassembleRegisterOperands(CodeObject* co, uint8_t opcode, size_t offset,
+                                           size_t count) {
+            auto size = 1 + count + (opcode == ROP_LOADK || opcode == ROP_COMPARE ? 1 : 0);
+            dumpBytes(co, offset, size);
+            printOpCode(opcode);
+            for (size_t i = 0; i < count; i++) {
+                std::cout << (i == 0 ? "r" : ", r") << (int)co->code[offset + 1 + i];
+            }
+            return offset + 1 + count;
+        }
+
+        void printAddress(size_t address) {
+            std::ios_base::fmtflags f(std::cout.flags());
+            std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
+                << std::setw(4) << (int)address;
+            std::cout.flags(f);
+        }
+
         /**
          * Disassembles individual instruction
          */ 
@@ -49,16 +168,31 @@ class EvaDisassembler {
                 case OP_DIV:
                 case OP_POP:
                 case OP_RETURN:
+                case OP_ADD_NUM:
+                case OP_ADD_STR:
                     return disassembleSimple(co, opcode, offset);
                 case OP_SCOPE_EXIT:
                 case OP_CALL:
+                case OP_TAIL_CALL:
                     return disassembleWord(co, opcode, offset);
                 case OP_CONST:
                     return disassembleConst(co, opcode, offset);
                 case OP_COMPARE:
+                case OP_LT_NUM:
+                case OP_GT_NUM:
+                case OP_EQ_NUM:
+                case OP_GE_NUM:
+                case OP_LE_NUM:
+                case OP_NE_NUM:
                     return disassembleCompare(co, opcode, offset);
                 case OP_JMP_IF_FALSE:
                 case OP_JMP:
+                case OP_JMP_IF_LT:
+                case OP_JMP_IF_GT:
+                case OP_JMP_IF_EQ:
+                case OP_JMP_IF_GE:
+                case OP_JMP_IF_LE:
+                case OP_JMP_IF_NE:
                     return disassembleJump(co, opcode, offset);
                 case OP_GET_GLOBAL:
                 case OP_SET_GLOBAL:
@@ -72,6 +206,14 @@ class EvaDisassembler {
                     return disassembleCell(co, opcode, offset);
                 case OP_MAKE_FUNCTION:
                     return disassembleMakeFunction(co, opcode, offset); 
+                case OP_WIDE:
+                    return disassembleWide(co, offset);
+                case OP_GET_LOCAL2:
+                case OP_GET_LOCAL_CONST:
+                case OP_GET_GLOBAL_CONST:
+                case OP_SET_LOCAL_POP:
+                case OP_SET_GLOBAL_POP:
+                    return disassembleFused(co, opcode, offset);
                 default:
                     DIE << "disassembleInstruction: no disassembly for "
                         << opcodeToString(opcode);
@@ -155,6 +297,74 @@ class EvaDisassembler {
             return disassembleWord(co, opcode, offset);
         }
 
+        /**
+         * Disassembles a wide instruction: the prefixed opcode and its
+         * two-byte operand, annotated as in the one-byte form
+         */
+        size_t disassembleWide(CodeObject* co, size_t offset) {
+            dumpBytes(co, offset, 4);
+            printOpCode(OP_WIDE);
+            auto opcode = co->code[offset + 1];
+            auto operand = wideOperand(co->code.data(), offset);
+            std::cout << opcodeToString(opcode) << " " << operand;
+            switch (opcode) {
+                case OP_CONST:
+                    std::cout << " (" << evaValueToConstantString(co->constants[operand]) << ")";
+                    break;
+                case OP_GET_GLOBAL:
+                case OP_SET_GLOBAL:
+                    std::cout << " (" << global->get(operand).name << ")";
+                    break;
+                case OP_GET_LOCAL:
+                case OP_SET_LOCAL:
+                    std::cout << " (" << co->locals[operand].name << ")";
+                    break;
+                case OP_GET_CELL:
+                case OP_SET_CELL:
+                case OP_LOAD_CELL:
+                    std::cout << " (" << co->cellNames[operand] << ")";
+                    break;
+            }
+            return offset + 4;
+        }
+
+        /**
+         * Disassembles a superinstruction, operands annotated as in
+         * the instructions it replaces
+         */
+        size_t disassembleFused(CodeObject* co, uint8_t opcode, size_t offset) {
+            dumpBytes(co, offset, opcodeSize(opcode));
+            printOpCode(opcode);
+            auto a = co->code[offset + 1];
+            switch (opcode) {
+                case OP_GET_LOCAL2: {
+                    auto b = co->code[offset + 2];
+                    std::cout << (int)a << " (" << co->locals[a].name << "), "
+                              << (int)b << " (" << co->locals[b].name << ")";
+                    break;
+                }
+                case OP_GET_LOCAL_CONST: {
+                    auto k = co->code[offset + 2];
+                    std::cout << (int)a << " (" << co->locals[a].name << "), "
+                              << (int)k << " (" << evaValueToConstantString(co->constants[k]) << ")";
+                    break;
+                }
+                case OP_GET_GLOBAL_CONST: {
+                    auto k = co->code[offset + 2];
+                    std::cout << (int)a << " (" << global->get(a).name << "), "
+                              << (int)k << " (" << evaValueToConstantString(co->constants[k]) << ")";
+                    break;
+                }
+                case OP_SET_LOCAL_POP:
+                    std::cout << (int)a << " (" << co->locals[a].name << ")";
+                    break;
+                case OP_SET_GLOBAL_POP:
+                    std::cout << (int)a << " (" << global->get(a).name << ")";
+                    break;
+            }
+            return offset + opcodeSize(opcode);
+        }
+
         /**
          * Disassembles individual instruction
          */ 
@@ -193,20 +403,16 @@ class EvaDisassembler {
         }
 
         /**
-         * Disassembles conditional jump
+         * Disassembles a jump, showing the offset it lands on
          */ 
         size_t disassembleJump(CodeObject* co, uint8_t opcode, size_t offset) {
-            dumpBytes(co, offset, 3);
+            dumpBytes(co, offset, 5);
             printOpCode(opcode);
-            uint16_t address = readWordAtOffset(co, offset + 1);
+            auto address = jumpTarget(co->code.data(), offset + 1);
             std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
-                << std::setw(4) << (int)address << " ";
-
-            return offset + 3;
-        }
+                << std::setw(4) << address << " ";
 
-        uint16_t readWordAtOffset(CodeObject* co, size_t offset) {
-            return (uint16_t)((co->code[offset] << 8) | co->code[offset + 1]);
+            return offset + 5;
         }
 
         /**
@@ -0,0 +1,294 @@
+/**
+ * Garbage collector: mark-sweep heap, copying nursery
+ */
+
+#ifndef EvaCollector_h
+#define EvaCollector_h
+
+#include <vector>
+
+#include "../Logger.h"
+#include "../vm/EvaValue.h"
+
+/**
+ *  EvaCollector
+ *
+ *  The VM marks its roots with markValue/markObject, then `trace`
+ *  marks everything reachable from them and `sweep` frees the rest of
+ *  the heap.  Marked objects wait on a gray list instead of being
+ *  traced recursively, so long chains (closures over cells over
+ *  closures) don't grow the C++ stack.
+ *
+ *  `scavenge` is the minor collection: young objects reachable from
+ *  the roots or the remembered objects are copied to the heap, the
+ *  references to them updated.  Full collections scavenge first, so
+ *  marking never sees a young object.
+ *
+ *  Incremental collections use the same tri-color scheme a slice at a
+ *  time: unmarked objects are white, marked ones on the gray list gray,
+ *  the others black.  `mark` traces a budget of gray objects, and
+ *  `beginSweep`/`sweepSome` sweep a budget of objects.  Between slices
+ *  the write barrier shades what the program stores into black objects,
+ *  new objects are allocated black, and promoted ones gray.
+ */
+class EvaCollector {
+    public:
+        void markValue(const EvaValue& value) {
+            if (IS_OBJECT(value)) {
+                markObject(AS_OBJECT(value));
+            }
+        }
+
+        void markObject(Object* object) {
+            if (object == nullptr || object->marked || object->young) {
+                return;
+            }
+            object->marked = true;
+            gray_.push_back(object);
+        }
+
+        /**
+         * Marks the objects reachable from the gray ones
+         */
+        void trace() {
+            while (!gray_.empty()) {
+                auto object = gray_.back();
+                gray_.pop_back();
+                traceObject(object);
+            }
+        }
+
+        /**
+         * Traces up to `budget` gray objects of `heap`, the ones the
+         * write barrier shaded included; true once none are left
+         */
+        bool mark(Heap& heap, size_t budget) {
+            gray_.insert(gray_.end(), heap.shaded.begin(), heap.shaded.end());
+            heap.shaded.clear();
+            while (!gray_.empty() && budget > 0) {
+                auto object = gray_.back();
+                gray_.pop_back();
+                traceObject(object);
+                budget--;
+            }
+            return gray_.empty();
+        }
+
+        /**
+         * Frees the unmarked objects of `heap`, calling `onFree` on
+         * each first, and clears the marks of the others
+         */
+        template <typename OnFree>
+        void sweep(Heap& heap, OnFree onFree) {
+            beginSweep(heap, onFree);
+            sweepSome(heap, onFree, (size_t)-1);
+        }
+
+        /**
+         * Sweeps the head of the list up to the first survivor.  Objects
+         * linked later go before it, out of this sweep.
+         */
+        template <typename OnFree>
+        void beginSweep(Heap& heap, OnFree onFree) {
+            while (heap.objects != nullptr && !heap.objects->marked) {
+                auto object = heap.objects;
+                heap.objects = object->next;
+                onFree(object);
+                heap.free(object);
+            }
+            sweepLink_ = nullptr;
+            if (heap.objects != nullptr) {
+                heap.objects->marked = false;
+                sweepLink_ = &heap.objects->next;
+            }
+        }
+
+        /**
+         * Sweeps up to `budget` more objects; true at the end of the list
+         */
+        template <typename OnFree>
+        bool sweepSome(Heap& heap, OnFree onFree, size_t budget) {
+            while (sweepLink_ != nullptr && *sweepLink_ != nullptr && budget > 0) {
+                auto object = *sweepLink_;
+                if (object->marked) {
+                    object->marked = false;
+                    sweepLink_ = &object->next;
+                } else {
+                    *sweepLink_ = object->next;
+                    onFree(object);
+                    heap.free(object);
+                }
+                budget--;
+            }
+            return sweepLink_ == nullptr || *sweepLink_ == nullptr;
+        }
+
+        /**
+         * Empties the nursery of `heap`.  `visitRoots` is called with a
+         * function updating an EvaValue and one updating an object
+         * pointer, and passes them every root.
+         */
+        template <typename VisitRoots>
+        void scavenge(Heap& heap, VisitRoots visitRoots) {
+            heap_ = &heap;
+            visitRoots([this](EvaValue& value) { forwardValue(value); },
+                       [this](auto& object) { forwardObject(object); });
+
+            for (auto object : heap.remembered) {
+                object->remembered = false;
+                forwardReferences(object);
+            }
+            heap.remembered.clear();
+
+            while (!copies_.empty()) {
+                auto object = copies_.back();
+                copies_.pop_back();
+                forwardReferences(object);
+            }
+
+            // The young objects left behind: copied, or dead
+            auto& nursery = heap.nursery;
+            for (auto slot = nursery.start; slot < nursery.top;) {
+                auto object = (Object*)slot;
+                slot += Nursery::slotSize(object->type);
+                if (object->next == nullptr) {
+                    heap.stats.bytesFreed += Heap::objectSize(object);
+                    heap.stats.objectsFreed++;
+                }
+                Heap::destroy(object);
+            }
+            nursery.top = nursery.start;
+            nursery.bytes = 0;
+        }
+
+    private:
+        /**
+         * Objects marked, their references not yet
+         */
+        std::vector<Object*> gray_;
+
+        /**
+         * Next link to sweep
+         */
+        Object** sweepLink_ = nullptr;
+
+        /**
+         * Heap being scavenged, and the copies whose references are not
+         * updated yet
+         */
+        Heap* heap_ = nullptr;
+        std::vector<Object*> copies_;
+
+        void forwardValue(EvaValue& value) {
+            if (IS_OBJECT(value) && AS_OBJECT(value)->young) {
+                value = OBJECT(promote(AS_OBJECT(value)));
+            }
+        }
+
+        template <typename T>
+        void forwardObject(T*& object) {
+            if (object != nullptr && object->young) {
+                object = (T*)promote(object);
+            }
+        }
+
+        /**
+         * The heap copy of a young object, made on first use
+         */
+        Object* promote(Object* object) {
+            if (object->next != nullptr) {
+                return object->next;
+            }
+            Object* copy = nullptr;
+            switch (object->type) {
+                case ObjectType::STRING:
+                    copy = new StringObject(std::move(*(StringObject*)object));
+                    break;
+                case ObjectType::FUNCTION:
+                    copy = new FunctionObject(std::move(*(FunctionObject*)object));
+                    break;
+                case ObjectType::CELL:
+                    copy = new CellObject(std::move(*(CellObject*)object));
+                    break;
+                default:
+                    DIE << "young object of type " << (int)object->type;
+            }
+            copy->young = false;
+            copy->marked = heap_->phase == GCPhase::MARK;
+            if (copy->marked) {
+                heap_->shaded.push_back(copy);
+            }
+            heap_->link(copy);
+            heap_->stats.bytesPromoted += Heap::objectSize(copy);
+            heap_->stats.objectsPromoted++;
+            object->next = copy;
+            copies_.push_back(copy);
+            return copy;
+        }
+
+        /**
+         * Updates the references of `object` to young objects
+         */
+        void forwardReferences(Object* object) {
+            switch (object->type) {
+                case ObjectType::FUNCTION:
+                    for (auto& cell : ((FunctionObject*)object)->cells) {
+                        forwardObject(cell);
+                    }
+                    break;
+
+                case ObjectType::CODE: {
+                    auto co = (CodeObject*)object;
+                    for (auto& constant : co->constants) {
+                        forwardValue(constant);
+                    }
+                    for (auto& slot : co->feedback) {
+                        forwardObject(slot.callee);
+                    }
+                    break;
+                }
+
+                case ObjectType::CELL:
+                    forwardValue(((CellObject*)object)->value);
+                    break;
+
+                case ObjectType::STRING:
+                case ObjectType::NATIVE:
+                    break;
+            }
+        }
+
+        void traceObject(Object* object) {
+            switch (object->type) {
+                case ObjectType::FUNCTION: {
+                    auto function = (FunctionObject*)object;
+                    markObject(function->co);
+                    for (auto cell : function->cells) {
+                        markObject(cell);
+                    }
+                    break;
+                }
+
+                case ObjectType::CODE: {
+                    auto co = (CodeObject*)object;
+                    for (const auto& constant : co->constants) {
+                        markValue(constant);
+                    }
+                    for (const auto& slot : co->feedback) {
+                        markObject(slot.callee);
+                    }
+                    break;
+                }
+
+                case ObjectType::CELL:
+                    markValue(((CellObject*)object)->value);
+                    break;
+
+                case ObjectType::STRING:
+                case ObjectType::NATIVE:
+                    break;
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * Baseline JIT: stack bytecode to x86-64
+ */
+
+#ifndef EvaJit_h
+#define EvaJit_h
+
+#include "JitEmitter.h"
+
+#ifdef EVA_JIT
+
+#include <map>
+
+/**
+ *  EvaJit
+ *
+ *  Translates a CodeObject instruction by instruction (see JitEmitter
+ *  for the register and value conventions).  Numeric instructions run
+ *  inline behind type guards; a failed guard or any other opcode
+ *  (calls, returns, cells, strings) exits to the interpreter at that
+ *  instruction.
+ */
+class EvaJit : protected JitEmitter {
+    public:
+        /**
+         * Compiles `co`; the code is owned by the JIT
+         */
+        JitCode* compile(CodeObject* co) {
+            a = X86Assembler();
+            const auto& code = co->code;
+            std::vector<uint32_t> entries(code.size() + 1, 0);
+
+            // Jumps to bytecode offsets, and exit jumps by bytecode offset
+            std::vector<std::pair<size_t, size_t>> jumps;
+            std::map<size_t, std::vector<size_t>> exits;
+
+            emitEntry();
+
+            for (size_t offset = 0; offset < code.size(); offset += opcodeSize(code[offset])) {
+                entries[offset] = a.size();
+                auto opcode = code[offset];
+
+                switch (opcode) {
+                    case OP_ADD:
+                    case OP_ADD_NUM:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV:
+                        guardNumbers();
+                        arithmetic(opcode);
+                        break;
+
+                    case OP_COMPARE:
+                    case OP_LT_NUM:
+                    case OP_GT_NUM:
+                    case OP_EQ_NUM:
+                    case OP_GE_NUM:
+                    case OP_LE_NUM:
+                    case OP_NE_NUM:
+                        guardNumbers();
+                        compareNumbers(code[offset + 1]);
+                        storeBoolean(-2 * VALUE_SIZE);
+                        a.subImm(RBX, VALUE_SIZE);
+                        break;
+
+                    case OP_JMP_IF_FALSE:
+                        jumps.push_back({popJumpIfFalse(), jumpTarget(code.data(), offset + 1)});
+                        break;
+
+                    case OP_JMP_IF_LT:
+                    case OP_JMP_IF_GT:
+                    case OP_JMP_IF_EQ:
+                    case OP_JMP_IF_GE:
+                    case OP_JMP_IF_LE:
+                    case OP_JMP_IF_NE:
+                        // Jumps unless the opposite relation holds
+                        guardNumbers();
+                        compareNumbers((opcode - OP_JMP_IF_LT + 3) % 6);
+                        a.subImm(RBX, 2 * VALUE_SIZE);
+                        a.testByte(RAX, RAX);
+                        jumps.push_back({a.jcc(CC_E), jumpTarget(code.data(), offset + 1)});
+                        break;
+
+                    case OP_JMP:
+                        jumps.push_back({a.jmp(), jumpTarget(code.data(), offset + 1)});
+                        break;
+
+                    default:
+                        if (!emitDataMove(co, offset)) {
+                            exitAlways();
+                        }
+                        break;
+                }
+
+                auto taken = takeExits();
+                if (!taken.empty()) {
+                    auto& list = exits[offset];
+                    list.insert(list.end(), taken.begin(), taken.end());
+                }
+            }
+
+            for (auto& jump : jumps) {
+                a.bind(jump.first, entries[jump.second]);
+            }
+
+            // Exit stubs: the bytecode offset in eax, then the common exit
+            std::vector<size_t> exitJumps;
+            for (auto& exit : exits) {
+                for (auto position : exit.second) {
+                    a.bind(position, a.size());
+                }
+                a.movImm(RAX, exit.first);
+                exitJumps.push_back(a.jmp());
+            }
+
+            auto commonExit = a.size();
+            emitExit();
+
+            for (auto position : exitJumps) {
+                a.bind(position, commonExit);
+            }
+
+            codes_.push_back(std::make_unique<JitCode>(a.code, std::move(entries)));
+            return codes_.back().get();
+        }
+
+        /**
+         * Unmaps `jitCode` if it's ours: its code object was collected
+         */
+        void release(JitCode* jitCode) {
+            codes_.erase(std::remove_if(codes_.begin(), codes_.end(),
+                                        [&](const auto& code) { return code.get() == jitCode; }),
+                         codes_.end());
+        }
+
+        /**
+         * Executable memory in use
+         */
+        size_t codeSize() {
+            size_t total = 0;
+            for (auto& code : codes_) {
+                total += code->size();
+            }
+            return total;
+        }
+
+    private:
+        /**
+         * Compiled code, one mapping per CodeObject
+         */
+        std::vector<std::unique_ptr<JitCode>> codes_;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,542 @@
+/**
+ * Copy-and-patch compiler: native code from per-opcode stencils
+ */
+
+#ifndef EvaStencils_h
+#define EvaStencils_h
+
+#include "JitEmitter.h"
+
+#ifdef EVA_JIT
+
+#include <array>
+
+/**
+ * A field of a stencil filled in per instruction
+ */
+enum class HoleKind {
+    /**
+     * imm32/disp32: operand byte * scale + bias
+     */
+    OPERAND,
+
+    /**
+     * imm64: 8-byte word at `bias` of the constant the operand indexes
+     */
+    CONST,
+
+    /**
+     * rel32: the instruction's jump target
+     */
+    TARGET,
+
+    /**
+     * rel32: exit to the interpreter at the instruction
+     */
+    EXIT,
+};
+
+struct Hole {
+    HoleKind kind;
+
+    /**
+     * Position in the stencil
+     */
+    size_t position;
+
+    /**
+     * Operand byte, counted from the opcode
+     */
+    uint8_t operand;
+
+    int32_t scale;
+    int32_t bias;
+};
+
+/**
+ * Machine code of one opcode, with holes for its operands
+ */
+struct Stencil {
+    std::vector<uint8_t> code;
+    std::vector<Hole> holes;
+};
+
+/**
+ *  EvaStencils
+ *
+ *  The stencil of every opcode is generated once per process, with the
+ *  same emitters as the baseline JIT (JitEmitter) but displacements and
+ *  immediates left as holes.  Compiling a CodeObject is then a copy of
+ *  each instruction's stencil and a patch of its holes: no instruction
+ *  selection or encoding per instruction, so code objects are compiled
+ *  on their first call instead of once hot.
+ *
+ *  Opcodes the interpreter implements out of line (string add and
+ *  compare, cells, closures) call helpers with the same semantics
+ *  instead of exiting.  Calls and returns exit to the interpreter.
+ */
+class EvaStencils {
+    public:
+        /**
+         * Compiles `co`; the code is owned by the compiler
+         */
+        JitCode* compile(CodeObject* co) {
+            auto& library = getLibrary();
+            const auto& code = co->code;
+            std::vector<uint32_t> entries(code.size() + 1, 0);
+
+            std::vector<uint8_t> out(library.entry.code);
+            out.reserve(code.size() * 32);
+
+            // (position, bytecode offset) of jumps and exits
+            std::vector<std::pair<size_t, size_t>> jumps;
+            std::vector<std::pair<size_t, size_t>> exits;
+
+            for (size_t offset = 0; offset < code.size(); offset += opcodeSize(code[offset])) {
+                entries[offset] = out.size();
+                auto& stencil = library.select(code, offset);
+
+                auto base = out.size();
+                out.insert(out.end(), stencil.code.begin(), stencil.code.end());
+
+                // OP_WIDE runs the stencil of the prefixed opcode, whose
+                // one operand is the two-byte one
+                auto wide = code[offset] == OP_WIDE;
+                auto operand = [&](uint8_t index) -> size_t {
+                    return wide ? wideOperand(code.data(), offset) : code[offset + index];
+                };
+
+                for (auto& hole : stencil.holes) {
+                    auto position = base + hole.position;
+                    switch (hole.kind) {
+                        case HoleKind::OPERAND: {
+                            int32_t value = operand(hole.operand) * hole.scale + hole.bias;
+                            std::memcpy(&out[position], &value, 4);
+                            break;
+                        }
+                        case HoleKind::CONST: {
+                            auto& value = co->constants[operand(hole.operand)];
+                            std::memcpy(&out[position], (const char*)&value + hole.bias, 8);
+                            break;
+                        }
+                        case HoleKind::TARGET:
+                            jumps.push_back({position, jumpTarget(code.data(), offset + 1)});
+                            break;
+                        case HoleKind::EXIT:
+                            exits.push_back({position, offset});
+                            break;
+                    }
+                }
+            }
+
+            for (auto& jump : jumps) {
+                patchRel32(out, jump.first, entries[jump.second]);
+            }
+
+            // Exit stubs, one per instruction that can exit:
+            std::vector<size_t> stubJumps;
+            size_t stubOffset = SIZE_MAX;
+            size_t stub = 0;
+            for (auto& exit : exits) {
+                if (exit.second != stubOffset) {
+                    stubOffset = exit.second;
+                    stub = out.size();
+                    out.insert(out.end(), library.exitStub.code.begin(),
+                               library.exitStub.code.end());
+                    uint32_t value = stubOffset;
+                    std::memcpy(&out[stub + library.exitStub.holes[0].position], &value, 4);
+                    stubJumps.push_back(stub + library.exitStub.holes[1].position);
+                }
+                patchRel32(out, exit.first, stub);
+            }
+
+            auto commonExit = out.size();
+            out.insert(out.end(), library.exit.code.begin(), library.exit.code.end());
+            for (auto position : stubJumps) {
+                patchRel32(out, position, commonExit);
+            }
+
+            codes_.push_back(std::make_unique<JitCode>(out, std::move(entries)));
+            return codes_.back().get();
+        }
+
+        /**
+         * Unmaps `jitCode` if it's ours: its code object was collected
+         */
+        void release(JitCode* jitCode) {
+            codes_.erase(std::remove_if(codes_.begin(), codes_.end(),
+                                        [&](const auto& code) { return code.get() == jitCode; }),
+                         codes_.end());
+        }
+
+    private:
+        /**
+         * Compiled code, one mapping per CodeObject
+         */
+        std::vector<std::unique_ptr<JitCode>> codes_;
+
+        static void patchRel32(std::vector<uint8_t>& out, size_t position, size_t target) {
+            int32_t rel = (int32_t)(target - (position + 4));
+            std::memcpy(&out[position], &rel, 4);
+        }
+
+        // -------------------------------------------------------
+        // Helpers, with the semantics of the interpreter handlers
+
+        static void addValues(JitState* state) {
+            state->safepoint(state);
+            auto op2 = *--state->sp;
+            auto op1 = *--state->sp;
+            if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
+                *state->sp++ = addNumbers(op1, op2);
+            } else if (IS_STRING(op1) && IS_STRING(op2)) {
+                *state->sp++ = ALLOC_STRING(AS_CPPSTRING(op1) + AS_CPPSTRING(op2));
+            } else {
+                DIE << "OP_ADD: incompatible operands: " << op1 << ", " << op2;
+            }
+        }
+
+        static void compareStrings(JitState* state, uint32_t op) {
+            auto op2 = *--state->sp;
+            auto op1 = *--state->sp;
+            *state->sp++ = BOOLEAN(compareObjects(op, op1, op2));
+        }
+
+        static CellObject* cellAt(JitState* state, uint32_t index) {
+            auto& cell = state->cells[index];
+            if (cell == nullptr) {
+                state->safepoint(state);
+                cell = AS_CELL(ALLOC_CELL(INTEGER(0)));
+            }
+            return cell;
+        }
+
+        static void getCell(JitState* state, uint32_t index) {
+            *state->sp++ = cellAt(state, index)->value;
+        }
+
+        static void setCell(JitState* state, uint32_t index) {
+            auto& cell = state->cells[index];
+            if (cell == nullptr) {
+                state->safepoint(state);
+                cell = AS_CELL(ALLOC_CELL(state->sp[-1]));
+            } else {
+                cell->value = state->sp[-1];
+                writeBarrier(cell, cell->value);
+            }
+        }
+
+        static void loadCell(JitState* state, uint32_t index) {
+            *state->sp++ = CELL(cellAt(state, index));
+        }
+
+        static void makeFunction(JitState* state, uint32_t cellsCount) {
+            state->safepoint(state);
+            auto co = AS_CODE(*--state->sp);
+            auto fnValue = ALLOC_FUNCTION(co);
+            auto fn = AS_FUNCTION(fnValue);
+            fn->cells.resize(cellsCount);
+            for (auto i = cellsCount; i-- > 0;) {
+                fn->cells[i] = AS_CELL(*--state->sp);
+                writeBarrier(fn, fn->cells[i]);
+            }
+            *state->sp++ = fnValue;
+        }
+
+        // -------------------------------------------------------
+        // Stencil library
+
+        /**
+         * Builds one stencil with the JIT emitters
+         */
+        class StencilBuilder : protected JitEmitter {
+            public:
+                StencilBuilder() { a.wideDisplacements = true; }
+
+                Stencil build(uint8_t opcode, uint8_t op = 0) {
+                    emit(opcode, op);
+                    for (auto position : takeExits()) {
+                        holes_.push_back({HoleKind::EXIT, position, 0, 0, 0});
+                    }
+                    return Stencil{std::move(a.code), std::move(holes_)};
+                }
+
+                Stencil buildEntry() {
+                    emitEntry();
+                    return Stencil{std::move(a.code), {}};
+                }
+
+                Stencil buildExit() {
+                    emitExit();
+                    return Stencil{std::move(a.code), {}};
+                }
+
+                /**
+                 * mov eax, offset; jmp exit
+                 */
+                Stencil buildExitStub() {
+                    auto offset = a.movImm32(RAX, 0);
+                    auto exit = a.jmp();
+                    return Stencil{std::move(a.code), {{HoleKind::OPERAND, offset, 0, 0, 0},
+                                                       {HoleKind::EXIT, exit, 0, 0, 0}}};
+                }
+
+            private:
+                std::vector<Hole> holes_;
+
+                /**
+                 * Hole in the last displacement
+                 */
+                void operandHole(uint8_t operand, int32_t scale, int32_t bias = 0) {
+                    holes_.push_back({HoleKind::OPERAND, a.displacement, operand, scale, bias});
+                }
+
+                /**
+                 * rax = &bp[operand]
+                 */
+                void localAddress(uint8_t operand) {
+                    a.lea(RAX, R12, 0);
+                    operandHole(operand, VALUE_SIZE);
+                }
+
+                /**
+                 * rax = &globals[operand].value
+                 */
+                void globalAddress(uint8_t operand) {
+                    a.load(RAX, R14, offsetof(JitState, globals));
+                    a.lea(RAX, RAX, 0);
+                    operandHole(operand, sizeof(GlobalVar), globalDisplacement(0));
+                }
+
+                /**
+                 * Pushes the constant the operand indexes
+                 */
+                void pushConst(uint8_t operand) {
+                    for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+                        holes_.push_back({HoleKind::CONST, a.movImm64(RAX, 0), operand, 0, word});
+                        a.store(RBX, word, RAX);
+                    }
+                    a.addImm(RBX, VALUE_SIZE);
+                }
+
+                /**
+                 * Calls helper(state, operand)
+                 */
+                void callWithOperand(const void* helper, uint8_t operand) {
+                    holes_.push_back({HoleKind::OPERAND, a.movImm32(RSI, 0), operand, 1, 0});
+                    callHelper(helper);
+                }
+
+                void emit(uint8_t opcode, uint8_t op) {
+                    switch (opcode) {
+                        case OP_CONST:
+                            pushConst(1);
+                            break;
+
+                        case OP_POP:
+                            a.subImm(RBX, VALUE_SIZE);
+                            break;
+
+                        case OP_GET_LOCAL:
+                            localAddress(1);
+                            copyValue(RBX, 0, RAX, 0);
+                            a.addImm(RBX, VALUE_SIZE);
+                            break;
+
+                        case OP_SET_LOCAL:
+                            localAddress(1);
+                            copyValue(RAX, 0, RBX, -VALUE_SIZE);
+                            break;
+
+                        case OP_SET_LOCAL_POP:
+                            a.subImm(RBX, VALUE_SIZE);
+                            localAddress(1);
+                            copyValue(RAX, 0, RBX, 0);
+                            break;
+
+                        case OP_GET_LOCAL2:
+                            localAddress(1);
+                            copyValue(RBX, 0, RAX, 0);
+                            localAddress(2);
+                            copyValue(RBX, VALUE_SIZE, RAX, 0);
+                            a.addImm(RBX, 2 * VALUE_SIZE);
+                            break;
+
+                        case OP_GET_LOCAL_CONST:
+                            localAddress(1);
+                            copyValue(RBX, 0, RAX, 0);
+                            a.addImm(RBX, VALUE_SIZE);
+                            pushConst(2);
+                            break;
+
+                        case OP_GET_GLOBAL:
+                            globalAddress(1);
+                            copyValue(RBX, 0, RAX, 0);
+                            a.addImm(RBX, VALUE_SIZE);
+                            break;
+
+                        case OP_GET_GLOBAL_CONST:
+                            globalAddress(1);
+                            copyValue(RBX, 0, RAX, 0);
+                            a.addImm(RBX, VALUE_SIZE);
+                            pushConst(2);
+                            break;
+
+                        case OP_SET_GLOBAL:
+                            globalAddress(1);
+                            copyValue(RAX, 0, RBX, -VALUE_SIZE);
+                            break;
+
+                        case OP_SET_GLOBAL_POP:
+                            a.subImm(RBX, VALUE_SIZE);
+                            globalAddress(1);
+                            copyValue(RAX, 0, RBX, 0);
+                            break;
+
+                        case OP_SCOPE_EXIT:
+                            // Result to bp[-count - 1], then pop count values
+                            a.lea(RAX, RBX, 0);
+                            operandHole(1, -VALUE_SIZE, -VALUE_SIZE);
+                            copyValue(RAX, 0, RBX, -VALUE_SIZE);
+                            a.lea(RBX, RBX, 0);
+                            operandHole(1, -VALUE_SIZE);
+                            break;
+
+                        case OP_ADD:
+                        case OP_ADD_NUM:
+                        case OP_ADD_STR: {
+                            auto notNumber1 = branchIfNotNumber(-2 * VALUE_SIZE);
+                            auto notNumber2 = branchIfNotNumber(-VALUE_SIZE);
+                            arithmetic(OP_ADD);
+                            auto done = a.jmp();
+                            a.bind(notNumber1, a.size());
+                            a.bind(notNumber2, a.size());
+                            callHelper((const void*)addValues);
+                            a.bind(done, a.size());
+                            break;
+                        }
+
+                        case OP_SUB:
+                        case OP_MUL:
+                        case OP_DIV:
+                            guardNumbers();
+                            arithmetic(opcode);
+                            break;
+
+                        case OP_COMPARE:
+                        case OP_LT_NUM:
+                        case OP_GT_NUM:
+                        case OP_EQ_NUM:
+                        case OP_GE_NUM:
+                        case OP_LE_NUM:
+                        case OP_NE_NUM: {
+                            auto notNumber1 = branchIfNotNumber(-2 * VALUE_SIZE);
+                            auto notNumber2 = branchIfNotNumber(-VALUE_SIZE);
+                            compareNumbers(op);
+                            storeBoolean(-2 * VALUE_SIZE);
+                            a.subImm(RBX, VALUE_SIZE);
+                            auto done = a.jmp();
+                            a.bind(notNumber1, a.size());
+                            a.bind(notNumber2, a.size());
+                            a.movImm32(RSI, op);
+                            callHelper((const void*)compareStrings);
+                            a.bind(done, a.size());
+                            break;
+                        }
+
+                        case OP_JMP_IF_FALSE:
+                            targetHole(popJumpIfFalse());
+                            break;
+
+                        case OP_JMP_IF_LT:
+                        case OP_JMP_IF_GT:
+                        case OP_JMP_IF_EQ:
+                        case OP_JMP_IF_GE:
+                        case OP_JMP_IF_LE:
+                        case OP_JMP_IF_NE:
+                            // Jumps unless the opposite relation holds
+                            guardNumbers();
+                            compareNumbers((opcode - OP_JMP_IF_LT + 3) % 6);
+                            a.subImm(RBX, 2 * VALUE_SIZE);
+                            a.testByte(RAX, RAX);
+                            targetHole(a.jcc(CC_E));
+                            break;
+
+                        case OP_JMP:
+                            targetHole(a.jmp());
+                            break;
+
+                        case OP_GET_CELL:
+                            callWithOperand((const void*)getCell, 1);
+                            break;
+
+                        case OP_SET_CELL:
+                            callWithOperand((const void*)setCell, 1);
+                            break;
+
+                        case OP_LOAD_CELL:
+                            callWithOperand((const void*)loadCell, 1);
+                            break;
+
+                        case OP_MAKE_FUNCTION:
+                            callWithOperand((const void*)makeFunction, 1);
+                            break;
+
+                        default:
+                            exitAlways();
+                            break;
+                    }
+                }
+
+                void targetHole(size_t position) {
+                    holes_.push_back({HoleKind::TARGET, position, 0, 0, 0});
+                }
+        };
+
+        struct Library {
+            Stencil entry;
+            Stencil exit;
+            Stencil exitStub;
+
+            /**
+             * By opcode; OP_COMPARE by its operator
+             */
+            std::array<Stencil, 256> stencils;
+            std::array<Stencil, 6> compares;
+
+            Library() {
+                entry = StencilBuilder().buildEntry();
+                exit = StencilBuilder().buildExit();
+                exitStub = StencilBuilder().buildExitStub();
+                for (auto opcode = 0; opcode < 256; opcode++) {
+                    auto op = opcode >= OP_LT_NUM && opcode <= OP_NE_NUM ? opcode - OP_LT_NUM : 0;
+                    stencils[opcode] = StencilBuilder().build(opcode, op);
+                }
+                for (auto op = 0; op < 6; op++) {
+                    compares[op] = StencilBuilder().build(OP_COMPARE, op);
+                }
+            }
+
+            Stencil& select(const std::vector<uint8_t>& code, size_t offset) {
+                if (code[offset] == OP_COMPARE) {
+                    return compares[code[offset + 1]];
+                }
+                if (code[offset] == OP_WIDE) {
+                    return stencils[code[offset + 1]];
+                }
+                return stencils[code[offset]];
+            }
+        };
+
+        /**
+         * Stencils, generated on first use
+         */
+        static Library& getLibrary() {
+            static Library library;
+            return library;
+        }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,879 @@
+/**
+ * Tracing JIT: hot while loops to specialized native code
+ */
+
+#ifndef EvaTracer_h
+#define EvaTracer_h
+
+#include "JitEmitter.h"
+
+#ifdef EVA_JIT
+
+#include <map>
+#include <set>
+#include <unordered_map>
+
+/**
+ * Recorded instructions before a trace is given up
+ */
+#define MAX_TRACE_LENGTH 1000
+
+/**
+ * Failed recordings before a loop is no longer traced
+ */
+#define MAX_TRACE_ABORTS 3
+
+/**
+ * One recorded instruction.  `numbers`: the values it loaded were
+ * numbers (GET_LOCAL, GET_GLOBAL, ...), `integers`: small integers.
+ */
+struct TraceStep {
+    uint32_t offset;
+    bool numbers;
+    bool integers;
+};
+
+/**
+ * A recorded path from `start` back to the loop header: the loop
+ * iteration itself, then paths from its hot side exits.
+ */
+struct TraceFragment {
+    size_t start;
+    std::vector<TraceStep> steps;
+};
+
+/**
+ * Per loop header state
+ */
+struct TraceLoop {
+    /**
+     * Body offsets [header, end), frame height at the header
+     */
+    size_t header = 0;
+    size_t end = 0;
+    size_t height = 0;
+
+    /**
+     * Back-edges taken
+     */
+    size_t hotness = 0;
+
+    /**
+     * Failed recordings
+     */
+    size_t aborts = 0;
+
+    std::vector<TraceFragment> fragments;
+
+    /**
+     * Branch side exits staying in the loop: times taken, by offset
+     */
+    std::map<size_t, size_t> branchExits;
+
+    /**
+     * Failed entry guards: a slot no longer holds its recorded kind,
+     * e.g. an integer overflowed into a double
+     */
+    size_t entryExits = 0;
+
+    std::unique_ptr<JitCode> trace;
+};
+
+/**
+ *  EvaTracer
+ *
+ *  A while loop ends with a backward OP_JMP to its header.  Once a
+ *  header is hot, the next iteration is recorded instruction by
+ *  instruction (see the LoopTracing policy) with the types it saw, and
+ *  compiled to linear native code: one path through the body, jumping
+ *  back to its own start.  Branches leaving the recorded path and
+ *  failed type guards are side exits to the interpreter.  A branch
+ *  exit taken often is recorded in turn, up to the header, and the
+ *  loop is recompiled with that path attached to the exit.
+ *
+ *  Recording gives up on anything but numeric code: calls, returns,
+ *  cells, strings, inner loops.
+ */
+class EvaTracer {
+    public:
+        bool recording() const { return loop_ != nullptr; }
+
+        /**
+         * Backward OP_JMP at `jump` to `header`, with `height` values in
+         * the frame.  Returns the loop's trace, or nullptr after counting
+         * the edge.
+         */
+        JitCode* backEdge(CodeObject* co, const uint8_t* header, const uint8_t* jump,
+                          size_t height, size_t threshold) {
+            if (recording()) {
+                return nullptr;
+            }
+            auto& loop = loops_[header];
+            if (loop.trace != nullptr) {
+                running_ = &loop;
+                return loop.trace.get();
+            }
+            if (loop.aborts < MAX_TRACE_ABORTS && ++loop.hotness >= threshold) {
+                loop.header = header - co->code.data();
+                loop.end = jump - co->code.data() + 1;
+                loop.height = height;
+                start(loop, co, loop.header);
+            }
+            return nullptr;
+        }
+
+        /**
+         * The trace returned by backEdge left at `ip`: counts branch
+         * exits towards recording their path, and entry guard failures
+         * towards recording the loop again
+         */
+        void sideExit(CodeObject* co, const uint8_t* ip, size_t threshold) {
+            auto& loop = *running_;
+            auto offset = (size_t)(ip - co->code.data());
+            if (offset == loop.header) {
+                if (++loop.entryExits >= threshold) {
+                    retrace(loop);
+                }
+                return;
+            }
+            auto exit = loop.branchExits.find(offset);
+            if (exit != loop.branchExits.end() && loop.aborts < MAX_TRACE_ABORTS &&
+                ++exit->second >= threshold) {
+                start(loop, co, exit->first);
+            }
+        }
+
+        /**
+         * Records the instruction at `ip`, about to run
+         */
+        void record(const uint8_t* ip, const EvaValue* sp, const EvaValue* bp,
+                    const GlobalVar* globals) {
+            const auto& code = co_->code;
+            if (ip < code.data() + loop_->header || ip >= code.data() + loop_->end) {
+                return leave();
+            }
+            auto offset = (size_t)(ip - code.data());
+
+            // Back at the header: the path is complete
+            if (offset == loop_->header && !steps_.empty()) {
+                return finish();
+            }
+
+            if (steps_.size() == MAX_TRACE_LENGTH) {
+                return abort();
+            }
+
+            auto numbers = true;
+            auto integers = true;
+            auto load = [&](const EvaValue& value) {
+                numbers = numbers && IS_NUMBER(value);
+                integers = integers && IS_INTEGER(value);
+            };
+            switch (code[offset]) {
+                case OP_GET_LOCAL:
+                case OP_GET_LOCAL_CONST:
+                    load(bp[code[offset + 1]]);
+                    break;
+
+                case OP_GET_LOCAL2:
+                    load(bp[code[offset + 1]]);
+                    load(bp[code[offset + 2]]);
+                    break;
+
+                case OP_GET_GLOBAL:
+                case OP_GET_GLOBAL_CONST:
+                    load(globals[code[offset + 1]].value);
+                    break;
+
+                case OP_CONST:
+                case OP_POP:
+                case OP_SET_LOCAL:
+                case OP_SET_LOCAL_POP:
+                case OP_SET_GLOBAL:
+                case OP_SET_GLOBAL_POP:
+                case OP_SCOPE_EXIT:
+                    break;
+
+                case OP_ADD:
+                case OP_ADD_NUM:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_COMPARE:
+                case OP_LT_NUM:
+                case OP_GT_NUM:
+                case OP_EQ_NUM:
+                case OP_GE_NUM:
+                case OP_LE_NUM:
+                case OP_NE_NUM:
+                case OP_JMP_IF_LT:
+                case OP_JMP_IF_GT:
+                case OP_JMP_IF_EQ:
+                case OP_JMP_IF_GE:
+                case OP_JMP_IF_LE:
+                case OP_JMP_IF_NE:
+                    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) {
+                        return abort();
+                    }
+                    break;
+
+                case OP_JMP_IF_FALSE:
+                    if (!IS_BOOLEAN(sp[-1])) {
+                        return abort();
+                    }
+                    break;
+
+                // Only the back-edge of the loop itself:
+                case OP_JMP: {
+                    auto target = jumpTarget(code.data(), offset + 1);
+                    if (target < offset && target != loop_->header) {
+                        return abort();
+                    }
+                    break;
+                }
+
+                default:
+                    return abort();
+            }
+
+            steps_.push_back({(uint32_t)offset, numbers, integers});
+        }
+
+        /**
+         * Forgets all loops and traces, their code may be gone
+         */
+        void reset() {
+            loops_.clear();
+            loop_ = nullptr;
+            running_ = nullptr;
+        }
+
+    private:
+        /**
+         * Loops by header address
+         */
+        std::unordered_map<const uint8_t*, TraceLoop> loops_;
+
+        /**
+         * Loop whose trace ran last
+         */
+        TraceLoop* running_ = nullptr;
+
+        /**
+         * The recording: loop, code, start offset and the instructions
+         * so far
+         */
+        TraceLoop* loop_ = nullptr;
+        CodeObject* co_ = nullptr;
+        size_t start_ = 0;
+        std::vector<TraceStep> steps_;
+
+        void start(TraceLoop& loop, CodeObject* co, size_t offset) {
+            loop_ = &loop;
+            co_ = co;
+            start_ = offset;
+            steps_.clear();
+        }
+
+        void abort() {
+            loop_->aborts++;
+            loop_->hotness = 0;
+            loop_ = nullptr;
+        }
+
+        /**
+         * Drops the trace: the loop is hot again from zero, and counts
+         * as a failed recording
+         */
+        void retrace(TraceLoop& loop) {
+            loop.trace.reset();
+            loop.fragments.clear();
+            loop.branchExits.clear();
+            loop.entryExits = 0;
+            loop.hotness = 0;
+            loop.aborts++;
+        }
+
+        /**
+         * The recorded iteration was the last one: the next back-edge
+         * records again
+         */
+        void leave() { loop_ = nullptr; }
+
+        /**
+         * Adds the recorded path and recompiles the loop
+         */
+        void finish();
+
+        class TraceCompiler;
+};
+
+/**
+ *  TraceCompiler
+ *
+ *  Emits the fragments of a loop: the first from the header jumps back
+ *  to the trace start, each later one is attached to the branch exits
+ *  leading to it.
+ *
+ *  Known value kinds remove type guards: kinds of the trace's own stack
+ *  values, and of outer locals and globals only ever assigned numbers
+ *  in the trace ("stable" slots).  Stable slots are guarded once at the
+ *  trace entry and stay numbers on every iteration; those only seen
+ *  holding integers are guarded as integers, so their arithmetic needs
+ *  no double code at all.
+ */
+class EvaTracer::TraceCompiler : protected JitEmitter {
+    public:
+        TraceCompiler(CodeObject* co, const TraceLoop& loop) : co_(co), loop_(loop) {}
+
+        /**
+         * Native code entered at the header, nullptr if a fragment does
+         * not fit the frame
+         */
+        std::unique_ptr<JitCode> compile() {
+            // Outer slots the trace reads as numbers only, and as
+            // integers only
+            std::set<size_t> unstable;
+            std::set<size_t> mixed;
+            forEachRead([&](const TraceStep& step, size_t slot) {
+                if (!step.numbers) {
+                    unstable.insert(slot);
+                } else if (!step.integers) {
+                    mixed.insert(slot);
+                }
+            });
+
+            // Widen integer slots assigned other numbers, drop slots
+            // assigned other kinds, until the assumption holds
+            for (;;) {
+                stable_.clear();
+                forEachRead([&](const TraceStep& step, size_t slot) {
+                    if (unstable.count(slot) == 0) {
+                        stable_[slot] = mixed.count(slot) ? Kind::NUMBER : Kind::INTEGER;
+                    }
+                });
+                if (!emit()) {
+                    return nullptr;
+                }
+                if (unstableWrites_.empty()) {
+                    break;
+                }
+                for (auto slot : unstableWrites_) {
+                    (stable_[slot] == Kind::INTEGER ? mixed : unstable).insert(slot);
+                }
+            }
+
+            std::vector<uint32_t> entries(co_->code.size() + 1, 0);
+            entries[loop_.header] = entry_;
+            return std::make_unique<JitCode>(a.code, std::move(entries));
+        }
+
+        /**
+         * Branch exits with no fragment, inside the loop body
+         */
+        const std::set<size_t>& branchExits() { return branchExits_; }
+
+    private:
+        /**
+         * Statically known kind of a value
+         */
+        enum class Kind {
+            UNKNOWN,
+            INTEGER,
+            DOUBLE,
+            NUMBER,
+            OTHER,
+        };
+
+        static bool isNumber(Kind kind) {
+            return kind == Kind::INTEGER || kind == Kind::DOUBLE || kind == Kind::NUMBER;
+        }
+
+        /**
+         * Kind holding on both of two paths
+         */
+        static Kind join(Kind a, Kind b) {
+            if (a == b) {
+                return a;
+            }
+            return isNumber(a) && isNumber(b) ? Kind::NUMBER : Kind::UNKNOWN;
+        }
+
+        static NumberKind numberKind(Kind kind) {
+            if (kind == Kind::INTEGER) {
+                return NumberKind::INTEGER;
+            }
+            return kind == Kind::DOUBLE ? NumberKind::DOUBLE : NumberKind::ANY;
+        }
+
+        /**
+         * Kind of an arithmetic result: integers overflowing exit the
+         * trace, so two integers give an integer
+         */
+        static Kind resultKind(uint8_t opcode, Kind lhs, Kind rhs) {
+            if (opcode == OP_DIV || lhs == Kind::DOUBLE || rhs == Kind::DOUBLE) {
+                return Kind::DOUBLE;
+            }
+            return lhs == Kind::INTEGER && rhs == Kind::INTEGER ? Kind::INTEGER : Kind::NUMBER;
+        }
+
+        /**
+         * Kinds at a program point: the trace's stack values from the
+         * header height, outer locals and globals
+         */
+        struct Kinds {
+            std::vector<Kind> stack;
+            std::map<size_t, Kind> slots;
+
+            /**
+             * Keeps what holds on both paths
+             */
+            void merge(const Kinds& other) {
+                for (size_t i = 0; i < stack.size() && i < other.stack.size(); i++) {
+                    stack[i] = join(stack[i], other.stack[i]);
+                }
+                for (auto it = slots.begin(); it != slots.end();) {
+                    auto match = other.slots.find(it->first);
+                    auto kind = match == other.slots.end() ? Kind::UNKNOWN
+                                                           : join(it->second, match->second);
+                    if (kind == Kind::UNKNOWN) {
+                        it = slots.erase(it);
+                    } else {
+                        it->second = kind;
+                        ++it;
+                    }
+                }
+            }
+        };
+
+        /**
+         * Outer locals are slots below the header height; globals are
+         * tagged with GLOBAL_SLOT
+         */
+        static constexpr size_t GLOBAL_SLOT = (size_t)1 << 32;
+
+        CodeObject* co_;
+        const TraceLoop& loop_;
+
+        /**
+         * Stable slots and the kind they are guarded as
+         */
+        std::map<size_t, Kind> stable_;
+        std::set<size_t> unstableWrites_;
+        std::set<size_t> branchExits_;
+        size_t entry_ = 0;
+
+        /**
+         * Current kinds
+         */
+        Kinds kinds_;
+
+        /**
+         * Pending branch exits by target offset: jumps and the kinds
+         * there
+         */
+        std::map<size_t, std::pair<std::vector<size_t>, Kinds>> branches_;
+
+        /**
+         * Calls fn(step, slot) for each outer local or global read
+         */
+        template <typename Fn>
+        void forEachRead(Fn fn) {
+            const auto& code = co_->code;
+            for (auto& fragment : loop_.fragments) {
+                for (auto& step : fragment.steps) {
+                    auto offset = step.offset;
+                    switch (code[offset]) {
+                        case OP_GET_LOCAL:
+                        case OP_GET_LOCAL_CONST:
+                            if (code[offset + 1] < loop_.height) {
+                                fn(step, code[offset + 1]);
+                            }
+                            break;
+                        case OP_GET_LOCAL2:
+                            for (auto index : {code[offset + 1], code[offset + 2]}) {
+                                if (index < loop_.height) {
+                                    fn(step, index);
+                                }
+                            }
+                            break;
+                        case OP_GET_GLOBAL:
+                        case OP_GET_GLOBAL_CONST:
+                            fn(step, GLOBAL_SLOT | code[offset + 1]);
+                            break;
+                    }
+                }
+            }
+        }
+
+        /**
+         * Emits entry guards and the fragments under the current stable
+         * slots.  False if a fragment pops below the header height.
+         */
+        bool emit() {
+            a = X86Assembler();
+            exits_.clear();
+            unstableWrites_.clear();
+            branchExits_.clear();
+            branches_.clear();
+            kinds_ = Kinds();
+            std::map<size_t, std::vector<size_t>> exits;
+
+            emitEntry();
+            entry_ = a.size();
+
+            // Entry guards: stable slots hold numbers (integers), else
+            // run the iteration in the interpreter
+            for (auto& stable : stable_) {
+                auto slot = stable.first;
+                auto base = R12;
+                int32_t disp = slot * VALUE_SIZE;
+                if (slot & GLOBAL_SLOT) {
+                    a.load(RDX, R14, offsetof(JitState, globals));
+                    base = RDX;
+                    disp = globalDisplacement(slot & ~GLOBAL_SLOT);
+                }
+                exits[loop_.header].push_back(stable.second == Kind::INTEGER
+                                                  ? branchIfNotInteger(disp, base)
+                                                  : branchIfNotNumber(disp, base));
+                kinds_.slots[slot] = stable.second;
+            }
+
+            auto loop = a.size();
+
+            for (auto& fragment : loop_.fragments) {
+                if (fragment.start != loop_.header) {
+                    auto branch = branches_.find(fragment.start);
+                    if (branch == branches_.end()) {
+                        continue;
+                    }
+                    for (auto position : branch->second.first) {
+                        a.bind(position, a.size());
+                    }
+                    kinds_ = branch->second.second;
+                    branches_.erase(branch);
+                }
+                if (!emitFragment(fragment, exits)) {
+                    return false;
+                }
+                a.bind(a.jmp(), loop);
+            }
+
+            // Branch exits with no fragment leave the trace; those inside
+            // the body may get one
+            std::set<size_t> starts;
+            for (auto& fragment : loop_.fragments) {
+                starts.insert(fragment.start);
+            }
+            for (auto& branch : branches_) {
+                auto& list = exits[branch.first];
+                list.insert(list.end(), branch.second.first.begin(), branch.second.first.end());
+                if (branch.first > loop_.header && branch.first < loop_.end &&
+                    starts.count(branch.first) == 0) {
+                    branchExits_.insert(branch.first);
+                }
+            }
+
+            // Exit stubs: the bytecode offset in eax, then the common exit
+            std::vector<size_t> exitJumps;
+            for (auto& exit : exits) {
+                for (auto position : exit.second) {
+                    a.bind(position, a.size());
+                }
+                a.movImm(RAX, exit.first);
+                exitJumps.push_back(a.jmp());
+            }
+
+            auto commonExit = a.size();
+            emitExit();
+
+            for (auto position : exitJumps) {
+                a.bind(position, commonExit);
+            }
+            return true;
+        }
+
+        /**
+         * One recorded path, up to its jump back to the header
+         */
+        bool emitFragment(const TraceFragment& fragment,
+                          std::map<size_t, std::vector<size_t>>& exits) {
+            const auto& code = co_->code;
+            const auto& steps = fragment.steps;
+
+            for (size_t i = 0; i < steps.size(); i++) {
+                auto offset = steps[i].offset;
+                auto next = i + 1 < steps.size() ? steps[i + 1].offset : loop_.header;
+                auto opcode = code[offset];
+
+                switch (opcode) {
+                    case OP_ADD:
+                    case OP_ADD_NUM:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV: {
+                        Kind lhs, rhs;
+                        if (!operands(lhs, rhs)) {
+                            return false;
+                        }
+                        arithmetic(opcode, numberKind(lhs), numberKind(rhs));
+                        push(resultKind(opcode, lhs, rhs));
+                        break;
+                    }
+
+                    case OP_COMPARE:
+                    case OP_LT_NUM:
+                    case OP_GT_NUM:
+                    case OP_EQ_NUM:
+                    case OP_GE_NUM:
+                    case OP_LE_NUM:
+                    case OP_NE_NUM: {
+                        Kind lhs, rhs;
+                        if (!operands(lhs, rhs)) {
+                            return false;
+                        }
+                        compareNumbers(code[offset + 1], numberKind(lhs), numberKind(rhs));
+                        storeBoolean(-2 * VALUE_SIZE);
+                        a.subImm(RBX, VALUE_SIZE);
+                        push(Kind::OTHER);
+                        break;
+                    }
+
+                    // Branches: stay on the recorded successor, exit to
+                    // the other one
+                    case OP_JMP_IF_FALSE: {
+                        if (!pop()) {
+                            return false;
+                        }
+                        auto branch = popJumpIfFalse();
+                        leave(branch, offset, jumpTarget(code.data(), offset + 1), next);
+                        break;
+                    }
+
+                    case OP_JMP_IF_LT:
+                    case OP_JMP_IF_GT:
+                    case OP_JMP_IF_EQ:
+                    case OP_JMP_IF_GE:
+                    case OP_JMP_IF_LE:
+                    case OP_JMP_IF_NE: {
+                        Kind lhs, rhs;
+                        if (!operands(lhs, rhs)) {
+                            return false;
+                        }
+                        compareNumbers((opcode - OP_JMP_IF_LT + 3) % 6, numberKind(lhs),
+                                       numberKind(rhs));
+                        a.subImm(RBX, 2 * VALUE_SIZE);
+                        a.testByte(RAX, RAX);
+                        leave(a.jcc(CC_E), offset, jumpTarget(code.data(), offset + 1), next);
+                        break;
+                    }
+
+                    // The trace is laid out in recorded order
+                    case OP_JMP:
+                        break;
+
+                    default:
+                        if (!track(offset)) {
+                            return false;
+                        }
+                        emitDataMove(co_, offset);
+                        break;
+                }
+
+                auto taken = takeExits();
+                if (!taken.empty()) {
+                    auto& list = exits[offset];
+                    list.insert(list.end(), taken.begin(), taken.end());
+                }
+            }
+            return kinds_.stack.empty();
+        }
+
+        /**
+         * `branch` jumps to `target` (else falls through): points it at
+         * the successor not recorded and notes the kinds there
+         */
+        void leave(size_t branch, size_t offset, size_t target, size_t next) {
+            if (next == target) {
+                a.invert(branch);
+                target = offset + opcodeSize(co_->code[offset]);
+            }
+            auto it = branches_.find(target);
+            if (it == branches_.end()) {
+                branches_[target] = {{branch}, kinds_};
+            } else {
+                it->second.first.push_back(branch);
+                it->second.second.merge(kinds_);
+            }
+        }
+
+        /**
+         * Pops the two top values, guarded unless known numbers, and
+         * their kinds after the guards
+         */
+        bool operands(Kind& lhs, Kind& rhs) {
+            auto& stack = kinds_.stack;
+            if (stack.size() < 2) {
+                return false;
+            }
+            for (auto depth : {2, 1}) {
+                auto& kind = stack[stack.size() - depth];
+                if (!isNumber(kind)) {
+                    exits_.push_back(branchIfNotNumber(-depth * VALUE_SIZE));
+                    kind = Kind::NUMBER;
+                }
+            }
+            lhs = stack[stack.size() - 2];
+            rhs = stack[stack.size() - 1];
+            stack.resize(stack.size() - 2);
+            return true;
+        }
+
+        void push(Kind kind) { kinds_.stack.push_back(kind); }
+
+        /**
+         * Pops a kind, false below the header height
+         */
+        bool pop(Kind* kind = nullptr) {
+            if (kinds_.stack.empty()) {
+                return false;
+            }
+            if (kind != nullptr) {
+                *kind = kinds_.stack.back();
+            }
+            kinds_.stack.pop_back();
+            return true;
+        }
+
+        bool getLocal(size_t index) {
+            auto& stack = kinds_.stack;
+            if (index >= loop_.height) {
+                if (index - loop_.height >= stack.size()) {
+                    return false;
+                }
+                push(stack[index - loop_.height]);
+            } else {
+                push(getSlot(index));
+            }
+            return true;
+        }
+
+        bool setLocal(size_t index, Kind kind) {
+            auto& stack = kinds_.stack;
+            if (index >= loop_.height) {
+                if (index - loop_.height >= stack.size()) {
+                    return false;
+                }
+                stack[index - loop_.height] = kind;
+            } else {
+                setSlot(index, kind);
+            }
+            return true;
+        }
+
+        Kind getSlot(size_t slot) {
+            auto it = kinds_.slots.find(slot);
+            return it == kinds_.slots.end() ? Kind::UNKNOWN : it->second;
+        }
+
+        void setSlot(size_t slot, Kind kind) {
+            kinds_.slots[slot] = kind;
+            auto stable = stable_.find(slot);
+            if (stable != stable_.end() && kind != stable->second &&
+                !(stable->second == Kind::NUMBER && isNumber(kind))) {
+                unstableWrites_.insert(slot);
+            }
+        }
+
+        Kind constKind(uint8_t index) {
+            auto& value = co_->constants[index];
+            if (IS_INTEGER(value)) {
+                return Kind::INTEGER;
+            }
+            return IS_NUMBER(value) ? Kind::DOUBLE : Kind::OTHER;
+        }
+
+        /**
+         * Kinds through a data move instruction
+         */
+        bool track(size_t offset) {
+            const auto& code = co_->code;
+            auto& stack = kinds_.stack;
+            auto operand = code[offset + 1];
+            auto kind = Kind::UNKNOWN;
+            switch (code[offset]) {
+                case OP_CONST:
+                    push(constKind(operand));
+                    return true;
+                case OP_POP:
+                    return pop();
+                case OP_GET_LOCAL:
+                    return getLocal(operand);
+                case OP_SET_LOCAL:
+                    return !stack.empty() && setLocal(operand, stack.back());
+                case OP_SET_LOCAL_POP:
+                    return pop(&kind) && setLocal(operand, kind);
+                case OP_GET_LOCAL2:
+                    return getLocal(operand) && getLocal(code[offset + 2]);
+                case OP_GET_LOCAL_CONST:
+                    if (!getLocal(operand)) {
+                        return false;
+                    }
+                    push(constKind(code[offset + 2]));
+                    return true;
+                case OP_GET_GLOBAL:
+                    push(getSlot(GLOBAL_SLOT | operand));
+                    return true;
+                case OP_GET_GLOBAL_CONST:
+                    push(getSlot(GLOBAL_SLOT | operand));
+                    push(constKind(code[offset + 2]));
+                    return true;
+                case OP_SET_GLOBAL:
+                    if (stack.empty()) {
+                        return false;
+                    }
+                    setSlot(GLOBAL_SLOT | operand, stack.back());
+                    return true;
+                case OP_SET_GLOBAL_POP:
+                    if (!pop(&kind)) {
+                        return false;
+                    }
+                    setSlot(GLOBAL_SLOT | operand, kind);
+                    return true;
+                case OP_SCOPE_EXIT: {
+                    if (stack.size() < (size_t)operand + 1) {
+                        return false;
+                    }
+                    auto result = stack.back();
+                    stack.resize(stack.size() - operand - 1);
+                    push(result);
+                    return true;
+                }
+            }
+            return false;
+        }
+};
+
+inline void EvaTracer::finish() {
+    auto& loop = *loop_;
+    loop.fragments.push_back({start_, std::move(steps_)});
+    steps_.clear();
+
+    TraceCompiler compiler(co_, loop);
+    auto trace = compiler.compile();
+    if (trace == nullptr) {
+        loop.fragments.pop_back();
+        return abort();
+    }
+    loop.trace = std::move(trace);
+
+    loop.branchExits.clear();
+    for (auto offset : compiler.branchExits()) {
+        loop.branchExits[offset] = 0;
+    }
+    loop_ = nullptr;
+}
+
+#endif
+
+#endif
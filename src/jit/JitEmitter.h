@@ -0,0 +1,563 @@
+/**
+ * Native code runtime and value emitters shared by the JIT compilers
+ */
+
+#ifndef JitEmitter_h
+#define JitEmitter_h
+
+/**
+ * The JIT needs x86-64 and POSIX mmap.  Define EVA_NO_JIT to leave it
+ * out of the build; --jit is then ignored.
+ */
+#if !defined(EVA_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define EVA_JIT
+#endif
+
+#ifdef EVA_JIT
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../Logger.h"
+#include "../bytecode/OpCode.h"
+#include "../vm/EvaValue.h"
+#include "../vm/Global.h"
+#include "X86Assembler.h"
+
+/**
+ * VM registers shared with native code, read on entry and written
+ * back on exit.
+ */
+struct JitState {
+    EvaValue* sp;
+    EvaValue* bp;
+    GlobalVar* globals;
+
+    /**
+     * Cells of the running frame
+     */
+    CellObject** cells;
+
+    /**
+     * Called by helpers before they allocate, with sp written back:
+     * the VM may collect
+     */
+    void* vm;
+    void (*safepoint)(JitState* state);
+};
+
+/**
+ * What the JIT knows of a number operand
+ */
+enum class NumberKind {
+    INTEGER,
+    DOUBLE,
+    ANY,
+};
+
+/**
+ * Native code: runs from `target` and returns the bytecode offset the
+ * interpreter continues at.
+ */
+using JitEntry = uint32_t (*)(JitState* state, const uint8_t* target);
+
+/**
+ * Native code of one CodeObject, in its own executable mapping.
+ */
+class JitCode {
+    public:
+        JitCode(const std::vector<uint8_t>& machineCode, std::vector<uint32_t> entries)
+            : entries_(std::move(entries)) {
+            auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            mappingSize_ = (machineCode.size() + pageSize - 1) / pageSize * pageSize;
+
+            auto mapping = mmap(nullptr, mappingSize_, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                DIE << "JitCode: cannot map " << mappingSize_ << " bytes";
+            }
+            memory_ = (uint8_t*)mapping;
+            std::memcpy(memory_, machineCode.data(), machineCode.size());
+
+            // Writable or executable, never both:
+            if (mprotect(memory_, mappingSize_, PROT_READ | PROT_EXEC) != 0) {
+                DIE << "JitCode: cannot make code executable";
+            }
+        }
+
+        ~JitCode() { munmap(memory_, mappingSize_); }
+
+        JitCode(const JitCode&) = delete;
+        JitCode& operator=(const JitCode&) = delete;
+
+        /**
+         * Runs from the instruction at bytecode `offset`
+         */
+        uint32_t run(JitState* state, size_t offset) {
+            return ((JitEntry)memory_)(state, memory_ + entries_[offset]);
+        }
+
+        size_t size() { return mappingSize_; }
+
+    private:
+        uint8_t* memory_;
+        size_t mappingSize_;
+
+        /**
+         * Native offset of each instruction, by bytecode offset
+         */
+        std::vector<uint32_t> entries_;
+};
+
+/**
+ *  JitEmitter
+ *
+ *  Values stay in the operand stack memory: rbx is sp, r12 is bp, so
+ *  the interpreter can resume at any instruction boundary without
+ *  reconstructing state.  The emitters below read and write values in
+ *  place, for either EvaValue layout.  Numbers are small integers or
+ *  doubles: integer arithmetic runs as 32-bit ALU ops, anything mixed
+ *  as SSE doubles.
+ *
+ *  Registers: rbx sp, r12 bp, r14 JitState*, r15 the NaN-box tag mask;
+ *  rax, rcx, rdx, rsi, rdi, xmm0, xmm1 are scratch.  rsp is 16-byte
+ *  aligned after the entry, so helpers can be called directly.
+ */
+class JitEmitter {
+    protected:
+        static constexpr int32_t VALUE_SIZE = sizeof(EvaValue);
+
+#ifdef EVA_NAN_BOXING
+        static constexpr int32_t NUMBER_OFFSET = 0;
+#else
+        static constexpr int32_t NUMBER_OFFSET = offsetof(EvaValue, number);
+#endif
+
+        X86Assembler a;
+
+        /**
+         * Exit jumps emitted since the last takeExits
+         */
+        std::vector<size_t> exits_;
+
+        std::vector<size_t> takeExits() { return std::move(exits_); }
+
+        /**
+         * Entry: saves callee-saved registers, loads the state and jumps
+         * to the target
+         */
+        void emitEntry() {
+            a.push(RBX);
+            a.push(RBP);
+            a.push(R12);
+            a.push(R14);
+            a.push(R15);
+            a.mov(R14, RDI);
+            a.load(RBX, R14, offsetof(JitState, sp));
+            a.load(R12, R14, offsetof(JitState, bp));
+#ifdef EVA_NAN_BOXING
+            a.movImm(R15, QNAN);
+#endif
+            a.jmp(RSI);
+        }
+
+        /**
+         * Common exit, the bytecode offset is in eax
+         */
+        void emitExit() {
+            a.store(R14, offsetof(JitState, sp), RBX);
+            a.pop(R15);
+            a.pop(R14);
+            a.pop(R12);
+            a.pop(RBP);
+            a.pop(RBX);
+            a.ret();
+        }
+
+        /**
+         * Leaves native code at the current instruction
+         */
+        void exitAlways() { exits_.push_back(a.jmp()); }
+
+        void exitIf(Cond cond) { exits_.push_back(a.jcc(cond)); }
+
+        /**
+         * Calls helper(state, arg) with sp written back and reloaded
+         */
+        void callHelper(const void* helper) {
+            a.store(R14, offsetof(JitState, sp), RBX);
+            a.mov(RDI, R14);
+            a.movImm64(RAX, (uint64_t)(uintptr_t)helper);
+            a.call(RAX);
+            a.load(RBX, R14, offsetof(JitState, sp));
+        }
+
+        /**
+         * [dstBase + dstDisp] = [srcBase + srcDisp], through rcx
+         */
+        void copyValue(Reg dstBase, int32_t dstDisp, Reg srcBase, int32_t srcDisp) {
+            for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+                a.load(RCX, srcBase, srcDisp + word);
+                a.store(dstBase, dstDisp + word, RCX);
+            }
+        }
+
+        /**
+         * Displacement of globals[index].value
+         */
+        static int32_t globalDisplacement(size_t index) {
+            static GlobalVar sample;
+            return index * sizeof(GlobalVar) + ((char*)&sample.value - (char*)&sample);
+        }
+
+        /**
+         * [rbx] = value
+         */
+        void storeConst(const EvaValue& value) {
+            for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+                uint64_t bits;
+                std::memcpy(&bits, (const char*)&value + word, 8);
+                a.movImm(RAX, bits);
+                a.store(RBX, word, RAX);
+            }
+        }
+
+        /**
+         * Emits the instruction at `offset` if it only moves values:
+         * constants, locals, globals, pops, also in their OP_WIDE form.
+         * These need no guards.  Returns false for any other opcode.
+         */
+        bool emitDataMove(const CodeObject* co, size_t offset) {
+            const auto& code = co->code;
+            auto wide = code[offset] == OP_WIDE;
+            auto opcode = wide ? code[offset + 1] : code[offset];
+            auto operand = [&]() -> size_t {
+                return wide ? wideOperand(code.data(), offset) : code[offset + 1];
+            };
+            switch (opcode) {
+                case OP_CONST:
+                    storeConst(co->constants[operand()]);
+                    a.addImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_POP:
+                    a.subImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_GET_LOCAL:
+                    copyValue(RBX, 0, R12, operand() * VALUE_SIZE);
+                    a.addImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_SET_LOCAL:
+                    copyValue(R12, operand() * VALUE_SIZE, RBX, -VALUE_SIZE);
+                    return true;
+
+                case OP_SET_LOCAL_POP:
+                    a.subImm(RBX, VALUE_SIZE);
+                    copyValue(R12, operand() * VALUE_SIZE, RBX, 0);
+                    return true;
+
+                case OP_GET_LOCAL2:
+                    copyValue(RBX, 0, R12, operand() * VALUE_SIZE);
+                    copyValue(RBX, VALUE_SIZE, R12, code[offset + 2] * VALUE_SIZE);
+                    a.addImm(RBX, 2 * VALUE_SIZE);
+                    return true;
+
+                case OP_GET_LOCAL_CONST:
+                    copyValue(RBX, 0, R12, operand() * VALUE_SIZE);
+                    a.addImm(RBX, VALUE_SIZE);
+                    storeConst(co->constants[code[offset + 2]]);
+                    a.addImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_GET_GLOBAL:
+                    a.load(RAX, R14, offsetof(JitState, globals));
+                    copyValue(RBX, 0, RAX, globalDisplacement(operand()));
+                    a.addImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_GET_GLOBAL_CONST:
+                    a.load(RAX, R14, offsetof(JitState, globals));
+                    copyValue(RBX, 0, RAX, globalDisplacement(operand()));
+                    a.addImm(RBX, VALUE_SIZE);
+                    storeConst(co->constants[code[offset + 2]]);
+                    a.addImm(RBX, VALUE_SIZE);
+                    return true;
+
+                case OP_SET_GLOBAL:
+                    a.load(RAX, R14, offsetof(JitState, globals));
+                    copyValue(RAX, globalDisplacement(operand()), RBX, -VALUE_SIZE);
+                    return true;
+
+                case OP_SET_GLOBAL_POP:
+                    a.subImm(RBX, VALUE_SIZE);
+                    a.load(RAX, R14, offsetof(JitState, globals));
+                    copyValue(RAX, globalDisplacement(operand()), RBX, 0);
+                    return true;
+
+                case OP_SCOPE_EXIT:
+                    copyValue(RBX, -((int32_t)operand() + 1) * VALUE_SIZE, RBX, -VALUE_SIZE);
+                    a.subImm(RBX, operand() * VALUE_SIZE);
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         * Exits unless the two top values are numbers
+         */
+        void guardNumbers() {
+            for (auto disp : {-2 * VALUE_SIZE, -VALUE_SIZE}) {
+                exits_.push_back(branchIfNotNumber(disp));
+            }
+        }
+
+        /**
+         * jcc to be bound by the caller, taken unless [base + disp] is a
+         * small integer
+         */
+        size_t branchIfNotInteger(int32_t disp, Reg base = RBX) {
+#ifdef EVA_NAN_BOXING
+            a.cmpImm32(base, disp + 4, (int32_t)(INTEGER_BITS >> 32));
+#else
+            a.cmpImm32(base, disp, (int32_t)EvaValueType::INTEGER);
+#endif
+            return a.jcc(CC_NE);
+        }
+
+        /**
+         * jcc to be bound by the caller, taken unless [base + disp] is a
+         * number, integer or double (clobbers rax)
+         */
+        size_t branchIfNotNumber(int32_t disp, Reg base = RBX) {
+            auto integer = branchIfNotInteger(disp, base);
+            a.invert(integer);
+#ifdef EVA_NAN_BOXING
+            a.load(RAX, base, disp);
+            a.andReg(RAX, R15);
+            a.cmp(RAX, R15);
+            auto notNumber = a.jcc(CC_E);
+#else
+            a.cmpImm32(base, disp, (int32_t)EvaValueType::NUMBER);
+            auto notNumber = a.jcc(CC_NE);
+#endif
+            a.bind(integer, a.size());
+            return notNumber;
+        }
+
+        /**
+         * xmm = the number at [rbx + disp], converted if an integer
+         */
+        void loadNumber(Xmm dst, int32_t disp, NumberKind kind) {
+            if (kind == NumberKind::INTEGER) {
+                convertInteger(dst, disp);
+                return;
+            }
+            if (kind == NumberKind::DOUBLE) {
+                a.movsdLoad(dst, RBX, disp + NUMBER_OFFSET);
+                return;
+            }
+            auto notInteger = branchIfNotInteger(disp);
+            convertInteger(dst, disp);
+            auto done = a.jmp();
+            a.bind(notInteger, a.size());
+            a.movsdLoad(dst, RBX, disp + NUMBER_OFFSET);
+            a.bind(done, a.size());
+        }
+
+        /**
+         * cvtsi2sd only writes the low half of xmm: clear it first, or
+         * the conversion waits for the last result there (a divsd)
+         */
+        void convertInteger(Xmm dst, int32_t disp) {
+            a.xorpd(dst, dst);
+            a.cvtsi2sd(dst, RBX, disp + NUMBER_OFFSET);
+        }
+
+        /**
+         * Branches to the double code of a binary operation unless both
+         * top values are integers; empty if they are known to be
+         */
+        std::vector<size_t> branchUnlessIntegers(NumberKind lhs, NumberKind rhs) {
+            std::vector<size_t> notIntegers;
+            if (lhs != NumberKind::INTEGER) {
+                notIntegers.push_back(branchIfNotInteger(-2 * VALUE_SIZE));
+            }
+            if (rhs != NumberKind::INTEGER) {
+                notIntegers.push_back(branchIfNotInteger(-VALUE_SIZE));
+            }
+            return notIntegers;
+        }
+
+        /**
+         * al = (top-1 op top), in compareValues order, for two numbers.
+         * An unordered (NaN) compare is only true for !=.
+         */
+        void compareNumbers(uint8_t op, NumberKind lhs = NumberKind::ANY,
+                            NumberKind rhs = NumberKind::ANY) {
+            static const Cond integerConds[] = {CC_L, CC_G, CC_E, CC_GE, CC_LE, CC_NE};
+
+            size_t done = 0;
+            if (lhs != NumberKind::DOUBLE && rhs != NumberKind::DOUBLE) {
+                auto notIntegers = branchUnlessIntegers(lhs, rhs);
+                a.load32(RAX, RBX, -2 * VALUE_SIZE + NUMBER_OFFSET);
+                a.cmp32(RAX, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+                a.setcc(integerConds[op], RAX);
+                if (notIntegers.empty()) {
+                    return;
+                }
+                done = a.jmp();
+                for (auto position : notIntegers) {
+                    a.bind(position, a.size());
+                }
+            }
+
+            loadNumber(XMM0, -2 * VALUE_SIZE, lhs);
+            loadNumber(XMM1, -VALUE_SIZE, rhs);
+            switch (op) {
+                case 0:
+                    a.ucomisd(XMM1, XMM0);
+                    a.setcc(CC_A, RAX);
+                    break;
+                case 1:
+                    a.ucomisd(XMM0, XMM1);
+                    a.setcc(CC_A, RAX);
+                    break;
+                case 2:
+                    a.ucomisd(XMM0, XMM1);
+                    a.setcc(CC_E, RAX);
+                    a.setcc(CC_NP, RCX);
+                    a.andByte(RAX, RCX);
+                    break;
+                case 3:
+                    a.ucomisd(XMM0, XMM1);
+                    a.setcc(CC_AE, RAX);
+                    break;
+                case 4:
+                    a.ucomisd(XMM1, XMM0);
+                    a.setcc(CC_AE, RAX);
+                    break;
+                default:
+                    a.ucomisd(XMM0, XMM1);
+                    a.setcc(CC_NE, RAX);
+                    a.setcc(CC_P, RCX);
+                    a.orByte(RAX, RCX);
+                    break;
+            }
+            if (done != 0) {
+                a.bind(done, a.size());
+            }
+        }
+
+        /**
+         * Binary arithmetic on the two top numbers: OP_ADD, OP_SUB, ...
+         * Two integers stay an integer, exiting on overflow so the
+         * interpreter promotes the result; OP_DIV is always a double.
+         */
+        void arithmetic(uint8_t opcode, NumberKind lhs = NumberKind::ANY,
+                        NumberKind rhs = NumberKind::ANY) {
+            size_t done = 0;
+            if (opcode != OP_DIV && lhs != NumberKind::DOUBLE && rhs != NumberKind::DOUBLE) {
+                auto notIntegers = branchUnlessIntegers(lhs, rhs);
+                a.load32(RAX, RBX, -2 * VALUE_SIZE + NUMBER_OFFSET);
+                if (opcode == OP_SUB) {
+                    a.sub32(RAX, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+                } else if (opcode == OP_MUL) {
+                    a.imul32(RAX, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+                } else {
+                    a.add32(RAX, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+                }
+                exitIf(CC_O);
+                storeInteger(-2 * VALUE_SIZE);
+                a.subImm(RBX, VALUE_SIZE);
+                if (notIntegers.empty()) {
+                    return;
+                }
+                done = a.jmp();
+                for (auto position : notIntegers) {
+                    a.bind(position, a.size());
+                }
+            }
+
+            loadNumber(XMM0, -2 * VALUE_SIZE, lhs);
+            loadNumber(XMM1, -VALUE_SIZE, rhs);
+            if (opcode == OP_SUB) {
+                a.subsd(XMM0, XMM1);
+            } else if (opcode == OP_MUL) {
+                a.mulsd(XMM0, XMM1);
+            } else if (opcode == OP_DIV) {
+                a.divsd(XMM0, XMM1);
+            } else {
+                a.addsd(XMM0, XMM1);
+            }
+            storeNumber(-2 * VALUE_SIZE);
+            a.subImm(RBX, VALUE_SIZE);
+            if (done != 0) {
+                a.bind(done, a.size());
+            }
+        }
+
+        /**
+         * [rbx + disp] = INTEGER(eax), a tagged value already an integer.
+         * Values are stored as whole words: a narrower store read back
+         * by a word load (copyValue) stalls store-to-load forwarding.
+         */
+        void storeInteger(int32_t disp) {
+#ifdef EVA_NAN_BOXING
+            a.movImm(RCX, INTEGER_BITS);
+            a.orReg(RAX, RCX);
+#endif
+            a.store(RBX, disp + NUMBER_OFFSET, RAX);
+        }
+
+        /**
+         * [rbx + disp] = NUMBER(xmm0)
+         */
+        void storeNumber(int32_t disp) {
+#ifndef EVA_NAN_BOXING
+            a.storeImm(RBX, disp, (int32_t)EvaValueType::NUMBER);
+#endif
+            a.movsdStore(RBX, disp + NUMBER_OFFSET, XMM0);
+        }
+
+        /**
+         * [rbx + disp] = BOOLEAN(al)
+         */
+        void storeBoolean(int32_t disp) {
+            a.movzxByte(RAX, RAX);
+#ifdef EVA_NAN_BOXING
+            a.movImm(RCX, FALSE_BITS);
+            a.orReg(RAX, RCX);
+            a.store(RBX, disp, RAX);
+#else
+            a.storeImm(RBX, disp, (int32_t)EvaValueType::BOOLEAN);
+            a.store(RBX, disp + NUMBER_OFFSET, RAX);
+#endif
+        }
+
+        /**
+         * Pops a boolean, returns a jcc taken if it was false
+         */
+        size_t popJumpIfFalse() {
+            a.subImm(RBX, VALUE_SIZE);
+#ifdef EVA_NAN_BOXING
+            a.load(RAX, RBX, 0);
+            a.movImm(RCX, TRUE_BITS);
+            a.cmp(RAX, RCX);
+            return a.jcc(CC_NE);
+#else
+            a.cmpImm8(RBX, NUMBER_OFFSET, 0);
+            return a.jcc(CC_E);
+#endif
+        }
+};
+
+#endif
+
+#endif
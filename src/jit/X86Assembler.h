@@ -0,0 +1,419 @@
+/**
+ * x86-64 machine code emitter
+ */
+
+#ifndef X86Assembler_h
+#define X86Assembler_h
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * General purpose registers, by encoding
+ */
+enum Reg : uint8_t {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/**
+ * SSE registers, by encoding
+ */
+enum Xmm : uint8_t {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+};
+
+/**
+ * Condition codes of jcc/setcc
+ */
+enum Cond : uint8_t {
+    CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+};
+
+/**
+ *  X86Assembler
+ *
+ *  Appends encoded instructions to `code`.  Only the forms the JIT
+ *  needs: 64-bit moves and ALU ops, 32-bit integer arithmetic,
+ *  [base + disp] memory operands, scalar double SSE2 and rel32 jumps.
+ *  Jumps return the position of their rel32 field, resolved later
+ *  with `bind`.
+ */
+class X86Assembler {
+    public:
+        std::vector<uint8_t> code;
+
+        /**
+         * Encode every displacement as disp32, so it can be patched
+         */
+        bool wideDisplacements = false;
+
+        /**
+         * Position of the last displacement emitted
+         */
+        size_t displacement = 0;
+
+        size_t size() const { return code.size(); }
+
+        // -------------------------------------------------------
+        // Moves
+
+        /**
+         * mov dst, [base + disp]
+         */
+        void load(Reg dst, Reg base, int32_t disp) { op(0x8b, dst, base, disp, true); }
+
+        /**
+         * mov [base + disp], src
+         */
+        void store(Reg base, int32_t disp, Reg src) { op(0x89, src, base, disp, true); }
+
+        /**
+         * mov byte [base + disp], src (AL..BL)
+         */
+        void storeByte(Reg base, int32_t disp, Reg src) { op(0x88, src, base, disp, false); }
+
+        /**
+         * mov dst32, [base + disp]
+         */
+        void load32(Reg dst, Reg base, int32_t disp) { op(0x8b, dst, base, disp, false); }
+
+        /**
+         * mov qword [base + disp], imm (sign-extended)
+         */
+        void storeImm(Reg base, int32_t disp, int32_t imm) {
+            op(0xc7, 0, base, disp, true);
+            emit32(imm);
+        }
+
+        /**
+         * mov dst, imm (shortest form)
+         */
+        void movImm(Reg dst, uint64_t imm) {
+            if (imm <= 0xffffffff) {
+                rex(false, 0, dst);
+                emit(0xb8 + (dst & 7));
+                emit32((uint32_t)imm);
+            } else {
+                rex(true, 0, dst);
+                emit(0xb8 + (dst & 7));
+                emit64(imm);
+            }
+        }
+
+        /**
+         * mov dst, imm64 / mov dst32, imm32 (fixed size), return the
+         * position of the immediate
+         */
+        size_t movImm64(Reg dst, uint64_t imm) {
+            rex(true, 0, dst);
+            emit(0xb8 + (dst & 7));
+            auto position = code.size();
+            emit64(imm);
+            return position;
+        }
+
+        size_t movImm32(Reg dst, uint32_t imm) {
+            rex(false, 0, dst);
+            emit(0xb8 + (dst & 7));
+            return emit32(imm);
+        }
+
+        /**
+         * mov dst, src
+         */
+        void mov(Reg dst, Reg src) { opReg(0x89, src, dst); }
+
+        /**
+         * lea dst, [base + disp]
+         */
+        void lea(Reg dst, Reg base, int32_t disp) { op(0x8d, dst, base, disp, true); }
+
+        /**
+         * movzx dst32, src8
+         */
+        void movzxByte(Reg dst, Reg src) {
+            rex(false, dst, src);
+            emit(0x0f);
+            emit(0xb6);
+            emit(0xc0 | (dst & 7) << 3 | (src & 7));
+        }
+
+        // -------------------------------------------------------
+        // Arithmetic and logic
+
+        void addImm(Reg dst, int32_t imm) { aluImm(0, dst, imm); }
+
+        void subImm(Reg dst, int32_t imm) { aluImm(5, dst, imm); }
+
+        /**
+         * add/sub/imul dst32, [base + disp]
+         */
+        void add32(Reg dst, Reg base, int32_t disp) { op(0x03, dst, base, disp, false); }
+
+        void sub32(Reg dst, Reg base, int32_t disp) { op(0x2b, dst, base, disp, false); }
+
+        void imul32(Reg dst, Reg base, int32_t disp) {
+            rex(false, dst, base);
+            emit(0x0f);
+            emit(0xaf);
+            memory(dst, base, disp);
+        }
+
+        void andReg(Reg dst, Reg src) { opReg(0x21, src, dst); }
+
+        void orReg(Reg dst, Reg src) { opReg(0x09, src, dst); }
+
+        /**
+         * and/or of the low bytes (AL..BL)
+         */
+        void andByte(Reg dst, Reg src) { opReg(0x20, src, dst, false); }
+
+        void orByte(Reg dst, Reg src) { opReg(0x08, src, dst, false); }
+
+        /**
+         * cmp a, b
+         */
+        void cmp(Reg a, Reg b) { opReg(0x39, b, a); }
+
+        /**
+         * cmp reg, [base + disp]
+         */
+        void cmpMem(Reg reg, Reg base, int32_t disp) { op(0x3b, reg, base, disp, true); }
+
+        void cmp32(Reg reg, Reg base, int32_t disp) { op(0x3b, reg, base, disp, false); }
+
+        /**
+         * cmp dword [base + disp], imm
+         */
+        void cmpImm32(Reg base, int32_t disp, int32_t imm) {
+            op(0x81, 7, base, disp, false);
+            emit32(imm);
+        }
+
+        /**
+         * cmp byte [base + disp], imm
+         */
+        void cmpImm8(Reg base, int32_t disp, int8_t imm) {
+            op(0x80, 7, base, disp, false);
+            emit(imm);
+        }
+
+        /**
+         * test reg8, reg8 (AL..BL)
+         */
+        void testByte(Reg a, Reg b) { opReg(0x84, b, a, false); }
+
+        /**
+         * setcc reg8 (AL..BL)
+         */
+        void setcc(Cond cond, Reg dst) {
+            emit(0x0f);
+            emit(0x90 + cond);
+            emit(0xc0 | (dst & 7));
+        }
+
+        // -------------------------------------------------------
+        // Scalar double
+
+        /**
+         * movsd dst, [base + disp]
+         */
+        void movsdLoad(Xmm dst, Reg base, int32_t disp) { sse(0xf2, 0x10, dst, base, disp); }
+
+        /**
+         * movsd [base + disp], src
+         */
+        void movsdStore(Reg base, int32_t disp, Xmm src) { sse(0xf2, 0x11, src, base, disp); }
+
+        /**
+         * xorpd dst, src
+         */
+        void xorpd(Xmm dst, Xmm src) { sseReg(0x66, 0x57, dst, src); }
+
+        /**
+         * cvtsi2sd dst, dword [base + disp]
+         */
+        void cvtsi2sd(Xmm dst, Reg base, int32_t disp) { sse(0xf2, 0x2a, dst, base, disp); }
+
+        /**
+         * addsd/subsd/mulsd/divsd dst, src
+         */
+        void addsd(Xmm dst, Xmm src) { sseReg(0xf2, 0x58, dst, src); }
+
+        void subsd(Xmm dst, Xmm src) { sseReg(0xf2, 0x5c, dst, src); }
+
+        void mulsd(Xmm dst, Xmm src) { sseReg(0xf2, 0x59, dst, src); }
+
+        void divsd(Xmm dst, Xmm src) { sseReg(0xf2, 0x5e, dst, src); }
+
+        /**
+         * ucomisd a, b
+         */
+        void ucomisd(Xmm a, Xmm b) { sseReg(0x66, 0x2e, a, b); }
+
+        // -------------------------------------------------------
+        // Control flow
+
+        void push(Reg reg) {
+            rex(false, 0, reg);
+            emit(0x50 + (reg & 7));
+        }
+
+        void pop(Reg reg) {
+            rex(false, 0, reg);
+            emit(0x58 + (reg & 7));
+        }
+
+        void ret() { emit(0xc3); }
+
+        /**
+         * call reg
+         */
+        void call(Reg target) {
+            rex(false, 0, target);
+            emit(0xff);
+            emit(0xc0 | 2 << 3 | (target & 7));
+        }
+
+        /**
+         * jmp reg
+         */
+        void jmp(Reg target) {
+            rex(false, 0, target);
+            emit(0xff);
+            emit(0xc0 | 4 << 3 | (target & 7));
+        }
+
+        /**
+         * jmp rel32, returns the position of rel32
+         */
+        size_t jmp() {
+            emit(0xe9);
+            return emit32(0);
+        }
+
+        /**
+         * jcc rel32, returns the position of rel32
+         */
+        size_t jcc(Cond cond) {
+            emit(0x0f);
+            emit(0x80 + cond);
+            return emit32(0);
+        }
+
+        /**
+         * Negates the condition of the jcc whose rel32 is at `position`
+         */
+        void invert(size_t position) { code[position - 1] ^= 1; }
+
+        /**
+         * Points the rel32 at `position` to `target`
+         */
+        void bind(size_t position, size_t target) {
+            int32_t rel = (int32_t)(target - (position + 4));
+            std::memcpy(&code[position], &rel, 4);
+        }
+
+    private:
+        void emit(uint8_t byte) { code.push_back(byte); }
+
+        size_t emit32(uint32_t value) {
+            auto position = code.size();
+            code.resize(position + 4);
+            std::memcpy(&code[position], &value, 4);
+            return position;
+        }
+
+        void emit64(uint64_t value) {
+            auto position = code.size();
+            code.resize(position + 8);
+            std::memcpy(&code[position], &value, 8);
+        }
+
+        /**
+         * REX prefix, omitted when no bit is set
+         */
+        void rex(bool wide, uint8_t reg, uint8_t base) {
+            uint8_t bits = (wide ? 8 : 0) | (reg & 8) >> 1 | (base & 8) >> 3;
+            if (bits != 0) {
+                emit(0x40 | bits);
+            }
+        }
+
+        /**
+         * ModRM (+ SIB) and displacement of [base + disp]
+         */
+        void memory(uint8_t reg, Reg base, int32_t disp) {
+            auto small = disp >= -128 && disp <= 127 && !wideDisplacements;
+            emit((small ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+            if ((base & 7) == RSP) {
+                emit(0x24);
+            }
+            displacement = code.size();
+            if (small) {
+                emit((uint8_t)disp);
+            } else {
+                emit32(disp);
+            }
+        }
+
+        /**
+         * opcode reg, [base + disp]
+         */
+        void op(uint8_t opcode, uint8_t reg, Reg base, int32_t disp, bool wide) {
+            rex(wide, reg, base);
+            emit(opcode);
+            memory(reg, base, disp);
+        }
+
+        /**
+         * opcode rm, reg (register direct)
+         */
+        void opReg(uint8_t opcode, uint8_t reg, uint8_t rm, bool wide = true) {
+            rex(wide, reg, rm);
+            emit(opcode);
+            emit(0xc0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        /**
+         * Group 1 ALU op with an immediate: 0 add, 5 sub, 7 cmp
+         */
+        void aluImm(uint8_t ext, Reg dst, int32_t imm) {
+            rex(true, 0, dst);
+            if (imm >= -128 && imm <= 127) {
+                emit(0x83);
+                emit(0xc0 | ext << 3 | (dst & 7));
+                emit((uint8_t)imm);
+            } else {
+                emit(0x81);
+                emit(0xc0 | ext << 3 | (dst & 7));
+                emit32(imm);
+            }
+        }
+
+        /**
+         * prefix [REX] 0F opcode xmm, [base + disp]
+         */
+        void sse(uint8_t prefix, uint8_t opcode, uint8_t xmm, Reg base, int32_t disp) {
+            emit(prefix);
+            rex(false, xmm, base);
+            emit(0x0f);
+            emit(opcode);
+            memory(xmm, base, disp);
+        }
+
+        /**
+         * prefix 0F opcode xmm, xmm (XMM0..XMM7)
+         */
+        void sseReg(uint8_t prefix, uint8_t opcode, Xmm dst, Xmm src) {
+            emit(prefix);
+            emit(0x0f);
+            emit(opcode);
+            emit(0xc0 | (dst & 7) << 3 | (src & 7));
+        }
+};
+
+#endif
@@ -228,15 +228,16 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    auto strSlice = str_.substr(cursor_);
-
     auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
 
     for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
+      const auto& rule = lexRules_[ruleIndex];
       std::smatch sm;
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
+      // Anchored at the cursor: an unanchored search scans (and copies)
+      // the rest of the input for every token
+      if (std::regex_search(str_.cbegin() + cursor_, str_.cend(), sm, rule.regex,
+                            std::regex_constants::match_continuous)) {
         yytext = sm[0];
 
         captureLocations_(yytext);
@@ -264,7 +265,7 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
+    throwUnexpectedToken(std::string(1, str_[cursor_]), currentLine_,
                          currentColumn_);
   }
 
@@ -19,20 +19,47 @@ EvaValue createTestFunction(const std::string &name, size_t arity = 0) {
     return coValue;
 }
 
-TestResult runTest(EvaValue expectedResult, const char* testProgram, bool showStackDump) {
-    EvaVM vm;
+/**
+ * With a JIT, every code object is compiled on its first call or loop
+ * iteration (no stack dumps, which need the interpreter).  The heap is
+ * collected at every allocation, or with `incremental`, always being
+ * collected a slice per safepoint.
+ */
+TestResult runTestOnTier(EvaValue expectedResult, const char* testProgram, bool showStackDump,
+                         BytecodeTier tier, JitTier jit = JitTier::NONE,
+                         bool incremental = false) {
+    VMOptions options;
+    options.jit = jit;
+    options.jitThreshold = 1;
+    options.gcThreshold = 0;
+    options.gcGrowth = 0;
+    if (incremental) {
+        options.gcSlice = 1;
+        options.gcSliceInterval = 1;
+        options.nurserySize = 1024;
+    }
+    EvaVM vm(options);
+    vm.tier = tier;
 
     std::cout << std::endl << std::endl << "======================" << std::endl
-        << "Testing this program: " << std::endl
+        << "Testing this program (" << (tier == BytecodeTier::REGISTER ? "registers" : "stack")
+        << " tier" << (jit == JitTier::BASELINE ? ", jit" : jit == JitTier::STENCIL ? ", stencils"
+                       : jit == JitTier::TRACE ? ", traces" : "")
+        << (incremental ? ", incremental gc" : "") << "): " << std::endl
         << testProgram << std::endl
         << "======================" << std::endl << std::endl;
 
-    auto actualResult = vm.exec(testProgram);
+    auto actualResult = jit != JitTier::NONE ? vm.exec(testProgram, true, TraceMode::NONE)
+                                             : vm.exec(testProgram);
 
     // Let's see if the test passed
     bool passed = false;
-    if (IS_NUMBER(expectedResult)) {
-        passed = AS_NUMBER(actualResult) == AS_NUMBER(expectedResult);
+    if (IS_INTEGER(expectedResult)) {
+        passed = IS_INTEGER(actualResult) && AS_INTEGER(actualResult) == AS_INTEGER(expectedResult);
+    } else if (IS_NUMBER(expectedResult)) {
+        passed = IS_NUMBER(actualResult) && AS_NUMBER(actualResult) == AS_NUMBER(expectedResult);
+    } else if (IS_BOOLEAN(expectedResult)) {
+        passed = IS_BOOLEAN(actualResult) && AS_BOOLEAN(actualResult) == AS_BOOLEAN(expectedResult);
     } else if (IS_STRING(expectedResult)) {
         passed = AS_CPPSTRING(actualResult) == AS_CPPSTRING(expectedResult);
     } else if (IS_FUNCTION(expectedResult)) {
@@ -68,6 +95,133 @@ TestResult runTest(EvaValue expectedResult, const char* testProgram, bool showSt
     };
 }
 
+/**
+ * Runs the program on both bytecode tiers, under both JITs and with
+ * incremental collection, passes only if all do
+ */
+TestResult runTest(EvaValue expectedResult, const char* testProgram, bool showStackDump) {
+    auto result = runTestOnTier(expectedResult, testProgram, showStackDump, BytecodeTier::STACK);
+    if (!result.passed) {
+        return result;
+    }
+    result = runTestOnTier(expectedResult, testProgram, showStackDump, BytecodeTier::STACK,
+                           JitTier::NONE, true);
+    if (!result.passed) {
+        return result;
+    }
+#ifdef EVA_JIT
+    for (auto jit : {JitTier::BASELINE, JitTier::STENCIL, JitTier::TRACE}) {
+        result = runTestOnTier(expectedResult, testProgram, showStackDump, BytecodeTier::STACK, jit);
+        if (!result.passed) {
+            return result;
+        }
+    }
+#endif
+    return runTestOnTier(expectedResult, testProgram, showStackDump, BytecodeTier::REGISTER);
+}
+
+/**
+ * Runs the program collecting at every allocation, passes if it ends
+ * with `expected` and at most `maxObjects` objects left in the heap
+ */
+TestResult runHeapTest(EvaValue expected, size_t maxObjects, const char* testProgram) {
+    VMOptions options;
+    options.gcThreshold = 0;
+    options.gcGrowth = 0;
+    EvaVM vm(options);
+    std::cout << std::endl << std::endl << "======================" << std::endl
+        << "Testing the heap of: " << std::endl
+        << testProgram << std::endl
+        << "======================" << std::endl << std::endl;
+
+    auto result = vm.exec(testProgram, false, TraceMode::NONE);
+    vm.dumpHeapStats();
+
+    auto passed = AS_CPPSTRING(result) == AS_CPPSTRING(expected) && vm.heap.count <= maxObjects;
+    std::cout << (passed ? "-- Test passed --" : "-- Test failed --") << std::endl;
+    return TestResult {expected, result, testProgram, passed};
+}
+
+/**
+ * Runs the program with a small nursery, passes if it ends with
+ * `expected` after minor collections that promoted at most
+ * `maxPromoted` objects
+ */
+TestResult runNurseryTest(EvaValue expected, size_t maxPromoted, const char* testProgram) {
+    VMOptions options;
+    options.nurserySize = 4096;
+    EvaVM vm(options);
+    std::cout << std::endl << std::endl << "======================" << std::endl
+        << "Testing the nursery of: " << std::endl
+        << testProgram << std::endl
+        << "======================" << std::endl << std::endl;
+
+    auto result = vm.exec(testProgram, false, TraceMode::NONE);
+    vm.dumpHeapStats();
+
+    auto& stats = vm.heap.stats;
+    auto passed = AS_CPPSTRING(result) == AS_CPPSTRING(expected) &&
+                  stats.minorCollections > 0 && stats.objectsPromoted <= maxPromoted;
+    std::cout << (passed ? "-- Test passed --" : "-- Test failed --") << std::endl;
+    return TestResult {expected, result, testProgram, passed};
+}
+
+/**
+ * Runs the program without a nursery, the heap always being collected
+ * a slice per safepoint; passes if it ends with `expected` after
+ * collections of more than one slice each
+ */
+TestResult runIncrementalTest(EvaValue expected, const char* testProgram) {
+    VMOptions options;
+    options.gcThreshold = 0;
+    options.gcGrowth = 0;
+    options.gcSlice = 1;
+    options.gcSliceInterval = 1;
+    options.nurserySize = 0;
+    EvaVM vm(options);
+    std::cout << std::endl << std::endl << "======================" << std::endl
+        << "Testing incremental collection of: " << std::endl
+        << testProgram << std::endl
+        << "======================" << std::endl << std::endl;
+
+    auto result = vm.exec(testProgram, false, TraceMode::NONE);
+    vm.dumpHeapStats();
+
+    auto& stats = vm.heap.stats;
+    auto passed = AS_CPPSTRING(result) == AS_CPPSTRING(expected) && stats.collections > 0 &&
+                  stats.slices > 2 * stats.collections;
+    std::cout << (passed ? "-- Test passed --" : "-- Test failed --") << std::endl;
+    return TestResult {expected, result, testProgram, passed};
+}
+
+/**
+ * Runs the program collecting type feedback, passes if the recorded
+ * sites of all code objects print as `expected` ("; " separated)
+ */
+TestResult runFeedbackTest(const char* expected, const char* testProgram) {
+    EvaVM vm;
+    std::cout << std::endl << std::endl << "======================" << std::endl
+        << "Testing the feedback of: " << std::endl
+        << testProgram << std::endl
+        << "======================" << std::endl << std::endl;
+
+    vm.exec(testProgram, false, TraceMode::FEEDBACK);
+
+    std::string actual;
+    for (auto co : vm.compiler->getCodeObjects()) {
+        for (size_t offset = 0; offset < co->feedback.size(); offset++) {
+            if (co->feedback[offset].count != 0) {
+                actual += (actual.empty() ? "" : "; ") +
+                          feedbackToString(co->feedback[offset], co->code[offset]);
+            }
+        }
+    }
+
+    auto passed = actual == expected;
+    std::cout << (passed ? "-- Test passed --" : "-- Test failed --") << std::endl;
+    return TestResult {ALLOC_STRING(expected), ALLOC_STRING(actual), testProgram, passed};
+}
+
 void runTheTests () {
     std::vector<TestResult> results;
 
@@ -270,6 +424,334 @@ void runTheTests () {
                 (bar)))
     )", false));
 
+    // A local operand keeps its value when the other operand assigns it
+    results.push_back(runTest(INTEGER(6), R"(
+        (begin (var x 1) (+ x (set x 5)))
+    )", false));
+    results.push_back(runTest(INTEGER(2), R"(
+        (def f (x) (- x (begin (set x 10) 1)))
+        (f 3)
+    )", false));
+    results.push_back(runTest(INTEGER(200), R"(
+        (def g (n) (if (< n (begin (set n 0) 1)) 103 200))
+        (g 5)
+    )", false));
+
+    // Superinstructions around jump targets
+    results.push_back(runTest(NUMBER(45), R"(
+        (def sum-to (n)
+            (begin
+                (var i 0)
+                (var sum 0)
+                (while (< i n)
+                    (begin
+                        (set sum (+ sum i))
+                        (set i (+ i 1))))
+                sum))
+
+        (sum-to 10)
+    )", false));
+    // Compare and branch
+    results.push_back(runTest(NUMBER(111), R"(
+        (var n 0)
+        (if (!= "a" "b") (set n (+ n 1)) 0)
+        (if (<= 2 2) (set n (+ n 10)) 0)
+        (if (== 1 2) 0 (set n (+ n 100)))
+        (if (> 1 2) (set n 0) n)
+    )", false));
+    // Quickened instructions fall back when operand types change
+    results.push_back(runTest(ALLOC_STRING("ab"), R"(
+        (def add (a b) (+ a b))
+        (def less (a b) (< a b))
+        (add 1 2)
+        (less 1 2)
+        (less "a" "b")
+        (add "a" "b")
+    )", false));
+    // Quickened concatenation of strings past the short string buffer,
+    // leak-free under the computed-goto loop (check with LeakSanitizer)
+    std::string appended;
+    for (auto i = 0; i < 200; i++) {
+        appended += "a string longer than a short one";
+    }
+    results.push_back(runTest(ALLOC_STRING(appended), R"(
+        (var s "")
+        (var i 0)
+        (while (< i 200)
+            (begin
+                (set s (+ s "a string longer than a short one"))
+                (set i (+ i 1))))
+        s
+    )", false));
+    // Tail calls run in constant frames (deeper than MAX_CALL_DEPTH)
+    results.push_back(runTest(NUMBER(10000), R"(
+        (def loop (n acc)
+            (if (== n 0)
+                acc
+                (loop (- n 1) (+ acc 1))))
+        (loop 10000 0)
+    )", false));
+
+    // Tail calls from a block with locals, and to a native
+    results.push_back(runTest(NUMBER(27), R"(
+        (def add1 (x) (+ x 1))
+        (def f (n)
+            (begin
+                (var m (* n 2))
+                (add1 m)))
+        (def sq (x) (native-square x))
+        (+ (f 5) (sq 4))
+    )", false));
+    // Natives read their arguments in place
+    results.push_back(runTest(NUMBER(14), R"(
+        (def f (x) (native-sum x (native-square 3)))
+        (native-sum (f 1) 4)
+    )", false));
+    // Natives called through a variable and a parameter (arity checked
+    // at run time)
+    results.push_back(runTest(NUMBER(10), R"(
+        (var f native-sum)
+        (def apply (h x y) (h x y))
+        (+ (f 1 2) (apply f 3 4))
+    )", false));
+    // Numeric loop with a call; the JIT exits on the string operands
+    results.push_back(runTest(ALLOC_STRING("45aaa"), R"(
+        (def add (a b) (+ a b))
+        (var x 0)
+        (var i 0)
+        (while (< i 10)
+            (begin
+                (set x (add x (/ i 2)))
+                (set i (+ i 1))))
+        (var s "")
+        (set i 0)
+        (while (!= i 3)
+            (begin
+                (set s (add s "a"))
+                (set i (+ i 1))))
+        (if (== (* x 2) 45) (add "45" s) s)
+    )", false));
+    // Cells and string compares in a loop (stencil helpers)
+    results.push_back(runTest(NUMBER(32), R"(
+        (begin
+            (var k 1)
+            (var i 0)
+            (def add-k (x) (+ x k))
+            (while (< (set i (+ i 1)) 6)
+                (set k (if (< "a" "b") (add-k k) 0)))
+            k)
+    )", false));
+    // Traced loop: both if branches, leaving the trace on the other one;
+    // x turns into a string, failing its guard at the trace entry
+    results.push_back(runTest(ALLOC_STRING("s"), R"(
+        (var i 0)
+        (var s 0)
+        (var f 0)
+        (var x 0)
+        (while (< i 10)
+            (begin
+                (if (== f 0)
+                    (set s (+ s i))
+                    (set s (- s 1)))
+                (set f (- 1 f))
+                (set x (if (< i 7) (+ x 1) "s"))
+                (set i (+ i 1))))
+        (if (== s 15) x s)
+    )", false));
+    // Small integers: a counter stays one, a product overflows into a
+    // double, division and mixed operands are doubles
+    results.push_back(runTest(INTEGER(100), R"(
+        (var i 0)
+        (while (< i 100) (set i (+ i 1)))
+        i
+    )", false));
+    results.push_back(runTest(NUMBER(1099511627776.0), R"(
+        (var x 1)
+        (var i 0)
+        (while (< i 40)
+            (begin
+                (set x (* x 2))
+                (set i (+ i 1))))
+        x
+    )", false));
+    results.push_back(runTest(NUMBER(4.5), R"(
+        (+ (/ 7 2) 1)
+    )", false));
+    // Wide operands: 300 globals and constants, 300 locals in a block
+    std::string manyGlobals;
+    std::string manyLocals = "(begin";
+    for (auto i = 0; i < 300; i++) {
+        auto n = std::to_string(i);
+        manyGlobals += "(var g" + n + " " + std::to_string(i * 7) + ")\n";
+        manyLocals += " (var l" + n + " " + n + ")";
+    }
+    manyGlobals += "(+ g299 g1)";
+    manyLocals += " (set l280 (+ l299 l1)) l280)";
+    results.push_back(runTest(INTEGER(2100), manyGlobals.c_str(), false));
+    results.push_back(runTest(INTEGER(300), manyLocals.c_str(), false));
+    // Jumps across more than 64 KB of code, both ways
+    std::string longLoop = "(var x 0) (var i 0) (while (< i 3) (begin";
+    for (auto i = 0; i < 100; i++) {
+        longLoop += " (begin";
+        for (auto j = 0; j < 150; j++) {
+            longLoop += " (set x (+ x 1))";
+        }
+        longLoop += ")";
+    }
+    longLoop += " (set i (+ i 1)))) x";
+    results.push_back(runTest(INTEGER(45000), longLoop.c_str(), false));
+
+    // Stack heights the verifier checks: if without else, a local
+    // declared last in a block, a lambda not last
+    results.push_back(runTest(BOOLEAN(false), R"(
+        (if (> 1 2) 3)
+    )", false));
+    results.push_back(runTest(INTEGER(8), R"(
+        (def double (a) (begin (var b (* a 2))))
+        (double 4)
+    )", false));
+    results.push_back(runTest(INTEGER(5), R"(
+        (begin (lambda (x) x) 5)
+    )", false));
+    // A function without params whose block declares only captured
+    // variables still pops itself
+    results.push_back(runTest(INTEGER(2), R"(
+        (def counter ()
+            (begin
+                (var n 0)
+                (lambda () (set n (+ n 1)))))
+        (var c (counter))
+        (c)
+        (c)
+    )", false));
+
+    // Own cells per activation: recursion keeps each frame's x
+    results.push_back(runTest(INTEGER(6), R"(
+        (def f (n)
+            (begin
+                (var x n)
+                (var g (lambda (k) (+ x k)))
+                (var r (if (> n 0) (f (- n 1)) 0))
+                (+ x r)))
+        (f 3)
+    )", false));
+
+    // Every captured parameter gets its own argument, not the last one
+    results.push_back(runTest(ALLOC_STRING("a"), R"(
+        (def pair (h t) (lambda (pick) (if pick h t)))
+        ((pair "a" "b") true)
+    )", false));
+
+    // A block inside a function body that is not a block keeps the
+    // params on the stack
+    results.push_back(runTest(INTEGER(12), R"(
+        (def f (a b) (if (> a 0) (begin (var c (* a b)) c) b))
+        (f 3 4)
+    )", false));
+
+    // Lambda lifting: the loop variables are passed to step
+    results.push_back(runTest(INTEGER(10), R"(
+        (def sum ()
+            (begin
+                (var s 0)
+                (var i 0)
+                (def step () (+ s i))
+                (while (< i 5)
+                    (begin
+                        (set s (step))
+                        (set i (+ i 1))))
+                s))
+        (sum)
+    )", false));
+
+    // Not lifted: a call under a shadowing y, a stored function and a
+    // function assigning its free variable
+    results.push_back(runTest(INTEGER(1 + 300 + 3), R"(
+        (def f ()
+            (begin
+                (var y 1)
+                (def get () y)
+                (begin (var y 7) (get))))
+        (def g ()
+            (begin
+                (var y 100)
+                (def bar (k) (if (> k 0) (+ y (bar (- k 1))) 0))
+                (var h bar)
+                (h 3)))
+        (def h ()
+            (begin
+                (var y 1)
+                (def inc () (set y (+ y 1)))
+                (inc)
+                (inc)
+                y))
+        (+ (+ (f) (g)) (h))
+    )", false));
+
+    // Garbage strings, cells and closures are freed
+    results.push_back(runHeapTest(ALLOC_STRING("abab"), 40, R"(
+        (def twice (s)
+            (begin
+                (var get (lambda () s))
+                (var same get)
+                (+ (get) (same))))
+        (var r "")
+        (var i 0)
+        (while (< i 1000)
+            (begin
+                (set r (twice "ab"))
+                (set i (+ i 1))))
+        r
+    )"));
+
+    // Temporaries die young; a promoted cell set to a young string
+    // keeps it through the write barrier
+    results.push_back(runNurseryTest(ALLOC_STRING(std::string(300, 'a')), 200, R"(
+        (def keeper ()
+            (begin
+                (var kept "")
+                (lambda (v) (begin (set kept (+ kept v)) kept))))
+        (var keep (keeper))
+        (var i 0)
+        (while (< i 300)
+            (begin
+                (+ "x" "y")
+                (keep "a")
+                (set i (+ i 1))))
+        (keep "")
+    )"));
+
+    // Strings moved between cells while the heap is marked stay
+    // reachable through the write barrier
+    results.push_back(runIncrementalTest(ALLOC_STRING("a string longer than a short one"), R"(
+        (def box (v)
+            (begin
+                (var x v)
+                (lambda (put w) (if put (begin (set x w) x) x))))
+        (var a (box (+ "a string longer " "than a short one")))
+        (var b (box ""))
+        (var i 0)
+        (while (< i 2000)
+            (begin
+                (b true (a false 0))
+                (a true "")
+                (+ "x" "y")
+                (a true (b false 0))
+                (b true "")
+                (+ "x" "y")
+                (set i (+ i 1))))
+        (a false 0)
+    )"));
+
+    // Operand kinds, callees and branch ratios
+    results.push_back(runFeedbackTest(
+        "int, int; taken 20% of 5; calls add x4; calls add x1; "
+        "int|string, int|string x5", R"(
+        (def add (a b) (+ a b))
+        (var i 0)
+        (while (< i 4) (set i (add i 1)))
+        (add "a" "b")
+    )"));
 
     std::cout << "=============================" << std::endl
         << "Results:" << std::endl;
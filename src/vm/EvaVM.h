@@ -5,18 +5,30 @@
 #ifndef __EvaVM_h
 #define __EvaVM_h
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <array>
+#include <iomanip>
 #include <iostream>
 #include <stack>
 
 #include "../Logger.h"
 #include "../bytecode/OpCode.h"
 #include "../compiler/EvaCompiler.h"
+#include "../compiler/EvaRegisterCompiler.h"
+#include "../gc/EvaCollector.h"
+#include "../jit/EvaJit.h"
+#include "../jit/EvaStencils.h"
+#include "../jit/EvaTracer.h"
 #include "../parser/EvaParser.h"
 #include "EvaValue.h"
+#include "EvalPolicy.h"
 #include "Global.h"
+#include "NativeBinding.h"
+#include "OperandStack.h"
+#include "TypeFeedback.h"
 
 using syntax::EvaParser;
 
@@ -24,11 +36,105 @@ using syntax::EvaParser;
 
 #define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
 
-#define TO_ADDRESS(index) (&fn->co->code[index])
+/**
+ * Jump offset, relative to the end of the jump
+ */
+#define READ_JUMP() (ip += 4, readJumpOffset(ip - 4))
+
+#define GET_CONST() (constants[READ_BYTE()])
+
+/**
+ * Default operand stack size in values, see VMOptions
+ */
+#define STACK_SIZE (64 * 1024)
+
+/**
+ * Default maximum call depth, see VMOptions
+ */
+#define MAX_CALL_DEPTH 8192
+
+/**
+ * Default calls plus loop back-edges before a function is compiled,
+ * see VMOptions
+ */
+#define JIT_THRESHOLD 1000
+
+/**
+ * Default heap size in bytes that starts the first collection, and
+ * growth of the live heap to the next one, see VMOptions
+ */
+#define GC_THRESHOLD (1024 * 1024)
+#define GC_GROWTH 2
+
+/**
+ * Default nursery size in bytes, see VMOptions
+ */
+#define NURSERY_SIZE (256 * 1024)
+
+/**
+ * Default safepoints between the slices of an incremental collection,
+ * see VMOptions
+ */
+#define GC_SLICE_INTERVAL 64
+
+/**
+ * Allocation at run time: a safepoint, which collects first once the
+ * nursery is full or the heap is over its threshold.  Collections move
+ * young objects: arguments are read after it.
+ */
+#define MEM(allocator, ...) (maybeGC(), allocator(__VA_ARGS__))
+
+/**
+ * Instruction dispatch.
+ *
+ * With GCC/Clang the eval loop is threaded: every handler ends with its
+ * own indirect jump through a table of label addresses (computed goto),
+ * instead of going back to the single switch.  Define EVA_NO_COMPUTED_GOTO
+ * at build time to force the portable switch-based loop.
+ *
+ * The jump out of a handler skips the destructors of its locals, so
+ * nothing with a destructor (std::string) may be in scope at DISPATCH.
+ */
+#if !defined(EVA_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define EVA_COMPUTED_GOTO
+#endif
 
-#define GET_CONST() (fn->co->constants[READ_BYTE()])
+#ifdef EVA_COMPUTED_GOTO
 
-#define STACK_LIMIT 512
+#define OP_CASE(op) case op: L_##op
+
+#define OP_DEFAULT default: L_UNKNOWN
+
+#define DISPATCH_LABEL(op) dispatchTable[op] = &&L_##op
+
+#define DISPATCH()                              \
+    do {                                        \
+        opcode = READ_BYTE();                   \
+        Trace::onInstruction(*this, opcode);    \
+        goto *dispatchTable[opcode];            \
+    } while (false)
+
+#else
+
+#define OP_CASE(op) case op
+
+#define OP_DEFAULT default
+
+#define DISPATCH() break
+
+#endif
+
+/**
+ * GCC's SLP vectorizer turns some EvaValue copies into 16-byte vector
+ * moves, which defeat store-to-load forwarding with the 4/8-byte field
+ * reads of the next instruction.  Whether it does depends on unrelated
+ * code changes (up to 2x swings), so the eval loops opt out.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define EVAL_LOOP __attribute__((optimize("no-tree-slp-vectorize")))
+#else
+#define EVAL_LOOP
+#endif
 
 /**
  * Generic binary operation
@@ -41,32 +147,84 @@ using syntax::EvaParser;
     } while (false)
 
 /**
- * Generic values comparison
- */ 
-#define COMPARE_VALUES(op, v1, v2)      \
-    do {                                \
-        bool res;                       \
-        switch (op) {                   \
-            case 0:                     \
-                res = v1 < v2;          \
-                break;                  \
-            case 1:                     \
-                res = v1 > v2;          \
-                break;                  \
-            case 2:                     \
-                res = v1 == v2;         \
-                break;                  \
-            case 3:                     \
-                res = v1 >= v2;         \
-                break;                  \
-            case 4:                     \
-                res = v1 <= v2;         \
-                break;                  \
-            case 5:                     \
-                res = v1 != v2;         \
-                break;                  \
-        }                               \
-        push(BOOLEAN(res));             \
+ * Integer or double operation: addNumbers, subNumbers, mulNumbers
+ */
+#define NUMBER_OP(fn) \
+    do { \
+        auto op2 = pop(); \
+        auto op1 = pop(); \
+        push(fn(op1, op2)); \
+    } while (false)
+
+#define COMPARE_VALUES(op, v1, v2) push(BOOLEAN(compareValues(op, v1, v2)))
+
+/**
+ * Quickening: rewrites the instruction at `address` in place.
+ */
+#define QUICKEN(address, op) (*(address) = (op))
+
+/**
+ * Guard failure: rewrites the instruction back to its generic form and
+ * runs that instead.  (Not in a do-while: DISPATCH may be a `break`.)
+ */
+#define DEOPTIMIZE(address, op)                                             \
+    {                                                                       \
+        *(address) = (op);                                                  \
+        ip = (address);                                                     \
+        DISPATCH();                                                         \
+    }
+
+/**
+ * Quickened number comparison, OP_LT_NUM + op
+ */
+#define COMPARE_NUM(op)                                                     \
+    {                                                                       \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                   \
+            DEOPTIMIZE(ip - 1, OP_COMPARE);                                 \
+        }                                                                   \
+        ip++;                                                               \
+        auto v2 = pop();                                                    \
+        auto v1 = pop();                                                    \
+        push(BOOLEAN(compareNumberValues(op, v1, v2)));                     \
+        DISPATCH();                                                         \
+    }
+
+/**
+ * Compare and branch: pops two values, jumps unless the opposite of
+ * relation `op` holds (see OP_JMP_IF_LT)
+ */
+#define JUMP_IF_COMPARE(op)                                                 \
+    do {                                                                    \
+        auto jump = READ_JUMP();                                            \
+        auto op2 = pop();                                                   \
+        auto op1 = pop();                                                   \
+        auto opposite = IS_NUMBER(op1) && IS_NUMBER(op2)                    \
+            ? compareNumberValues((op + 3) % 6, op1, op2)                   \
+            : compareObjects((op + 3) % 6, op1, op2);                       \
+        if (!opposite) {                                                    \
+            ip += jump;                                                     \
+        }                                                                   \
+    } while (false)
+
+/**
+ * Register tier operands
+ */
+#define READ_REG() bp[READ_BYTE()]
+
+#define REG_BINARY_OP(op)                                           \
+    do {                                                            \
+        auto& dest = READ_REG();                                    \
+        auto v1 = AS_NUMBER(READ_REG());                            \
+        auto v2 = AS_NUMBER(READ_REG());                            \
+        dest = NUMBER(v1 op v2);                                    \
+    } while (false)
+
+#define REG_NUMBER_OP(fn)                                           \
+    do {                                                            \
+        auto& dest = READ_REG();                                    \
+        auto v1 = READ_REG();                                       \
+        auto v2 = READ_REG();                                       \
+        dest = fn(v1, v2);                                          \
     } while (false)
 
 // --------------------------------------------------------------
@@ -89,352 +247,1355 @@ struct Frame {
      * contains code, locals, etc.
      */ 
     FunctionObject* fn;
+
+    /**
+     * Cached fn->co->code.data() and fn->co->constants.data()
+     */
+    uint8_t* code;
+    EvaValue* constants;
+
+    /**
+     * Start of the caller's cells in EvaVM::cellStack
+     */
+    size_t cellBase;
+};
+
+/**
+ * Native code compiler used by eval, see VMOptions::jit
+ */
+enum class JitTier {
+    /**
+     * Interpret only
+     */
+    NONE,
+
+    /**
+     * EvaJit, once a code object is hot
+     */
+    BASELINE,
+
+    /**
+     * EvaStencils (copy and patch), on the first call or loop iteration
+     */
+    STENCIL,
+
+    /**
+     * EvaTracer, hot while loops only
+     */
+    TRACE,
 };
 
+/**
+ * VM construction options.
+ */
+struct VMOptions {
+    /**
+     * Operand stack size in values
+     */
+    size_t stackSize = STACK_SIZE;
+
+    /**
+     * Maximum number of active calls
+     */
+    size_t maxCallDepth = MAX_CALL_DEPTH;
+
+    /**
+     * Native code compiler (stack tier, no tracing)
+     */
+    JitTier jit = JitTier::NONE;
+
+    /**
+     * Calls plus loop back-edges before the baseline JIT compiles a
+     * code object; back-edges before a loop is traced
+     */
+    size_t jitThreshold = JIT_THRESHOLD;
+
+    /**
+     * Heap bytes before the first collection, and at least before each
+     * next one
+     */
+    size_t gcThreshold = GC_THRESHOLD;
+
+    /**
+     * The next collection starts when the heap is this many times the
+     * bytes that survived the last one
+     */
+    size_t gcGrowth = GC_GROWTH;
+
+    /**
+     * Bytes of the young generation, 0 to allocate every object in the
+     * heap
+     */
+    size_t nurserySize = NURSERY_SIZE;
+
+    /**
+     * Objects marked or swept per slice of an incremental collection,
+     * 0 to collect the whole heap in one pause
+     */
+    size_t gcSlice = 0;
+
+    /**
+     * Safepoints (allocations and loop back-edges) between two slices
+     */
+    size_t gcSliceInterval = GC_SLICE_INTERVAL;
+};
+
+
+/**
+ * Bytecode format to compile to and run, chosen per exec.
+ */
+enum class BytecodeTier {
+    STACK,
+    REGISTER,
+};
 
 // --------------------------------------------------------------
 class EvaVM {
     public:
-        EvaVM() 
+        EvaVM(const VMOptions& options = VMOptions()) 
             :   global(std::make_shared<Global>()),
                 parser(std::make_unique<EvaParser>()),
-                compiler(std::make_unique<EvaCompiler>(global)) {
+                compiler(std::make_unique<EvaCompiler>(global)),
+                registerCompiler(std::make_unique<EvaRegisterCompiler>(global)),
+                options(options),
+                stack(options.stackSize),
+                frames(options.maxCallDepth) {
+                    HeapScope scope(heap);
+                    heap.nextCollection = options.gcThreshold;
+                    heap.nursery.reserve(options.nurserySize);
                     setGlobalVariables();
                 }
 
-            
-        void push(const EvaValue& value) {
-            if ((size_t) (sp - stack.begin()) == STACK_LIMIT) {
-                DIE << "push(): Stack overflow. \n";
+        /**
+         * Frees the heap, except what the last result references: it
+         * stays valid, moved to the permanent heap
+         */
+        ~EvaVM() {
+            finishCycle();
+            collector.scavenge(heap, [this](auto visitValue, auto) { visitValue(result); });
+            collector.markValue(result);
+            collector.trace();
+            collector.sweep(heap, [this](Object* object) { onFree(object); });
+
+            while (heap.objects != nullptr) {
+                auto object = heap.objects;
+                heap.objects = object->next;
+                Heap::permanent().link(object);
             }
+        }
+
+
+        /**
+         * Stack operations, unchecked: the verifier proved code never
+         * pops past its frame and bounded how far it pushes, reserved
+         * once per frame by reserveStack
+         */
+        ALWAYS_INLINE void push(const EvaValue& value) {
             *sp = value;
             sp++;
         }
 
-        EvaValue pop() {
-            if (sp == stack.begin()) {
-                DIE << "pop(): empty stack. \n";
-            }
+        ALWAYS_INLINE EvaValue pop() {
             --sp;
             return *sp;
         }
 
-        EvaValue peek(size_t offset = 0) {
-            if (stack.size() == 0) {
-                DIE << "pop(): empty stack. \n";
-            }
+        ALWAYS_INLINE EvaValue peek(size_t offset = 0) {
             return *(sp - 1 - offset);
         }
 
-        void popN(size_t count) {
-            if (stack.size() == 0) {
-                DIE << "popN(): empty stack. \n";
-            }
+        ALWAYS_INLINE void popN(size_t count) {
             sp -= count;
         }
 
+        /**
+         * Room for the values `co` pushes in a frame starting at sp.
+         * Guard pages catch an overflow without the check.
+         */
+        ALWAYS_INLINE void reserveStack(CodeObject* co) {
+#ifndef EVA_GUARD_PAGES
+            if (sp + co->maxStack > stack.end()) {
+                DIE << "push(): Stack overflow. \n";
+            }
+#endif
+        }
+
+        /**
+         * Saves the caller context, restored by popFrame
+         */
+        ALWAYS_INLINE void pushFrame() {
+            if (csp == frames.data() + frames.size()) {
+                DIE << "Stack overflow: maximum call depth (" << frames.size() << ") exceeded";
+            }
+            *csp++ = Frame{ip, bp, fn, code, constants, cellBase};
+            cellBase += fn->co->cellNames.size();
+        }
+
+        ALWAYS_INLINE void popFrame() {
+            auto& frame = *--csp;
+            ip = frame.ra;
+            bp = frame.bp;
+            fn = frame.fn;
+            code = frame.code;
+            constants = frame.constants;
+            cellBase = frame.cellBase;
+            cells = cellStack.data() + cellBase;
+        }
+
+        /**
+         * Calls a native with its arguments in place.  The compiler only
+         * checks direct calls of a global native, so the count is checked
+         * here too.
+         */
+        ALWAYS_INLINE EvaValue callNative(NativeObject* native, const EvaValue* args,
+                                          size_t argsCount) {
+            if (argsCount != native->arity) {
+                DIE << "Native function " << native->name << " expects " << native->arity
+                    << " argument(s), " << argsCount << " given.";
+            }
+            return native->function({args, argsCount, native});
+        }
+
+        /**
+         * Makes `function` the running function, from its first instruction
+         */
+        ALWAYS_INLINE void enterFunction(FunctionObject* function) {
+            fn = function;
+            code = function->co->code.data();
+            constants = function->co->constants.data();
+            ip = code;
+            enterCells(function);
+        }
+
+        /**
+         * Cells of a new activation of `function` at cellBase: its free
+         * cells, then its own, created by their first use
+         */
+        ALWAYS_INLINE void enterCells(FunctionObject* function) {
+            auto co = function->co;
+            auto count = co->cellNames.size();
+            if (count == 0) {
+                return;
+            }
+            if (cellBase + count > cellStack.size()) {
+                cellStack.resize(2 * (cellBase + count));
+            }
+            cells = cellStack.data() + cellBase;
+            std::copy_n(function->cells.data(), co->freeCount, cells);
+            std::fill(cells + co->freeCount, cells + count, nullptr);
+        }
+
+        /**
+         * Instructions shared by the one-byte and OP_WIDE forms
+         */
+        ALWAYS_INLINE void setCell(size_t cellIndex) {
+            // Allocate the cell if it's not there yet.
+            if (cells[cellIndex] == nullptr) {
+                cells[cellIndex] = AS_CELL(MEM(ALLOC_CELL, peek(0)));
+            } else {
+                // Update the cell
+                cells[cellIndex]->value = peek(0);
+                writeBarrier(cells[cellIndex], peek(0));
+            }
+        }
+
+        /**
+         * Cell read or captured, possibly before it is set
+         */
+        ALWAYS_INLINE CellObject* cellAt(size_t cellIndex) {
+            if (cells[cellIndex] == nullptr) {
+                cells[cellIndex] = AS_CELL(MEM(ALLOC_CELL, INTEGER(0)));
+            }
+            return cells[cellIndex];
+        }
+
+        ALWAYS_INLINE void makeFunction(size_t cellsCount) {
+            auto co = AS_CODE(pop());
+
+            auto fnValue = MEM(ALLOC_FUNCTION, co);
+            auto function = AS_FUNCTION(fnValue);
+
+            // Capture, the cells pushed in order
+            function->cells.resize(cellsCount);
+            for (auto i = cellsCount; i-- > 0;) {
+                function->cells[i] = AS_CELL(pop());
+                writeBarrier(function, function->cells[i]);
+            }
+
+            push(fnValue);
+        }
+
+        /**
+         * Note: variables sit right below the result of a block, so we
+         * move the result below, which will be the new top after
+         * popping the variables
+         */
+        ALWAYS_INLINE void scopeExit(size_t count) {
+            // Move result above the vars:
+            *(sp - 1 - count) = peek(0);
+
+            // Pop the vars:
+            popN(count);
+        }
+
     EvaValue exec(const std::string &program, bool showDisassembler=true, bool showStacks=true)  {
+        return exec(program, showDisassembler, showStacks ? TraceMode::STACK : TraceMode::NONE);
+    }
+
+    /**
+     * Runs the program with the VM's heap current.  The result stays
+     * valid until the next exec.
+     */
+    EvaValue exec(const std::string &program, bool showDisassembler, TraceMode trace)  {
+        HeapScope scope(heap);
+        result = run(program, showDisassembler, trace);
+        return result;
+    }
+
+    EvaValue run(const std::string &program, bool showDisassembler, TraceMode trace)  {
+        // Compile-time objects go straight to the heap, and the code
+        // objects of the last program stop being roots
+        heap.nursery.open = false;
+        finishCycle();
+
         // 1. Parse to AST
         auto ast = parser->parse("(begin " + program + ")");
 
         // 2. Compile to Bytecode
-        compiler->compile(ast);
+        if (tier == BytecodeTier::REGISTER) {
+            if (registerCompiler->compile(ast)) {
+                return execRegisters(showDisassembler, trace);
+            }
+            std::cerr << "Register tier: " << registerCompiler->getUnsupportedReason()
+                      << ", running on the stack tier\n";
+        }
 
-        //Start from the main entry point:
-        fn = compiler->getMainFunction();
+        compiler->compile(ast);
 
-        // Set IP to beginning
-        ip = &fn->co->code[0];
+        //Start from the main entry point, IP at the beginning:
+        registerFrames = false;
+        cellBase = 0;
+        enterFunction(compiler->getMainFunction());
+        csp = frames.data();
 
         // Initialize stack
         sp = &stack[0];
 
         // Initialize base/frame pointer:
         bp = sp;
+        reserveStack(fn->co);
 
         // Debug disassembly
         if (showDisassembler) {
             compiler->disassembleBytecode();
         }
 
-        //return NUMBER(69);
-        return eval(showStacks);
+        heap.nursery.open = true;
+
+        // Pick the eval loop once, at entry:
+        switch (trace) {
+            case TraceMode::STACK:
+                return eval<StackTrace>();
+            case TraceMode::PROFILE:
+                profile.prev = -1;
+                return eval<Profile>();
+            case TraceMode::FEEDBACK:
+                feedback.reset();
+                return eval<Feedback>();
+            default:
+#ifdef EVA_JIT
+                if (options.jit == JitTier::TRACE) {
+                    tracer.reset();
+                    return eval<LoopTracing>();
+                }
+                if (options.jit != JitTier::NONE) {
+                    return eval<Jit>();
+                }
+#endif
+                return eval<NoTrace>();
+        }
     }
 
     /**
-     * Main Eval Loop
+     * Main Eval Loop, instantiated per trace policy (see EvalPolicy.h)
      */
-    EvaValue eval(bool showStacks=true ) {
-        for(;;) {
-            int opcode = READ_BYTE();
-            if (showStacks) {
-                dumpStack(opcode);
+    template <typename Trace>
+    EVAL_LOOP EvaValue eval() {
+        uint8_t opcode;
+
+#ifdef EVA_COMPUTED_GOTO
+        // Handler addresses, indexed by opcode.  Filled once per process.
+        static void* dispatchTable[256];
+        static bool dispatchTableReady = false;
+        if (!dispatchTableReady) {
+            for (auto& label : dispatchTable) {
+                label = &&L_UNKNOWN;
             }
+            DISPATCH_LABEL(OP_HALT);
+            DISPATCH_LABEL(OP_CONST);
+            DISPATCH_LABEL(OP_ADD);
+            DISPATCH_LABEL(OP_SUB);
+            DISPATCH_LABEL(OP_MUL);
+            DISPATCH_LABEL(OP_DIV);
+            DISPATCH_LABEL(OP_COMPARE);
+            DISPATCH_LABEL(OP_JMP_IF_FALSE);
+            DISPATCH_LABEL(OP_JMP);
+            DISPATCH_LABEL(OP_GET_GLOBAL);
+            DISPATCH_LABEL(OP_SET_GLOBAL);
+            DISPATCH_LABEL(OP_POP);
+            DISPATCH_LABEL(OP_GET_LOCAL);
+            DISPATCH_LABEL(OP_SET_LOCAL);
+            DISPATCH_LABEL(OP_SCOPE_EXIT);
+            DISPATCH_LABEL(OP_CALL);
+            DISPATCH_LABEL(OP_RETURN);
+            DISPATCH_LABEL(OP_TAIL_CALL);
+            DISPATCH_LABEL(OP_GET_CELL);
+            DISPATCH_LABEL(OP_SET_CELL);
+            DISPATCH_LABEL(OP_LOAD_CELL);
+            DISPATCH_LABEL(OP_MAKE_FUNCTION);
+            DISPATCH_LABEL(OP_WIDE);
+            DISPATCH_LABEL(OP_ADD_NUM);
+            DISPATCH_LABEL(OP_ADD_STR);
+            DISPATCH_LABEL(OP_LT_NUM);
+            DISPATCH_LABEL(OP_GT_NUM);
+            DISPATCH_LABEL(OP_EQ_NUM);
+            DISPATCH_LABEL(OP_GE_NUM);
+            DISPATCH_LABEL(OP_LE_NUM);
+            DISPATCH_LABEL(OP_NE_NUM);
+            DISPATCH_LABEL(OP_JMP_IF_LT);
+            DISPATCH_LABEL(OP_JMP_IF_GT);
+            DISPATCH_LABEL(OP_JMP_IF_EQ);
+            DISPATCH_LABEL(OP_JMP_IF_GE);
+            DISPATCH_LABEL(OP_JMP_IF_LE);
+            DISPATCH_LABEL(OP_JMP_IF_NE);
+            DISPATCH_LABEL(OP_GET_LOCAL2);
+            DISPATCH_LABEL(OP_GET_LOCAL_CONST);
+            DISPATCH_LABEL(OP_GET_GLOBAL_CONST);
+            DISPATCH_LABEL(OP_SET_LOCAL_POP);
+            DISPATCH_LABEL(OP_SET_GLOBAL_POP);
+            dispatchTableReady = true;
+        }
+#endif
+
+        for(;;) {
+            opcode = READ_BYTE();
+            Trace::onInstruction(*this, opcode);
             switch(opcode) {
-                case OP_HALT: {
+                OP_CASE(OP_HALT): {
                     return pop();
                 }
-                case OP_CONST: {
+                OP_CASE(OP_CONST): {
                     push(GET_CONST());
-                    break;
+                    DISPATCH();
                 }
-                case OP_ADD: {
+                OP_CASE(OP_ADD): {
                     auto op2 = pop();
                     auto op1 = pop();
 
                     // Numeric addition:
                     if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                        auto v1 = AS_NUMBER(op1);
-                        auto v2 = AS_NUMBER(op2);
-                        push(NUMBER(v1 + v2));
+                        QUICKEN(ip - 1, OP_ADD_NUM);
+                        push(addNumbers(op1, op2));
                     }
 
                     // String addition:
-                    if (IS_STRING(op1) && IS_STRING(op2)) {
+                    else if (IS_STRING(op1) && IS_STRING(op2)) {
+                        QUICKEN(ip - 1, OP_ADD_STR);
                         auto s1 = AS_CPPSTRING(op1);
                         auto s2 = AS_CPPSTRING(op2);
-                        push(ALLOC_STRING(s1 + s2));
+                        push(MEM(ALLOC_STRING, s1 + s2));
                     }
-                    break;
+
+                    else {
+                        DIE << "OP_ADD: incompatible operands: " << op1 << ", " << op2;
+                    }
+                    DISPATCH();
                 }
-                case OP_SUB: {
-                    BINARY_OP(-);
-                    break;
+                OP_CASE(OP_ADD_NUM): {
+                    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                        DEOPTIMIZE(ip - 1, OP_ADD);
+                    }
+                    NUMBER_OP(addNumbers);
+                    DISPATCH();
                 }
-                case OP_MUL: {
-                    BINARY_OP(*);
-                    break;
+                OP_CASE(OP_ADD_STR): {
+                    if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                        DEOPTIMIZE(ip - 1, OP_ADD);
+                    }
+                    // The concatenation is a temporary (see DISPATCH)
+                    auto string = MEM(ALLOC_STRING, AS_CPPSTRING(peek(1)) + AS_CPPSTRING(peek(0)));
+                    popN(2);
+                    push(string);
+                    DISPATCH();
                 }
-                case OP_DIV: {
+                OP_CASE(OP_SUB): {
+                    NUMBER_OP(subNumbers);
+                    DISPATCH();
+                }
+                OP_CASE(OP_MUL): {
+                    NUMBER_OP(mulNumbers);
+                    DISPATCH();
+                }
+                OP_CASE(OP_DIV): {
                     BINARY_OP(/);
-                    break;
+                    DISPATCH();
                 }
                 // Comparison
-                case OP_COMPARE: {
+                OP_CASE(OP_COMPARE): {
                     auto op = READ_BYTE();
                     auto op2 = pop();
                     auto op1 = pop();
                     if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                        auto v1 = AS_NUMBER(op1);
-                        auto v2 = AS_NUMBER(op2);
-                        COMPARE_VALUES(op, v1, v2);
+                        QUICKEN(ip - 2, OP_LT_NUM + op);
+                        push(BOOLEAN(compareNumberValues(op, op1, op2)));
                     } else if (IS_STRING(op1) && IS_STRING(op2)) {
                         auto s1 = AS_CPPSTRING(op1);
                         auto s2 = AS_CPPSTRING(op2);
                         COMPARE_VALUES(op, s1, s2);
+                    } else {
+                        DIE << "OP_COMPARE: incompatible operands: " << op1 << ", " << op2;
                     }
-                    break;
+                    DISPATCH();
                 }
+                OP_CASE(OP_LT_NUM): COMPARE_NUM(0)
+                OP_CASE(OP_GT_NUM): COMPARE_NUM(1)
+                OP_CASE(OP_EQ_NUM): COMPARE_NUM(2)
+                OP_CASE(OP_GE_NUM): COMPARE_NUM(3)
+                OP_CASE(OP_LE_NUM): COMPARE_NUM(4)
+                OP_CASE(OP_NE_NUM): COMPARE_NUM(5)
 
                 // Conditional jump:
-                case OP_JMP_IF_FALSE: {
+                OP_CASE(OP_JMP_IF_FALSE): {
                     auto cond = AS_BOOLEAN(pop());
 
-                    auto address = READ_SHORT();
+                    auto jump = READ_JUMP();
 
                     if (!cond) {
-                        ip = TO_ADDRESS(address);
+                        ip += jump;
                     }
 
-                    break;
+                    DISPATCH();
                 }
 
-                // Conditional jump:
-                case OP_JMP: {
-                    ip = TO_ADDRESS(READ_SHORT());
-                    break;
+                // Compare and branch:
+                OP_CASE(OP_JMP_IF_LT): {
+                    JUMP_IF_COMPARE(0);
+                    DISPATCH();
+                }
+                OP_CASE(OP_JMP_IF_GT): {
+                    JUMP_IF_COMPARE(1);
+                    DISPATCH();
+                }
+                OP_CASE(OP_JMP_IF_EQ): {
+                    JUMP_IF_COMPARE(2);
+                    DISPATCH();
+                }
+                OP_CASE(OP_JMP_IF_GE): {
+                    JUMP_IF_COMPARE(3);
+                    DISPATCH();
+                }
+                OP_CASE(OP_JMP_IF_LE): {
+                    JUMP_IF_COMPARE(4);
+                    DISPATCH();
+                }
+                OP_CASE(OP_JMP_IF_NE): {
+                    JUMP_IF_COMPARE(5);
+                    DISPATCH();
+                }
+
+                // Unconditional jump:
+                OP_CASE(OP_JMP): {
+                    auto from = ip;
+                    auto jump = READ_JUMP();
+                    ip += jump;
+
+                    // Loop back-edge
+                    if (ip < from && heap.phase != GCPhase::IDLE) {
+                        gcSafepoint();
+                    }
+                    if constexpr (Trace::jit) {
+                        if (ip < from) {
+                            jitHotEntry();
+                        }
+                    }
+                    if constexpr (Trace::traceLoops) {
+                        if (ip < from) {
+                            traceLoop(from - 1);
+                        }
+                    }
+                    DISPATCH();
                 }
 
                 // Global variable value:
-                case OP_GET_GLOBAL: {
+                OP_CASE(OP_GET_GLOBAL): {
                     auto globalIndex = READ_BYTE();
                     push(global->get(globalIndex).value);
-                    break;
+                    DISPATCH();
                 }
 
                 // Global variable setting
-                case OP_SET_GLOBAL: {
+                OP_CASE(OP_SET_GLOBAL): {
                     auto globalIndex = READ_BYTE();
                     auto value = peek(0);
                     global->set(globalIndex, value);
-                    break;
+                    DISPATCH();
                 }
 
                 // Stack manipulation
-                case OP_POP: {
+                OP_CASE(OP_POP): {
                     pop();
-                    break;
+                    DISPATCH();
                 }
 
                 // Local variable value
-                case OP_GET_LOCAL: {
+                OP_CASE(OP_GET_LOCAL): {
                     auto localIndex = READ_BYTE();
-                    if (localIndex < 0 || localIndex >= stack.size()) {
-                        DIE << "OP_GET_LOCAL: invalid variabel index: " << (int)localIndex;
-                    }
                     push(bp[localIndex]);
-                    break;
+                    DISPATCH();
                 }
 
                 // Local variable value
-                case OP_SET_LOCAL: {
+                OP_CASE(OP_SET_LOCAL): {
                     auto localIndex = READ_BYTE();
                     auto value = peek(0);
-                    if (localIndex < 0 || localIndex >= stack.size()) {
-                        DIE << "OP_SET_LOCAL: invalid variable index: " << (int)localIndex;
-                    }
                     bp[localIndex] = value;
-                    break;
+                    DISPATCH();
                 }
 
                 // Cell value
-                case OP_GET_CELL: {
+                OP_CASE(OP_GET_CELL): {
                     auto cellIndex = READ_BYTE();
-                    push(fn->cells[cellIndex]->value);
-                    break;
+                    push(cellAt(cellIndex)->value);
+                    DISPATCH();
                 }
 
                 // Set cell value
-                case OP_SET_CELL: {
+                OP_CASE(OP_SET_CELL): {
                     auto cellIndex = READ_BYTE();
-                    auto value = peek(0);
-
-                    // Allocate the cell if it's not there yet.
-                    if (fn->cells.size() <= cellIndex) {
-                        fn->cells.push_back(AS_CELL(ALLOC_CELL(value)));
-                    } else {
-                        // Update the cell
-                        fn->cells[cellIndex]->value = value;
-                    }
-                    break;
+                    setCell(cellIndex);
+                    DISPATCH();
                 }
 
                 // Load cell
-                case OP_LOAD_CELL: {
+                OP_CASE(OP_LOAD_CELL): {
                     auto cellIndex = READ_BYTE();
-                    push(CELL(fn->cells[cellIndex]));
-                    break;
+                    push(CELL(cellAt(cellIndex)));
+                    DISPATCH();
                 }
 
                 // Make a function
-                case OP_MAKE_FUNCTION: {
-                    auto co = AS_CODE(pop());
+                OP_CASE(OP_MAKE_FUNCTION): {
                     auto cellsCount = READ_BYTE();
+                    makeFunction(cellsCount);
+                    DISPATCH();
+                }
 
-                    auto fnValue = ALLOC_FUNCTION(co);
-                    auto fn = AS_FUNCTION(fnValue);
-
-                    // Capture
-                    for (auto i = 0; i < cellsCount; i++) {
-                        fn->cells.push_back(AS_CELL(pop()));
+                // Wide operand: the instruction after the prefix, with a
+                // two-byte operand
+                OP_CASE(OP_WIDE): {
+                    auto wideOpcode = READ_BYTE();
+                    auto operand = READ_SHORT();
+                    switch (wideOpcode) {
+                        case OP_CONST:
+                            push(constants[operand]);
+                            break;
+                        case OP_GET_GLOBAL:
+                            push(global->get(operand).value);
+                            break;
+                        case OP_SET_GLOBAL:
+                            global->set(operand, peek(0));
+                            break;
+                        case OP_GET_LOCAL:
+                            push(bp[operand]);
+                            break;
+                        case OP_SET_LOCAL:
+                            bp[operand] = peek(0);
+                            break;
+                        case OP_GET_CELL:
+                            push(cellAt(operand)->value);
+                            break;
+                        case OP_SET_CELL:
+                            setCell(operand);
+                            break;
+                        case OP_LOAD_CELL:
+                            push(CELL(cellAt(operand)));
+                            break;
+                        case OP_SCOPE_EXIT:
+                            scopeExit(operand);
+                            break;
+                        case OP_MAKE_FUNCTION:
+                            makeFunction(operand);
+                            break;
+                        default:
+                            DIE << "OP_WIDE: no wide form of " << opcodeToString(wideOpcode);
                     }
+                    DISPATCH();
+                }
+
 
-                    push(fnValue);
+                //----------------------------------------------
+                // Superinstructions (see EvaPeephole.h)
+
+                OP_CASE(OP_GET_LOCAL2): {
+                    auto localIndex1 = READ_BYTE();
+                    auto localIndex2 = READ_BYTE();
+                    push(bp[localIndex1]);
+                    push(bp[localIndex2]);
+                    DISPATCH();
+                }
 
-                    break;
+                OP_CASE(OP_GET_LOCAL_CONST): {
+                    auto localIndex = READ_BYTE();
+                    push(bp[localIndex]);
+                    push(GET_CONST());
+                    DISPATCH();
                 }
 
+                OP_CASE(OP_GET_GLOBAL_CONST): {
+                    auto globalIndex = READ_BYTE();
+                    push(global->get(globalIndex).value);
+                    push(GET_CONST());
+                    DISPATCH();
+                }
 
+                OP_CASE(OP_SET_LOCAL_POP): {
+                    auto localIndex = READ_BYTE();
+                    bp[localIndex] = pop();
+                    DISPATCH();
+                }
 
+                OP_CASE(OP_SET_GLOBAL_POP): {
+                    auto globalIndex = READ_BYTE();
+                    global->set(globalIndex, pop());
+                    DISPATCH();
+                }
 
                 //----------------------------------------------
                 // Scope Exit
-                //
-                // Note: variables sit right below the result of a block,
-                // so we move the result below, which will be the new top
-                // after popping the variables
-                case OP_SCOPE_EXIT: {
+                OP_CASE(OP_SCOPE_EXIT): {
                     // How many vars to pop:
                     auto count = READ_BYTE();
-
-                    // Move result above the vars:
-                    *(sp - 1 - count) = peek(0);
-
-                    // Pop the vars:
-                    popN(count);
-                    break;
+                    scopeExit(count);
+                    DISPATCH();
                 }
 
-                case OP_CALL: {
+                OP_CASE(OP_CALL): {
                     auto argsCount = READ_BYTE();
                     auto fnValue = peek(argsCount);
 
-                    // 1. Native function:
+                    // 1. Native function: reads the args in place, the
+                    // result replaces the function slot
                     if (IS_NATIVE(fnValue)) {
-                        AS_NATIVE(fnValue) ->function();
-                        auto result = pop();
-
-                        // Pop args and function
-                        popN(argsCount + 1);
-
-                        // Put result back on top
-                        push(result);
-                        break;
+                        auto slot = sp - argsCount - 1;
+                        *slot = callNative(AS_NATIVE(fnValue), slot + 1, argsCount);
+                        sp = slot + 1;
+                        DISPATCH();
                     }
 
                     // 2. User-defined function 
                     auto callee = AS_FUNCTION(fnValue);
 
                     // save execution context, restored on OP_RETURN
-                    callStack.push(Frame{ip, bp, fn});
-
-                    // To access locals, etc:
-                    fn = callee;
-
-                    // Shrink the cells vector to the size of only free
-                    // vars, since other (own) cells should be reallocated
-                    // for each invocation;
-                    fn->cells.resize(fn->co->freeCount);
+                    pushFrame();
 
                     // Set the base (frame) pointer for the callee:
                     bp = sp - argsCount - 1;
 
                     // Jump to the function code
-                    ip = &callee->co->code[0];
+                    enterFunction(callee);
+                    reserveStack(callee->co);
 
-                    break;
+                    if constexpr (Trace::jit) {
+                        jitHotEntry();
+                    }
+                    DISPATCH();
                 }
 
-                case OP_RETURN: {
-                    // Restore the caller address
-                    auto callerFrame = callStack.top();
+                OP_CASE(OP_TAIL_CALL): {
+                    auto argsCount = READ_BYTE();
+                    auto fnValue = peek(argsCount);
 
-                    // Restore stack pointers:
-                    ip = callerFrame.ra;
-                    bp = callerFrame.bp;
-                    fn = callerFrame.fn;
+                    // 1. Native function: call, then return its result
+                    if (IS_NATIVE(fnValue)) {
+                        *bp = callNative(AS_NATIVE(fnValue), sp - argsCount, argsCount);
+                        sp = bp + 1;
+                        popFrame();
+                        DISPATCH();
+                    }
+
+                    // 2. User-defined function: slide the callee and its
+                    // arguments down over the current frame, which pops
+                    // the caller's locals without OP_SCOPE_EXIT
+                    auto callee = AS_FUNCTION(fnValue);
+                    std::copy(sp - argsCount - 1, sp, bp);
+                    sp = bp + argsCount + 1;
+
+                    // The callee takes over the frame: return address
+                    // and cells base stay
+                    enterFunction(callee);
+                    reserveStack(callee->co);
 
-                    callStack.pop();
-                    break;
+                    if constexpr (Trace::jit) {
+                        jitHotEntry();
+                    }
+                    DISPATCH();
                 }
 
-                default: {
-                    DIE << "Unknown opcode: " << std::hex << opcode;
+                OP_CASE(OP_RETURN): {
+                    // Restore the caller address and stack pointers
+                    popFrame();
+
+                    if constexpr (Trace::jit) {
+                        if (fn->co->jitCode != nullptr) {
+                            runJit(fn->co->jitCode);
+                        }
+                    }
+                    DISPATCH();
+                }
+
+                OP_DEFAULT: {
+                    DIE << "Unknown opcode: " << std::hex << (int)opcode;
                 }
             }
         }    
     }
 
+    /**
+     * Counts an entry into fn (call or loop back-edge) and once fn is
+     * hot, runs its native code from ip.  Native code returns where the
+     * interpreter continues: an unsupported instruction or failed guard.
+     */
+    void jitHotEntry() {
+#ifdef EVA_JIT
+        auto co = fn->co;
+        if (co->jitCode == nullptr) {
+            if (options.jit == JitTier::STENCIL) {
+                co->jitCode = stencils.compile(co);
+            } else {
+                if (++co->hotness < options.jitThreshold) {
+                    return;
+                }
+                co->jitCode = jit.compile(co);
+            }
+        }
+        runJit(co->jitCode);
+#endif
+    }
+
+    /**
+     * Loop back-edge from the OP_JMP at `jump` to ip: runs the loop's
+     * trace, or counts the edge towards recording one
+     */
+    void traceLoop(const uint8_t* jump) {
+#ifdef EVA_JIT
+        auto trace = tracer.backEdge(fn->co, ip, jump, sp - bp, options.jitThreshold);
+        if (trace != nullptr) {
+            runJit(trace);
+            tracer.sideExit(fn->co, ip, options.jitThreshold);
+        }
+#endif
+    }
+
+    void runJit(JitCode* jitCode) {
+#ifdef EVA_JIT
+        JitState state{sp, bp, global->globals.data(), cells, this, jitSafepoint};
+        auto offset = jitCode->run(&state, ip - code);
+        sp = state.sp;
+        ip = code + offset;
+#endif
+    }
+
+#ifdef EVA_JIT
+    /**
+     * Native code allocating: collects with its stack pointer
+     */
+    static void jitSafepoint(JitState* state) {
+        auto vm = (EvaVM*)state->vm;
+        vm->sp = state->sp;
+        vm->maybeGC();
+    }
+#endif
+
+    /**
+     * Collects once the nursery is full or the heap is over its
+     * threshold; runs the next slice of an incremental collection
+     */
+    ALWAYS_INLINE void maybeGC() {
+        if (heap.nursery.full()) {
+            collectYoung();
+        }
+        if (heap.phase != GCPhase::IDLE) {
+            gcSafepoint();
+        } else if (heap.bytes >= heap.nextCollection) {
+            if (options.gcSlice > 0) {
+                beginCycle();
+            } else {
+                collectGarbage();
+            }
+        }
+    }
+
+    /**
+     * Allocation or loop back-edge during an incremental collection
+     */
+    ALWAYS_INLINE void gcSafepoint() {
+        if (--sliceCountdown == 0) {
+            collectSlice(options.gcSlice);
+        }
+    }
+
+    /**
+     * Starts an incremental collection: the roots turn gray
+     */
+    NOINLINE
+    void beginCycle() {
+        auto start = std::chrono::steady_clock::now();
+        heap.phase = GCPhase::MARK;
+        markRoots();
+        sliceCountdown = std::max<size_t>(options.gcSliceInterval, 1);
+        heap.stats.slices++;
+        recordPause(start);
+    }
+
+    /**
+     * Traces, or sweeps, `budget` objects.  Once the gray objects run
+     * out, the nursery is emptied and the roots traced again in the
+     * same slice: neither has a barrier.
+     */
+    NOINLINE
+    void collectSlice(size_t budget) {
+        auto start = std::chrono::steady_clock::now();
+
+        if (heap.phase == GCPhase::MARK) {
+            if (collector.mark(heap, budget)) {
+                scavenge();
+                markRoots();
+                collector.mark(heap, (size_t)-1);
+                heap.phase = GCPhase::SWEEP;
+                collector.beginSweep(heap, [this](Object* object) { onFree(object); });
+            }
+        } else if (collector.sweepSome(heap, [this](Object* object) { onFree(object); }, budget)) {
+            heap.phase = GCPhase::IDLE;
+            heap.nextCollection = std::max(options.gcThreshold, heap.bytes * options.gcGrowth);
+            heap.stats.collections++;
+        }
+
+        sliceCountdown = std::max<size_t>(options.gcSliceInterval, 1);
+        heap.stats.slices++;
+        recordPause(start);
+    }
+
+    /**
+     * Completes the incremental collection in progress, if any
+     */
+    void finishCycle() {
+        while (heap.phase != GCPhase::IDLE) {
+            collectSlice((size_t)-1);
+        }
+    }
+
+    /**
+     * Minor collection: the nursery survivors move to the heap
+     */
+    void collectYoung() {
+        auto start = std::chrono::steady_clock::now();
+        scavenge();
+        heap.stats.minorCollections++;
+        recordPause(start);
+    }
+
+    /**
+     * Full mark-sweep collection, after emptying the nursery.  The next
+     * one starts when the heap grows to options.gcGrowth times what
+     * survived.
+     */
+    void collectGarbage() {
+        auto start = std::chrono::steady_clock::now();
+
+        scavenge();
+        markRoots();
+        collector.trace();
+        collector.sweep(heap, [this](Object* object) { onFree(object); });
+
+        heap.nextCollection = std::max(options.gcThreshold, heap.bytes * options.gcGrowth);
+        heap.stats.collections++;
+        recordPause(start);
+    }
+
+    void scavenge() {
+        collector.scavenge(heap, [this](auto visitValue, auto visitObject) {
+            visitRoots(visitValue, visitObject);
+        });
+
+        // Registers of a new frame are read only once written, but the
+        // collector scans the whole frame: no stale pointers above sp
+        if (registerFrames && registerTop > sp) {
+            std::fill(sp, registerTop, NUMBER(0));
+            registerTop = sp;
+        }
+    }
+
+    void markRoots() {
+        visitRoots([this](EvaValue& value) { collector.markValue(value); },
+                   [this](auto& object) { collector.markObject(object); });
+    }
+
+    void recordPause(std::chrono::steady_clock::time_point start) {
+        heap.stats.pause((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    /**
+     * Passes every root to `visitValue` (EvaValue&) or `visitObject`
+     * (a reference to an object pointer): the operand stack, the
+     * functions and cells of the active frames, globals, and the code
+     * objects of the last compile
+     */
+    template <typename VisitValue, typename VisitObject>
+    void visitRoots(VisitValue visitValue, VisitObject visitObject) {
+        for (auto value = stack.begin(); value < sp; value++) {
+            visitValue(*value);
+        }
+
+        for (auto frame = frames.data(); frame < csp; frame++) {
+            visitObject(frame->fn);
+        }
+        visitObject(fn);
+
+        auto cellsInUse = cellBase + fn->co->cellNames.size();
+        for (size_t i = 0; i < cellsInUse; i++) {
+            visitObject(cellStack[i]);
+        }
+
+        for (auto& var : global->globals) {
+            visitValue(var.value);
+        }
+
+        for (auto co : compiler->getCodeObjects()) {
+            visitObject(co);
+        }
+        auto main = compiler->getMainFunction();
+        visitObject(main);
+        for (auto co : registerCompiler->getCodeObjects()) {
+            visitObject(co);
+        }
+        main = registerCompiler->getMainFunction();
+        visitObject(main);
+    }
+
+    /**
+     * An object about to be freed: its native code goes too
+     */
+    void onFree(Object* object) {
+#ifdef EVA_JIT
+        if (object->type == ObjectType::CODE) {
+            auto jitCode = ((CodeObject*)object)->jitCode;
+            if (jitCode != nullptr) {
+                jit.release(jitCode);
+                stencils.release(jitCode);
+            }
+        }
+#endif
+    }
+
+    /**
+     * Prints the collector counters (--gc-stats)
+     */
+    void dumpHeapStats() {
+        auto& stats = heap.stats;
+        std::cout << "\n----------------Heap -----------------\n\n"
+                  << std::dec
+                  << "collections:   " << stats.collections << " full, "
+                  << stats.minorCollections << " minor\n"
+                  << "allocated:     " << stats.bytesAllocated << " bytes, "
+                  << stats.objectsAllocated << " objects\n"
+                  << "freed:         " << stats.bytesFreed << " bytes, "
+                  << stats.objectsFreed << " objects\n"
+                  << "promoted:      " << stats.bytesPromoted << " bytes, "
+                  << stats.objectsPromoted << " objects\n"
+                  << "in heap:       " << heap.bytes << " bytes, " << heap.count << " objects\n"
+                  << "in nursery:    " << heap.nursery.bytes << " bytes\n"
+                  << "peak:          " << stats.peakBytes << " bytes\n"
+                  << "next at:       " << heap.nextCollection << " bytes\n"
+                  << "pauses:        " << stats.pauses << " (" << stats.slices
+                  << " incremental slices), " << stats.totalPause << " us total\n"
+                  << "pause p50:     <= " << stats.pausePercentile(0.5) << " us\n"
+                  << "pause p99:     <= " << stats.pausePercentile(0.99) << " us\n"
+                  << "pause max:     " << stats.maxPause << " us\n";
+        for (size_t bucket = 0; bucket < HeapStats::PAUSE_BUCKETS; bucket++) {
+            if (stats.pauseHistogram[bucket] > 0) {
+                std::cout << "  < " << std::setw(8) << (uint64_t(1) << bucket) << " us: "
+                          << stats.pauseHistogram[bucket] << "\n";
+            }
+        }
+    }
+
+    /**
+     * Runs the main function of the register compiler.
+     */
+    EvaValue execRegisters(bool showDisassembler, TraceMode trace) {
+        registerFrames = true;
+        cellBase = 0;
+        enterFunction(registerCompiler->getMainFunction());
+        csp = frames.data();
+        bp = &stack[0];
+        sp = bp + fn->co->registerCount;
+        registerTop = sp;
+
+        if (showDisassembler) {
+            registerCompiler->disassembleBytecode();
+        }
+
+        heap.nursery.open = true;
+
+        switch (trace) {
+            case TraceMode::STACK:
+                return evalRegisters<StackTrace>();
+            case TraceMode::PROFILE:
+                profile.prev = -1;
+                return evalRegisters<Profile>();
+            default:
+                return evalRegisters<NoTrace>();
+        }
+    }
+
+    /**
+     * Register tier eval loop.
+     *
+     * Registers are the slots of the operand stack above bp; sp is kept
+     * at the top of the current frame's registers.
+     */
+    template <typename Trace>
+    EVAL_LOOP EvaValue evalRegisters() {
+        uint8_t opcode;
+
+#ifdef EVA_COMPUTED_GOTO
+        static void* dispatchTable[256];
+        static bool dispatchTableReady = false;
+        if (!dispatchTableReady) {
+            for (auto& label : dispatchTable) {
+                label = &&L_UNKNOWN;
+            }
+            DISPATCH_LABEL(ROP_HALT);
+            DISPATCH_LABEL(ROP_LOADK);
+            DISPATCH_LABEL(ROP_MOVE);
+            DISPATCH_LABEL(ROP_ADD);
+            DISPATCH_LABEL(ROP_SUB);
+            DISPATCH_LABEL(ROP_MUL);
+            DISPATCH_LABEL(ROP_DIV);
+            DISPATCH_LABEL(ROP_COMPARE);
+            DISPATCH_LABEL(ROP_JMP_IF_FALSE);
+            DISPATCH_LABEL(ROP_JMP);
+            DISPATCH_LABEL(ROP_GET_GLOBAL);
+            DISPATCH_LABEL(ROP_SET_GLOBAL);
+            DISPATCH_LABEL(ROP_CALL);
+            DISPATCH_LABEL(ROP_RETURN);
+            DISPATCH_LABEL(ROP_TAIL_CALL);
+            dispatchTableReady = true;
+        }
+#endif
+
+        for (;;) {
+            opcode = READ_BYTE();
+            Trace::onInstruction(*this, opcode);
+            switch (opcode) {
+                OP_CASE(ROP_HALT): {
+                    return READ_REG();
+                }
+
+                OP_CASE(ROP_LOADK): {
+                    auto& dest = READ_REG();
+                    dest = GET_CONST();
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_MOVE): {
+                    auto& dest = READ_REG();
+                    dest = READ_REG();
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_ADD): {
+                    auto& dest = READ_REG();
+                    auto op1 = READ_REG();
+                    auto op2 = READ_REG();
+
+                    // Numeric addition:
+                    if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
+                        dest = addNumbers(op1, op2);
+                    }
+
+                    // String addition:
+                    else if (IS_STRING(op1) && IS_STRING(op2)) {
+                        auto string = AS_CPPSTRING(op1) + AS_CPPSTRING(op2);
+                        dest = MEM(ALLOC_STRING, string);
+                    }
+
+                    else {
+                        DIE << "ROP_ADD: incompatible operands: " << op1 << ", " << op2;
+                    }
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_SUB): {
+                    REG_NUMBER_OP(subNumbers);
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_MUL): {
+                    REG_NUMBER_OP(mulNumbers);
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_DIV): {
+                    REG_BINARY_OP(/);
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_COMPARE): {
+                    auto& dest = READ_REG();
+                    auto op1 = READ_REG();
+                    auto op2 = READ_REG();
+                    auto op = READ_BYTE();
+                    if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
+                        dest = BOOLEAN(compareNumberValues(op, op1, op2));
+                    } else if (IS_STRING(op1) && IS_STRING(op2)) {
+                        dest = BOOLEAN(compareValues(op, AS_CPPSTRING(op1), AS_CPPSTRING(op2)));
+                    } else {
+                        DIE << "ROP_COMPARE: incompatible operands: " << op1 << ", " << op2;
+                    }
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_JMP_IF_FALSE): {
+                    auto cond = AS_BOOLEAN(READ_REG());
+                    auto jump = READ_JUMP();
+                    if (!cond) {
+                        ip += jump;
+                    }
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_JMP): {
+                    auto jump = READ_JUMP();
+                    ip += jump;
+
+                    // Loop back-edge
+                    if (jump < 0 && heap.phase != GCPhase::IDLE) {
+                        gcSafepoint();
+                    }
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_GET_GLOBAL): {
+                    auto& dest = READ_REG();
+                    dest = global->get(READ_BYTE()).value;
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_SET_GLOBAL): {
+                    auto globalIndex = READ_BYTE();
+                    global->set(globalIndex, READ_REG());
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_CALL): {
+                    auto base = &READ_REG();
+                    auto argsCount = READ_BYTE();
+                    auto fnValue = *base;
+
+                    // 1. Native function: args are read in place
+                    if (IS_NATIVE(fnValue)) {
+                        *base = callNative(AS_NATIVE(fnValue), base + 1, argsCount);
+                        DISPATCH();
+                    }
+
+                    // 2. User-defined function, its frame starts at the callee
+                    auto callee = AS_FUNCTION(fnValue);
+
+                    if (base + callee->co->registerCount > stack.end()) {
+                        DIE << "ROP_CALL: Stack overflow. \n";
+                    }
+
+                    pushFrame();
+
+                    enterFunction(callee);
+                    bp = base;
+                    sp = bp + fn->co->registerCount;
+                    registerTop = std::max(registerTop, sp);
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_TAIL_CALL): {
+                    auto base = &READ_REG();
+                    auto argsCount = READ_BYTE();
+                    auto fnValue = *base;
+
+                    // 1. Native function: call, then return its result
+                    if (IS_NATIVE(fnValue)) {
+                        *bp = callNative(AS_NATIVE(fnValue), base + 1, argsCount);
+                        popFrame();
+                        sp = bp + fn->co->registerCount;
+                        DISPATCH();
+                    }
+
+                    // 2. User-defined function: callee and args move to
+                    // r0..rN of the current frame
+                    auto callee = AS_FUNCTION(fnValue);
+
+                    if (bp + callee->co->registerCount > stack.end()) {
+                        DIE << "ROP_TAIL_CALL: Stack overflow. \n";
+                    }
+
+                    std::copy(base, base + argsCount + 1, bp);
+                    enterFunction(callee);
+                    sp = bp + fn->co->registerCount;
+                    registerTop = std::max(registerTop, sp);
+                    DISPATCH();
+                }
+
+                OP_CASE(ROP_RETURN): {
+                    // The result goes into the callee slot of the caller
+                    *bp = READ_REG();
+
+                    popFrame();
+                    sp = bp + fn->co->registerCount;
+                    DISPATCH();
+                }
+
+                OP_DEFAULT: {
+                    DIE << "Unknown register opcode: " << std::hex << (int)opcode;
+                }
+            }
+        }
+    }
+
+    /**
+     * Binds the C++ function Fn as a global native.  Arity and argument
+     * conversions come from its signature (see NativeBinding.h), the
+     * arguments are type checked on each call.
+     *
+     *   vm.bind<cppFunction>("name");
+     */
+    template <auto Fn>
+    void bind(const std::string& name) {
+        global->addNativeFunction(name, NativeBinding<Fn>::trampoline,
+                                  NativeBinding<Fn>::Signature::arity);
+    }
+
+    /**
+     * Built-in natives
+     */
+    static double nativeSquare(double x) { return x * x; }
+
+    static double nativeSum(double v1, double v2) { return v1 + v2; }
+
     /**
      * Sets up global variables and function.
      */
     void setGlobalVariables() {
-        global->addNativeFunction(
-            "native-square",
-            [&]() {
-                auto x = AS_NUMBER(peek(0));
-                push(NUMBER(x * x));
-            },
-            1);
-
-        global->addNativeFunction(
-            "native-sum",
-            [&]() {
-                auto v2 = AS_NUMBER(peek(0));
-                auto v1 = AS_NUMBER(peek(1));
-                push(NUMBER(v1 + v2));
-            },
-            2);
+        bind<nativeSquare>("native-square");
+        bind<nativeSum>("native-sum");
         global->addConst( "native-version", 1);
     }
 
@@ -453,6 +1614,62 @@ class EvaVM {
      */
     std::unique_ptr<EvaCompiler> compiler;
 
+    /**
+     * Register tier compiler.
+     */
+    std::unique_ptr<EvaRegisterCompiler> registerCompiler;
+
+#ifdef EVA_JIT
+    /**
+     * Native code of hot code objects
+     */
+    EvaJit jit;
+
+    /**
+     * Copy-and-patch code, see JitTier::STENCIL
+     */
+    EvaStencils stencils;
+
+    /**
+     * Loop traces, see JitTier::TRACE
+     */
+    EvaTracer tracer;
+#endif
+
+    /**
+     * Bytecode tier used by exec
+     */
+    BytecodeTier tier = BytecodeTier::STACK;
+
+    /**
+     * Objects allocated by this VM, and their collector
+     */
+    Heap heap;
+    EvaCollector collector;
+
+    /**
+     * Safepoints left before the next slice of an incremental
+     * collection
+     */
+    size_t sliceCountdown = 0;
+
+    /**
+     * Result of the last exec
+     */
+    EvaValue result = NUMBER(0);
+
+    /**
+     * Running the register tier, and the highest frame top since the
+     * last collection
+     */
+    bool registerFrames = false;
+    EvaValue* registerTop = nullptr;
+
+    /**
+     * Construction options
+     */
+    VMOptions options;
+
     /**
      * Instruction Pointer
      */ 
@@ -469,20 +1686,64 @@ class EvaVM {
     EvaValue* bp;
 
     /**
-     * Operands Stack
+     * Operands Stack, options.stackSize values
      */ 
-    std::array<EvaValue, STACK_LIMIT> stack;
+    OperandStack stack;
 
     /**
-     * Separate stack for calls.  Keeps return addresses.
+     * Separate stack for calls, preallocated to options.maxCallDepth.
+     * Keeps return addresses.
      */
-    std::stack<Frame> callStack;
+    std::vector<Frame> frames;
+
+    /**
+     * Call stack pointer: next free frame
+     */
+    Frame* csp;
 
     /**
      * Code object
      */ 
     FunctionObject* fn;
 
+    /**
+     * Code and constants of fn, cached for dispatch
+     */
+    uint8_t* code;
+    EvaValue* constants;
+
+    /**
+     * Cells of the running activations, each frame's at its cellBase:
+     * the function's free cells, then its own cells, so recursive
+     * activations don't share them
+     */
+    std::vector<CellObject*> cellStack;
+    size_t cellBase = 0;
+
+    /**
+     * Cells of the running frame, cellStack.data() + cellBase
+     */
+    CellObject** cells = nullptr;
+
+    /**
+     * Opcode counts, filled by eval<Profile>
+     */
+    OpcodeProfile profile;
+
+    /**
+     * Type feedback recorder of eval<Feedback>
+     */
+    TypeFeedback feedback;
+
+    /**
+     * Prints the type feedback of every code object of the last run
+     */
+    void dumpFeedback() {
+        for (auto co : compiler->getCodeObjects()) {
+            TypeFeedback::dump(co);
+        }
+    }
+
     //-----------------------------------------------
     //  Debug functions:
 
@@ -1,12 +1,23 @@
 #ifndef EvaValue_h
 #define EvaValue_h
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 enum class EvaValueType {
     NUMBER,
     BOOLEAN,
     OBJECT,
+    INTEGER,
 };
 
 enum class ObjectType {
@@ -18,11 +29,29 @@ enum class ObjectType {
 };
 
 /**
- *  Base object
+ *  Base object: the header of every heap object
  */ 
 struct Object {
     Object(ObjectType type) : type(type) {}
     ObjectType type;
+
+    /**
+     * Reached by the running collection (see EvaCollector.h)
+     */
+    bool marked = false;
+
+    /**
+     * In the nursery (see Nursery), and for old objects, on the
+     * remembered list of the heap
+     */
+    bool young = false;
+    bool remembered = false;
+
+    /**
+     * Next object of the same Heap; for a young object, its copy in
+     * the heap once promoted
+     */
+    Object* next = nullptr;
 };
 
 /**
@@ -34,10 +63,85 @@ struct StringObject : public Object {
     std::string string;
 };
 
+// -------------------------------------------------------
+
+#ifdef EVA_NAN_BOXING
+
+/**
+ * EvaValue (NaN-boxed, 8 bytes)
+ *
+ * Any double which is not a quiet NaN with the bits below set is a number.
+ * Booleans are quiet NaNs tagged in the low bits, objects are quiet NaNs
+ * with the sign bit set and the pointer in the low 48 bits, integers are
+ * quiet NaNs with TAG_INTEGER set and the int32 in the low 32 bits.
+ */
+struct EvaValue {
+    uint64_t bits;
+};
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+#define FALSE_BITS (QNAN | TAG_FALSE)
+#define TRUE_BITS (QNAN | TAG_TRUE)
+
+#define TAG_INTEGER ((uint64_t)0x0001000000000000)
+#define INTEGER_BITS (QNAN | TAG_INTEGER)
+
+inline EvaValue numberToValue(double number) {
+    EvaValue value;
+    std::memcpy(&value.bits, &number, sizeof(double));
+    return value;
+}
+
+inline double valueToNumber(EvaValue value) {
+    double number;
+    std::memcpy(&number, &value.bits, sizeof(double));
+    return number;
+}
+
+static_assert(sizeof(EvaValue) == 8, "NaN-boxed EvaValue must be one word");
+
+#else
+
 /**
- *  Native function
+ * EvaValue (tagged union)
  */ 
-using NativeFn = std::function<void()>;
+struct EvaValue {
+    EvaValueType type;
+    union {
+        double number;
+        int32_t integer;
+        bool boolean;
+        Object* object;
+    };
+};
+
+#endif
+
+struct NativeObject;
+
+/**
+ *  Arguments of a native call: a view of the caller's stack, and the
+ *  native called
+ */
+struct NativeArgs {
+    const EvaValue* values;
+    size_t count;
+    const NativeObject* native;
+
+    const EvaValue& operator[](size_t index) const { return values[index]; }
+
+    size_t size() const { return count; }
+};
+
+/**
+ *  Native function: gets its arguments in place, returns the result
+ */ 
+using NativeFn = EvaValue (*)(NativeArgs args);
 
 struct NativeObject : public Object {
     NativeObject(NativeFn function, const std::string& name, size_t arity)
@@ -62,18 +166,36 @@ struct NativeObject : public Object {
     size_t arity;
 };
 
-// -------------------------------------------------------
+/**
+ *  Native code of a CodeObject (see EvaJit.h)
+ */
+class JitCode;
 
 /**
- * EvaValue (tagged union)
- */ 
-struct EvaValue {
-    EvaValueType type;
-    union {
-        double number;
-        bool boolean;
-        Object* object;
-    };
+ * Runtime feedback of one instruction, see TypeFeedback.h
+ */
+struct FeedbackSlot {
+    /**
+     * Executions
+     */
+    uint32_t count = 0;
+
+    /**
+     * Branches: times taken
+     */
+    uint32_t taken = 0;
+
+    /**
+     * Operand kinds seen, FeedbackKind bits
+     */
+    uint8_t lhs = 0;
+    uint8_t rhs = 0;
+
+    /**
+     * Calls: the first callee, and whether others followed
+     */
+    bool polymorphic = false;
+    Object* callee = nullptr;
 };
 
 struct LocalVar {
@@ -126,6 +248,33 @@ struct CodeObject : public Object {
      */ 
     size_t freeCount = 0;
 
+    /**
+     * Frame size in registers (register tier only)
+     */
+    size_t registerCount = 0;
+
+    /**
+     * Most values pushed above the callee and arguments, set by
+     * EvaVerifier (stack tier only)
+     */
+    size_t maxStack = 0;
+
+    /**
+     * Calls and loop back-edges counted towards the JIT threshold
+     */
+    size_t hotness = 0;
+
+    /**
+     * Native code, once hot (JIT only)
+     */
+    JitCode* jitCode = nullptr;
+
+    /**
+     * Runtime feedback by bytecode offset, empty unless collected
+     * (TraceMode::FEEDBACK)
+     */
+    std::vector<FeedbackSlot> feedback;
+
     /**
      * Adds a local within the current scope level
      */ 
@@ -163,11 +312,9 @@ struct CodeObject : public Object {
      * Get cell index
      */
     int getCellIndex(const std::string& name) {
-        if (locals.size() > 0) { 
-            for (auto i = (int)cellNames.size() - 1; i >= 0; i--) {
-                if (cellNames[i] == name) {
-                    return i;
-                }
+        for (auto i = (int)cellNames.size() - 1; i >= 0; i--) {
+            if (cellNames[i] == name) {
+                return i;
             }
         }
         return -1;
@@ -202,56 +349,469 @@ struct FunctionObject: public Object {
     std::vector<CellObject*> cells;
 };
 
+// -------------------------------------------------------
+/**
+ * Collector counters of a Heap
+ */
+struct HeapStats {
+    size_t collections = 0;
+    size_t minorCollections = 0;
+
+    /**
+     * Over the life of the heap
+     */
+    size_t bytesAllocated = 0;
+    size_t objectsAllocated = 0;
+    size_t bytesFreed = 0;
+    size_t objectsFreed = 0;
+
+    /**
+     * Copied from the nursery to the heap
+     */
+    size_t bytesPromoted = 0;
+    size_t objectsPromoted = 0;
+
+    /**
+     * Most bytes in the heap at once
+     */
+    size_t peakBytes = 0;
+
+    /**
+     * Collection pauses, in microseconds: minor collections, full ones
+     * and the slices of incremental ones
+     */
+    size_t pauses = 0;
+    uint64_t totalPause = 0;
+    uint64_t maxPause = 0;
+
+    /**
+     * Slices of incremental collections, counted in `pauses` too
+     */
+    size_t slices = 0;
+
+    /**
+     * Pauses by duration: bucket 0 under 1us, bucket i from 2^(i-1) up
+     * to 2^i us, the last one the rest
+     */
+    static constexpr size_t PAUSE_BUCKETS = 24;
+    std::array<size_t, PAUSE_BUCKETS> pauseHistogram{};
+
+    void pause(uint64_t us) {
+        pauses++;
+        totalPause += us;
+        maxPause = std::max(maxPause, us);
+        size_t bucket = 0;
+        while (bucket + 1 < PAUSE_BUCKETS && (uint64_t(1) << bucket) <= us) {
+            bucket++;
+        }
+        pauseHistogram[bucket]++;
+    }
+
+    /**
+     * Upper bound of the bucket holding the `fraction` percentile of
+     * pauses, in microseconds
+     */
+    uint64_t pausePercentile(double fraction) const {
+        size_t seen = 0;
+        for (size_t bucket = 0; bucket < PAUSE_BUCKETS; bucket++) {
+            seen += pauseHistogram[bucket];
+            if (seen > 0 && seen >= fraction * pauses) {
+                return std::min(uint64_t(1) << bucket, maxPause);
+            }
+        }
+        return maxPause;
+    }
+};
+
+/**
+ * State of the collection of a heap.  Stop-the-world collections go
+ * from IDLE to IDLE; incremental ones mark, then sweep, a slice at a
+ * time.
+ */
+enum class GCPhase {
+    IDLE,
+    MARK,
+    SWEEP,
+};
+
+/**
+ *  Nursery
+ *
+ *  The young generation: strings, cells and functions allocated while
+ *  a VM runs are placed by bumping a pointer through one block.  A
+ *  minor collection (EvaCollector::scavenge) copies the survivors to
+ *  the heap and resets the pointer.  Code and native objects are never
+ *  young: compiled code and the JIT hold raw pointers to them, and
+ *  compile-time allocations are long-lived anyway.
+ */
+struct Nursery {
+    /**
+     * [start, top) is allocated, [top, end) free
+     */
+    uint8_t* start = nullptr;
+    uint8_t* top = nullptr;
+    uint8_t* end = nullptr;
+
+    /**
+     * Bytes of the young objects, with the characters of strings:
+     * these live outside the block and count towards filling it
+     */
+    size_t bytes = 0;
+
+    /**
+     * Allocates only while open: the VM opens it for the eval loop
+     */
+    bool open = false;
+
+    void reserve(size_t capacity) {
+        space_.reset(capacity > 0 ? new uint8_t[capacity] : nullptr);
+        start = top = space_.get();
+        end = start + capacity;
+    }
+
+    /**
+     * Types allocated in the nursery
+     */
+    template <typename T>
+    static constexpr bool holds() {
+        return std::is_same<T, StringObject>::value ||
+               std::is_same<T, CellObject>::value ||
+               std::is_same<T, FunctionObject>::value;
+    }
+
+    /**
+     * Memory for an object of `size` bytes, nullptr when closed or full
+     */
+    void* bump(size_t size) {
+        size = align(size);
+        if (!open || (size_t)(end - top) < size) {
+            return nullptr;
+        }
+        auto memory = top;
+        top += size;
+        return memory;
+    }
+
+    /**
+     * Time for a minor collection: no room for the largest object, or
+     * the young bytes fill the block
+     */
+    bool full() const {
+        return top != start && ((size_t)(end - top) < MAX_SLOT || bytes >= (size_t)(end - start));
+    }
+
+    static constexpr size_t align(size_t size) {
+        return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    }
+
+    /**
+     * Bytes an object of `type` takes in the block
+     */
+    static size_t slotSize(ObjectType type);
+
+    static const size_t MAX_SLOT;
+
+    private:
+        std::unique_ptr<uint8_t[]> space_;
+};
+
+/**
+ *  Heap
+ *
+ *  Every object allocated while a heap is current is linked into its
+ *  object list, the list EvaCollector sweeps, unless it fits in the
+ *  heap's nursery.  Each VM has its own and makes it current while it
+ *  runs; objects allocated outside any VM go to a permanent heap, which
+ *  is never collected.
+ */
+struct Heap {
+    /**
+     * Most recently allocated object, linked through Object::next
+     */
+    Object* objects = nullptr;
+
+    /**
+     * Bytes and objects in the heap, live or not yet swept
+     */
+    size_t bytes = 0;
+    size_t count = 0;
+
+    /**
+     * Bytes at which the next collection starts, see EvaVM::maybeGC
+     */
+    size_t nextCollection = (size_t)-1;
+
+    GCPhase phase = GCPhase::IDLE;
+
+    Nursery nursery;
+
+    /**
+     * Old objects that may reference young ones, see writeBarrier
+     */
+    std::vector<Object*> remembered;
+
+    /**
+     * Objects the write barrier marked while the heap was being marked:
+     * gray, for EvaCollector to trace
+     */
+    std::vector<Object*> shaded;
+
+    HeapStats stats;
+
+    static Heap& permanent() {
+        static Heap heap;
+        return heap;
+    }
+
+    static Heap*& current() {
+        static Heap* heap = &permanent();
+        return heap;
+    }
+
+    void link(Object* object) {
+        object->next = objects;
+        objects = object;
+        bytes += objectSize(object);
+        count++;
+    }
+
+    /**
+     * Counts a new object, young or linked
+     */
+    void allocated(Object* object) {
+        stats.bytesAllocated += objectSize(object);
+        stats.objectsAllocated++;
+        stats.peakBytes = std::max(stats.peakBytes, bytes + nursery.bytes);
+    }
+
+    /**
+     * Bytes an object accounts for: its struct, and the characters of
+     * a string
+     */
+    static size_t objectSize(Object* object) {
+        switch (object->type) {
+            case ObjectType::STRING:
+                return sizeof(StringObject) + ((StringObject*)object)->string.size();
+            case ObjectType::CODE:
+                return sizeof(CodeObject);
+            case ObjectType::NATIVE:
+                return sizeof(NativeObject);
+            case ObjectType::FUNCTION:
+                return sizeof(FunctionObject);
+            case ObjectType::CELL:
+                return sizeof(CellObject);
+        }
+        return sizeof(Object);
+    }
+
+    /**
+     * Deletes an object the caller unlinked
+     */
+    void free(Object* object) {
+        auto size = objectSize(object);
+        bytes -= size;
+        count--;
+        stats.bytesFreed += size;
+        stats.objectsFreed++;
+        switch (object->type) {
+            case ObjectType::STRING:
+                delete (StringObject*)object;
+                break;
+            case ObjectType::CODE:
+                delete (CodeObject*)object;
+                break;
+            case ObjectType::NATIVE:
+                delete (NativeObject*)object;
+                break;
+            case ObjectType::FUNCTION:
+                delete (FunctionObject*)object;
+                break;
+            case ObjectType::CELL:
+                delete (CellObject*)object;
+                break;
+        }
+    }
+
+    /**
+     * Runs the destructor of a young object, its memory stays in the
+     * nursery
+     */
+    static void destroy(Object* object) {
+        switch (object->type) {
+            case ObjectType::STRING:
+                ((StringObject*)object)->~StringObject();
+                break;
+            case ObjectType::FUNCTION:
+                ((FunctionObject*)object)->~FunctionObject();
+                break;
+            case ObjectType::CELL:
+                ((CellObject*)object)->~CellObject();
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+inline size_t Nursery::slotSize(ObjectType type) {
+    switch (type) {
+        case ObjectType::STRING:
+            return align(sizeof(StringObject));
+        case ObjectType::FUNCTION:
+            return align(sizeof(FunctionObject));
+        case ObjectType::CELL:
+            return align(sizeof(CellObject));
+        default:
+            return 0;
+    }
+}
+
+inline const size_t Nursery::MAX_SLOT = align(
+    std::max({sizeof(StringObject), sizeof(FunctionObject), sizeof(CellObject)}));
+
+/**
+ * Makes `heap` current for the lifetime of the scope
+ */
+struct HeapScope {
+    HeapScope(Heap& heap) : previous(Heap::current()) { Heap::current() = &heap; }
+    ~HeapScope() { Heap::current() = previous; }
+    Heap* previous;
+};
+
+/**
+ * Allocates an object in the nursery of the current heap, or in the
+ * heap itself
+ */
+template <typename T, typename... Args>
+Object* allocate(Args&&... args) {
+    auto heap = Heap::current();
+    Object* object = nullptr;
+    void* memory = Nursery::holds<T>() ? heap->nursery.bump(sizeof(T)) : nullptr;
+    if (memory != nullptr) {
+        object = new (memory) T(std::forward<Args>(args)...);
+        object->young = true;
+        heap->nursery.bytes += Heap::objectSize(object);
+    } else {
+        object = new T(std::forward<Args>(args)...);
+        // Black while marking: not traced, kept by this collection
+        object->marked = heap->phase == GCPhase::MARK;
+        heap->link(object);
+    }
+    heap->allocated(object);
+    return object;
+}
+
 /**
  * Constructors
  */
+#ifdef EVA_NAN_BOXING
+
+#define NUMBER(value) numberToValue(value)
+#define INTEGER(value) ((EvaValue){INTEGER_BITS | (uint32_t)(int32_t)(value)})
+#define BOOLEAN(value) ((EvaValue){(value) ? TRUE_BITS : FALSE_BITS})
+#define OBJECT(value) ((EvaValue){SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)})
+
+#else
+
 #define NUMBER(value) ((EvaValue){EvaValueType::NUMBER, .number = value})
+#define INTEGER(value) ((EvaValue){EvaValueType::INTEGER, .integer = (int32_t)(value)})
 #define BOOLEAN(value) ((EvaValue){EvaValueType::BOOLEAN, .boolean = value})
 #define OBJECT(value) ((EvaValue){EvaValueType::OBJECT, .object = value})
 
-#define ALLOC_STRING(value)                 \
-    ((EvaValue) {EvaValueType::OBJECT, .object = (Object*)new StringObject(value)})
+#endif
+
+#define ALLOC_STRING(value) OBJECT(allocate<StringObject>(value))
 
-#define ALLOC_CODE(name, arity)             \
-    ((EvaValue) {EvaValueType::OBJECT,      \
-            .object = (Object*)new CodeObject(name, arity)})
+#define ALLOC_CODE(name, arity) OBJECT(allocate<CodeObject>(name, arity))
 
 #define ALLOC_NATIVE(fn, name, arity)       \
-    ((EvaValue) {EvaValueType::OBJECT,      \
-            .object = (Object*)new NativeObject(fn, name, arity)})
+    OBJECT(allocate<NativeObject>(fn, name, arity))
 
-#define ALLOC_FUNCTION(co)                  \
-    ((EvaValue){EvaValueType::OBJECT,       \
-            .object = (Object*)new FunctionObject(co)})
+#define ALLOC_FUNCTION(co) OBJECT(allocate<FunctionObject>(co))
 
-#define ALLOC_CELL(co)                      \
-    ((EvaValue){EvaValueType::OBJECT,       \
-            .object = (Object*)new CellObject(co)})
+#define ALLOC_CELL(co) OBJECT(allocate<CellObject>(co))
 
 #define CELL(cellObject) OBJECT((Object*)cellObject)
 
 /**
  * Accessors
  */
-#define AS_NUMBER(evaValue) ((double)(evaValue).number)
+#ifdef EVA_NAN_BOXING
+
+#define AS_DOUBLE(evaValue) valueToNumber(evaValue)
+#define AS_INTEGER(evaValue) ((int32_t)(uint32_t)(evaValue).bits)
+#define AS_BOOLEAN(evaValue) ((evaValue).bits == TRUE_BITS)
+#define AS_OBJECT(evaValue) \
+    ((Object*)(uintptr_t)((evaValue).bits & ~(SIGN_BIT | QNAN)))
+
+#else
+
+#define AS_DOUBLE(evaValue) ((double)(evaValue).number)
+#define AS_INTEGER(evaValue) ((int32_t)(evaValue).integer)
 #define AS_BOOLEAN(evaValue) ((bool)(evaValue).boolean)
 #define AS_OBJECT(evaValue) ((Object*)(evaValue).object)
 
-#define AS_STRING(evaValue) ((StringObject*)(evaValue).object)
+#endif
+
+#define AS_STRING(evaValue) ((StringObject*)AS_OBJECT(evaValue))
 #define AS_CPPSTRING(evaValue) (AS_STRING(evaValue)->string)
 
-#define AS_CODE(evaValue) ((CodeObject*)(evaValue).object)
-#define AS_NATIVE(evaValue) ((NativeObject*)(evaValue).object)
-#define AS_FUNCTION(evaValue) ((FunctionObject*)(evaValue).object)
-#define AS_CELL(evaValue) ((CellObject*)(evaValue).object)
+#define AS_CODE(evaValue) ((CodeObject*)AS_OBJECT(evaValue))
+#define AS_NATIVE(evaValue) ((NativeObject*)AS_OBJECT(evaValue))
+#define AS_FUNCTION(evaValue) ((FunctionObject*)AS_OBJECT(evaValue))
+#define AS_CELL(evaValue) ((CellObject*)AS_OBJECT(evaValue))
 
 /**
  * Testers
  */
-#define IS_NUMBER(evaValue) ((evaValue).type == EvaValueType::NUMBER)
+#ifdef EVA_NAN_BOXING
+
+#define IS_DOUBLE(evaValue) (((evaValue).bits & QNAN) != QNAN)
+#define IS_INTEGER(evaValue) (((evaValue).bits >> 32) == (INTEGER_BITS >> 32))
+#define IS_BOOLEAN(evaValue) (((evaValue).bits | 1) == TRUE_BITS)
+#define IS_OBJECT(evaValue) \
+    (((evaValue).bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+
+#else
+
+#define IS_DOUBLE(evaValue) ((evaValue).type == EvaValueType::NUMBER)
+#define IS_INTEGER(evaValue) ((evaValue).type == EvaValueType::INTEGER)
 #define IS_BOOLEAN(evaValue) ((evaValue).type == EvaValueType::BOOLEAN)
 #define IS_OBJECT(evaValue) ((evaValue).type == EvaValueType::OBJECT)
 
+#endif
+
+/**
+ * Stack and number helpers are forced inline: with threaded dispatch
+ * each handler gets its own copy of them, and GCC otherwise stops
+ * inlining.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/**
+ * Slow paths kept out of the eval loop
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+/**
+ * Numbers are doubles or small integers, read as a double either way
+ */
+#define IS_NUMBER(evaValue) (IS_DOUBLE(evaValue) || IS_INTEGER(evaValue))
+
+ALWAYS_INLINE double asNumber(const EvaValue& value) {
+    return IS_INTEGER(value) ? (double)AS_INTEGER(value) : AS_DOUBLE(value);
+}
+
+#define AS_NUMBER(evaValue) asNumber(evaValue)
+
 #define IS_OBJECT_TYPE(evaValue, objectType) \
     (IS_OBJECT(evaValue) && AS_OBJECT(evaValue)->type == objectType)
 
@@ -261,12 +821,42 @@ struct FunctionObject: public Object {
 #define IS_FUNCTION(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::FUNCTION)
 #define IS_CELL(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CELL)
 
+/**
+ * Write barrier: `owner` now references `value`.  An old object that
+ * references a young one is remembered, a minor collection updates it
+ * like a root.  While the heap is marked incrementally, a marked owner
+ * shades an unmarked value: a traced object never points to one the
+ * collector has not seen.
+ */
+inline void writeBarrier(Object* owner, Object* value) {
+    if (value == nullptr) {
+        return;
+    }
+    if (value->young) {
+        if (!owner->young && !owner->remembered) {
+            owner->remembered = true;
+            Heap::current()->remembered.push_back(owner);
+        }
+    } else if (owner->marked && !value->marked && Heap::current()->phase == GCPhase::MARK) {
+        value->marked = true;
+        Heap::current()->shaded.push_back(value);
+    }
+}
+
+inline void writeBarrier(Object* owner, const EvaValue& value) {
+    if (IS_OBJECT(value)) {
+        writeBarrier(owner, AS_OBJECT(value));
+    }
+}
+
 
 /**
  * String representation used in constants for debugging
  */
 std::string evaValueToTypeString(const EvaValue &evaValue) {
-    if (IS_NUMBER(evaValue)) {
+    if (IS_INTEGER(evaValue)) {
+        return "INTEGER";
+    } else if (IS_NUMBER(evaValue)) {
         return "NUMBER";
     } else if (IS_BOOLEAN(evaValue)) {
         return "BOOLEAN";
@@ -281,17 +871,19 @@ std::string evaValueToTypeString(const EvaValue &evaValue) {
     } else if (IS_CELL(evaValue)) {
         return "CELL";
     } else {
-        DIE << "evaValueToTypeString: unknown type " << (int)evaValue.type;
+        DIE << "evaValueToTypeString: unknown type";
     }
     return "";  // Unreachable
 }
 
 std::string evaValueToConstantString(const EvaValue &evaValue) {
     std::stringstream ss;
-    if (IS_NUMBER(evaValue)) {
-        ss << evaValue.number;
+    if (IS_INTEGER(evaValue)) {
+        ss << AS_INTEGER(evaValue);
+    } else if (IS_NUMBER(evaValue)) {
+        ss << AS_NUMBER(evaValue);
     } else if (IS_BOOLEAN(evaValue)) {
-        ss << (evaValue.boolean == true ? "true" : "false");
+        ss << (AS_BOOLEAN(evaValue) ? "true" : "false");
     } else if (IS_STRING(evaValue)) {
         ss << '"' << AS_CPPSTRING(evaValue) << '"';
     } else if (IS_CODE(evaValue)) {
@@ -307,7 +899,7 @@ std::string evaValueToConstantString(const EvaValue &evaValue) {
         auto cell = AS_CELL(evaValue);
         ss << "cell: " << evaValueToConstantString(cell->value);
     } else {
-        DIE << "evaValueToConstantString: unknown type " << (int)evaValue.type;
+        DIE << "evaValueToConstantString: unknown type";
     }
     return ss.str();
 }
@@ -320,4 +912,83 @@ std::ostream& operator<<(std::ostream &os, const EvaValue &evaValue) {
             << "): " << evaValueToConstantString(evaValue);
 }
 
+/**
+ * Generic values comparison
+ */ 
+template <typename T>
+bool compareValues(uint8_t op, const T& v1, const T& v2) {
+    switch (op) {
+        case 0:
+            return v1 < v2;
+        case 1:
+            return v1 > v2;
+        case 2:
+            return v1 == v2;
+        case 3:
+            return v1 >= v2;
+        case 4:
+            return v1 <= v2;
+        case 5:
+            return v1 != v2;
+    }
+    return false;
+}
+
+/**
+ * Non-numeric comparison, kept out of line of the branch handlers
+ */
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((noinline))
+#endif
+bool compareObjects(uint8_t op, const EvaValue& v1, const EvaValue& v2) {
+    if (!IS_STRING(v1) || !IS_STRING(v2)) {
+        DIE << "Comparison of incompatible values: " << v1 << ", " << v2;
+    }
+    return compareValues(op, AS_CPPSTRING(v1), AS_CPPSTRING(v2));
+}
+
+/**
+ * Number comparison: as integers when both are, else as doubles
+ */
+ALWAYS_INLINE bool compareNumberValues(uint8_t op, const EvaValue& v1, const EvaValue& v2) {
+    if (IS_INTEGER(v1) && IS_INTEGER(v2)) {
+        return compareValues(op, AS_INTEGER(v1), AS_INTEGER(v2));
+    }
+    return compareValues(op, AS_NUMBER(v1), AS_NUMBER(v2));
+}
+
+/**
+ * Number arithmetic: an integer while both operands are integers and the
+ * result fits in 32 bits, else a double
+ */
+ALWAYS_INLINE EvaValue addNumbers(const EvaValue& v1, const EvaValue& v2) {
+    if (IS_INTEGER(v1) && IS_INTEGER(v2)) {
+        auto result = (int64_t)AS_INTEGER(v1) + AS_INTEGER(v2);
+        if (result == (int32_t)result) {
+            return INTEGER(result);
+        }
+    }
+    return NUMBER(AS_NUMBER(v1) + AS_NUMBER(v2));
+}
+
+ALWAYS_INLINE EvaValue subNumbers(const EvaValue& v1, const EvaValue& v2) {
+    if (IS_INTEGER(v1) && IS_INTEGER(v2)) {
+        auto result = (int64_t)AS_INTEGER(v1) - AS_INTEGER(v2);
+        if (result == (int32_t)result) {
+            return INTEGER(result);
+        }
+    }
+    return NUMBER(AS_NUMBER(v1) - AS_NUMBER(v2));
+}
+
+ALWAYS_INLINE EvaValue mulNumbers(const EvaValue& v1, const EvaValue& v2) {
+    if (IS_INTEGER(v1) && IS_INTEGER(v2)) {
+        auto result = (int64_t)AS_INTEGER(v1) * AS_INTEGER(v2);
+        if (result == (int32_t)result) {
+            return INTEGER(result);
+        }
+    }
+    return NUMBER(AS_NUMBER(v1) * AS_NUMBER(v2));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+/**
+ * Eval loop policies
+ */
+
+#ifndef EvalPolicy_h
+#define EvalPolicy_h
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../bytecode/OpCode.h"
+
+/**
+ * Trace mode, selected once per run in EvaVM::exec.
+ */
+enum class TraceMode {
+    NONE,
+    STACK,
+    PROFILE,
+    FEEDBACK,
+};
+
+/**
+ * Opcode execution counts, collected by the Profile policy.
+ */
+struct OpcodeProfile {
+    /**
+     * Executions per opcode
+     */
+    std::array<uint64_t, 256> counts{};
+
+    /**
+     * Executions per (previous, current) opcode pair, 256 x 256
+     */
+    std::vector<uint64_t> pairs = std::vector<uint64_t>(256 * 256);
+
+    /**
+     * Previously executed opcode, -1 at the start of a run
+     */
+    int prev = -1;
+
+    /**
+     * Records one executed instruction
+     */
+    void record(uint8_t opcode) {
+        counts[opcode]++;
+        if (prev != -1) {
+            pairs[prev * 256 + opcode]++;
+        }
+        prev = opcode;
+    }
+
+    /**
+     * Prints the opcode and opcode pair frequencies
+     */
+    void dump(size_t topPairs = 20) {
+        uint64_t total = 0;
+        for (auto count : counts) {
+            total += count;
+        }
+
+        std::cout << std::dec << "\n----------------Profile: " << total
+                  << " instructions -----------------\n\n";
+
+        std::vector<int> ops;
+        for (auto op = 0; op < 256; op++) {
+            if (counts[op] != 0) {
+                ops.push_back(op);
+            }
+        }
+        std::sort(ops.begin(), ops.end(),
+                  [&](int a, int b) { return counts[a] > counts[b]; });
+
+        for (auto op : ops) {
+            printRow(opcodeToString(op), counts[op], total);
+        }
+
+        std::cout << "\n--- Top opcode pairs ---\n\n";
+
+        std::vector<int> pairIndices;
+        for (auto i = 0; i < (int)pairs.size(); i++) {
+            if (pairs[i] != 0) {
+                pairIndices.push_back(i);
+            }
+        }
+        std::sort(pairIndices.begin(), pairIndices.end(),
+                  [&](int a, int b) { return pairs[a] > pairs[b]; });
+
+        for (auto i = 0; i < (int)pairIndices.size() && i < (int)topPairs; i++) {
+            auto index = pairIndices[i];
+            printRow(opcodeToString(index / 256) + ", " + opcodeToString(index % 256),
+                     pairs[index], total);
+        }
+    }
+
+    void printRow(const std::string& name, uint64_t count, uint64_t total) {
+        std::ios_base::fmtflags f(std::cout.flags());
+        std::cout << std::left << std::setfill(' ') << std::setw(36) << name
+                  << std::right << std::dec << std::setw(14) << count << "  " << std::fixed
+                  << std::setprecision(1) << std::setw(5)
+                  << (total == 0 ? 0.0 : 100.0 * count / total) << "%\n";
+        std::cout.flags(f);
+    }
+};
+
+/**
+ * EvaVM::eval is instantiated once per policy.  Each policy gets a hook
+ * before every instruction; in NoTrace it is empty, so the production
+ * loop has no debug branches.  `jit` compiles in the JIT entry points,
+ * `traceLoops` the loop back-edge hook of the tracing JIT.
+ */
+struct NoTrace {
+    static constexpr bool jit = false;
+    static constexpr bool traceLoops = false;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {}
+};
+
+/**
+ * Dumps the operand stack before each instruction.
+ */
+struct StackTrace {
+    static constexpr bool jit = false;
+    static constexpr bool traceLoops = false;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {
+        vm.dumpStack(opcode);
+    }
+};
+
+/**
+ * Counts opcodes and opcode pairs.
+ */
+struct Profile {
+    static constexpr bool jit = false;
+    static constexpr bool traceLoops = false;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {
+        vm.profile.record(opcode);
+    }
+};
+
+/**
+ * Fills the type feedback of each code object (see TypeFeedback.h).
+ */
+struct Feedback {
+    static constexpr bool jit = false;
+    static constexpr bool traceLoops = false;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {
+        vm.feedback.record(vm.fn->co, vm.ip - 1, vm.sp);
+    }
+};
+
+/**
+ * No tracing; hot functions and loops are compiled to native code and
+ * run there (see EvaJit.h).
+ */
+struct Jit {
+    static constexpr bool jit = true;
+    static constexpr bool traceLoops = false;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {}
+};
+
+/**
+ * Hot loops are traced: while a loop iteration is being recorded, each
+ * instruction goes to the recorder (see EvaTracer.h).
+ */
+struct LoopTracing {
+    static constexpr bool jit = false;
+    static constexpr bool traceLoops = true;
+
+    template <typename VM>
+    static void onInstruction(VM& vm, uint8_t opcode) {
+        if (vm.tracer.recording()) {
+            vm.tracer.record(vm.ip - 1, vm.sp, vm.bp, vm.global->globals.data());
+        }
+    }
+};
+
+#endif
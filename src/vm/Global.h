@@ -43,7 +43,7 @@ struct Global {
             return;
         }
         //Set to default number 0
-        globals.push_back({name, NUMBER(0)});
+        globals.push_back({name, INTEGER(0)});
     }
 
     /**
@@ -57,17 +57,38 @@ struct Global {
     }
 
     /**
-     * Adds a native function
+     * Adds a native function, see checkNativeCall
      */ 
-    void addNativeFunction(const std::string& name, std::function<void()> fn, 
-            size_t arity) {
+    void addNativeFunction(const std::string& name, NativeFn fn, size_t arity) {
         if (exists(name)) {
             return;
         }
+        if (fn == nullptr) {
+            DIE << "Native function " << name << " is null.";
+        }
+        if (arity > 255) {
+            DIE << "Native function " << name << ": too many parameters (" << arity << ").";
+        }
 
         globals.push_back({name, ALLOC_NATIVE(fn, name, arity)});
     }
 
+    /**
+     * Direct calls of a global native are checked against its arity
+     * when compiled; the VM checks every call again as it runs.
+     */
+    void checkNativeCall(const std::string& name, size_t argsCount) {
+        auto index = getGlobalIndex(name);
+        if (index == -1 || !IS_NATIVE(globals[index].value)) {
+            return;
+        }
+        auto arity = AS_NATIVE(globals[index].value)->arity;
+        if (arity != argsCount) {
+            DIE << "Native function " << name << " expects " << arity
+                << " argument(s), " << argsCount << " given.";
+        }
+    }
+
     /**
      * Get local index
      */ 
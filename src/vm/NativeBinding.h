@@ -0,0 +1,130 @@
+/**
+ * Typed native bindings
+ */
+
+#ifndef NativeBinding_h
+#define NativeBinding_h
+
+#include <climits>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "../Logger.h"
+#include "EvaValue.h"
+
+/**
+ * Conversions between EvaValue and a C++ parameter or result type.
+ * Specialize to bind functions over other types.
+ */
+template <typename T>
+struct NativeType;
+
+template <>
+struct NativeType<double> {
+    static constexpr const char* name = "number";
+    static bool is(const EvaValue& value) { return IS_NUMBER(value); }
+    static double from(const EvaValue& value) { return AS_NUMBER(value); }
+    static EvaValue to(double value) { return NUMBER(value); }
+};
+
+/**
+ * A whole number in the range of int; other numbers are type errors
+ * rather than truncated
+ */
+template <>
+struct NativeType<int> {
+    static constexpr const char* name = "whole number";
+    static bool is(const EvaValue& value) {
+        if (IS_INTEGER(value)) {
+            return true;
+        }
+        if (!IS_NUMBER(value)) {
+            return false;
+        }
+        auto number = AS_NUMBER(value);
+        return number >= INT_MIN && number <= INT_MAX && number == (int)number;
+    }
+    static int from(const EvaValue& value) {
+        return IS_INTEGER(value) ? AS_INTEGER(value) : (int)AS_NUMBER(value);
+    }
+    static EvaValue to(int value) { return INTEGER(value); }
+};
+
+template <>
+struct NativeType<bool> {
+    static constexpr const char* name = "boolean";
+    static bool is(const EvaValue& value) { return IS_BOOLEAN(value); }
+    static bool from(const EvaValue& value) { return AS_BOOLEAN(value); }
+    static EvaValue to(bool value) { return BOOLEAN(value); }
+};
+
+template <>
+struct NativeType<std::string> {
+    static constexpr const char* name = "string";
+    static bool is(const EvaValue& value) { return IS_STRING(value); }
+    static const std::string& from(const EvaValue& value) { return AS_CPPSTRING(value); }
+    static EvaValue to(const std::string& value) { return ALLOC_STRING(value); }
+};
+
+template <>
+struct NativeType<EvaValue> {
+    static constexpr const char* name = "value";
+    static bool is(const EvaValue& value) { return true; }
+    static const EvaValue& from(const EvaValue& value) { return value; }
+    static EvaValue to(const EvaValue& value) { return value; }
+};
+
+/**
+ * Signature of a bound function: arity and the trampoline calling it.
+ */
+template <typename Fn>
+struct NativeSignature;
+
+template <typename R, typename... Args>
+struct NativeSignature<R (*)(Args...)> {
+    static constexpr size_t arity = sizeof...(Args);
+
+    /**
+     * Checks and unboxes the arguments, calls Fn, boxes the result.
+     * A void function evaluates to false.
+     */
+    template <auto Fn, size_t... I>
+    static EvaValue call(NativeArgs args, const std::string& name, std::index_sequence<I...>) {
+        (checkArgument<std::decay_t<Args>>(args[I], I, name), ...);
+        if constexpr (std::is_void_v<R>) {
+            Fn(NativeType<std::decay_t<Args>>::from(args[I])...);
+            return BOOLEAN(false);
+        } else {
+            return NativeType<std::decay_t<R>>::to(
+                Fn(NativeType<std::decay_t<Args>>::from(args[I])...));
+        }
+    }
+
+    template <typename T>
+    static void checkArgument(const EvaValue& value, size_t index, const std::string& name) {
+        if (!NativeType<T>::is(value)) {
+            DIE << name << ": argument " << index + 1 << " must be a " << NativeType<T>::name
+                << ", got " << value;
+        }
+    }
+};
+
+/**
+ * Native binding of the C++ function Fn
+ */
+template <auto Fn>
+struct NativeBinding {
+    using Signature = NativeSignature<decltype(Fn)>;
+
+    /**
+     * The NativeFn registered for Fn, under any name; errors name the
+     * NativeObject called
+     */
+    static EvaValue trampoline(NativeArgs args) {
+        return Signature::template call<Fn>(args, args.native->name,
+                                            std::make_index_sequence<Signature::arity>());
+    }
+};
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * Operand stack
+ */
+
+#ifndef OperandStack_h
+#define OperandStack_h
+
+#include <cstddef>
+#include <vector>
+
+#include "../Logger.h"
+#include "EvaValue.h"
+
+/**
+ * With guard pages (POSIX), the stack is a reserved mapping with an
+ * inaccessible page on each side: pushing past the end or popping past
+ * the beginning faults, and the fault handler reports it.  push/pop then
+ * need no bounds compare.  Pages are only backed by memory once touched,
+ * so large stacks cost nothing until used.
+ *
+ * Define EVA_NO_GUARD_PAGES to use a plain vector and checked push/pop.
+ */
+#if !defined(EVA_NO_GUARD_PAGES) && (defined(__unix__) || defined(__APPLE__))
+#define EVA_GUARD_PAGES
+#endif
+
+#ifdef EVA_GUARD_PAGES
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+class OperandStack {
+    public:
+        OperandStack(size_t size) {
+#ifdef EVA_GUARD_PAGES
+            pageSize_ = (size_t)sysconf(_SC_PAGESIZE);
+            auto bytes = (size * sizeof(EvaValue) + pageSize_ - 1) / pageSize_ * pageSize_;
+            mappingSize_ = bytes + 2 * pageSize_;
+
+            auto mapping = mmap(nullptr, mappingSize_, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                DIE << "OperandStack: cannot reserve " << bytes << " bytes";
+            }
+            mapping_ = (char*)mapping;
+            if (mprotect(mapping_ + pageSize_, bytes, PROT_READ | PROT_WRITE) != 0) {
+                DIE << "OperandStack: cannot map " << bytes << " bytes";
+            }
+
+            begin_ = (EvaValue*)(mapping_ + pageSize_);
+            end_ = (EvaValue*)(mapping_ + pageSize_ + bytes);
+
+            installFaultHandler();
+            next_ = stacks_;
+            stacks_ = this;
+#else
+            values_.resize(size);
+            begin_ = values_.data();
+            end_ = begin_ + size;
+#endif
+        }
+
+        ~OperandStack() {
+#ifdef EVA_GUARD_PAGES
+            for (auto link = &stacks_; *link != nullptr; link = &(*link)->next_) {
+                if (*link == this) {
+                    *link = next_;
+                    break;
+                }
+            }
+            munmap(mapping_, mappingSize_);
+#endif
+        }
+
+        OperandStack(const OperandStack&) = delete;
+        OperandStack& operator=(const OperandStack&) = delete;
+
+        EvaValue* begin() { return begin_; }
+
+        EvaValue* end() { return end_; }
+
+        size_t size() { return end_ - begin_; }
+
+        EvaValue& operator[](size_t index) { return begin_[index]; }
+
+    private:
+        EvaValue* begin_;
+        EvaValue* end_;
+
+#ifdef EVA_GUARD_PAGES
+        char* mapping_;
+        size_t mappingSize_;
+        size_t pageSize_;
+
+        /**
+         * Live stacks, searched by the fault handler
+         */
+        OperandStack* next_;
+        static OperandStack* stacks_;
+
+        static struct sigaction previousAction_;
+        static struct sigaction previousBusAction_;
+
+        static void installFaultHandler() {
+            static bool installed = false;
+            if (installed) {
+                return;
+            }
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_sigaction = onFault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previousAction_);
+            sigaction(SIGBUS, &action, &previousBusAction_);
+            installed = true;
+        }
+
+        /**
+         * Reports faults in a guard page as stack errors, anything
+         * else goes to the previous handler.
+         */
+        static void onFault(int signal, siginfo_t* info, void* context) {
+            auto address = (char*)info->si_addr;
+            for (auto stack = stacks_; stack != nullptr; stack = stack->next_) {
+                auto lower = stack->mapping_;
+                auto upper = (char*)stack->end_;
+                const char* message = nullptr;
+                if (address >= lower && address < lower + stack->pageSize_) {
+                    message = "Fatal error: pop(): empty stack. \n";
+                } else if (address >= upper && address < upper + stack->pageSize_) {
+                    message = "Fatal error: push(): Stack overflow. \n";
+                }
+                if (message != nullptr) {
+                    auto written = write(STDERR_FILENO, message, std::strlen(message));
+                    (void)written;
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            sigaction(SIGSEGV, &previousAction_, nullptr);
+            sigaction(SIGBUS, &previousBusAction_, nullptr);
+        }
+#else
+        std::vector<EvaValue> values_;
+#endif
+};
+
+#ifdef EVA_GUARD_PAGES
+OperandStack* OperandStack::stacks_ = nullptr;
+struct sigaction OperandStack::previousAction_;
+struct sigaction OperandStack::previousBusAction_;
+#endif
+
+#endif
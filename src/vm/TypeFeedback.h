@@ -0,0 +1,235 @@
+/**
+ * Runtime type feedback per instruction
+ */
+
+#ifndef TypeFeedback_h
+#define TypeFeedback_h
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../bytecode/OpCode.h"
+#include "EvaValue.h"
+
+/**
+ * Kinds of values told apart by the feedback, as FeedbackSlot bits
+ */
+enum class FeedbackKind : uint8_t {
+    INTEGER,
+    NUMBER,
+    BOOLEAN,
+    STRING,
+    FUNCTION,
+    NATIVE,
+    OTHER,
+};
+
+inline uint8_t feedbackBit(const EvaValue& value) {
+    auto kind = FeedbackKind::OTHER;
+    if (IS_INTEGER(value)) {
+        kind = FeedbackKind::INTEGER;
+    } else if (IS_NUMBER(value)) {
+        kind = FeedbackKind::NUMBER;
+    } else if (IS_BOOLEAN(value)) {
+        kind = FeedbackKind::BOOLEAN;
+    } else if (IS_STRING(value)) {
+        kind = FeedbackKind::STRING;
+    } else if (IS_FUNCTION(value)) {
+        kind = FeedbackKind::FUNCTION;
+    } else if (IS_NATIVE(value)) {
+        kind = FeedbackKind::NATIVE;
+    }
+    return 1 << (uint8_t)kind;
+}
+
+/**
+ * "int", "int|number", "number|string", ...
+ */
+inline std::string feedbackKinds(uint8_t bits) {
+    static const char* names[] = {"int", "number", "boolean", "string", "function", "native", "other"};
+    std::string result;
+    for (auto kind = 0; kind < 7; kind++) {
+        if (bits & (1 << kind)) {
+            result += (result.empty() ? "" : "|") + std::string(names[kind]);
+        }
+    }
+    return result;
+}
+
+inline bool isBranchOpcode(uint8_t opcode) {
+    return opcode == OP_JMP_IF_FALSE || (opcode >= OP_JMP_IF_LT && opcode <= OP_JMP_IF_NE);
+}
+
+/**
+ * Feedback of one instruction, as shown by the disassembler and
+ * TypeFeedback::dump: "number, string x3", "calls square x10",
+ * "taken 25% of 8"
+ */
+inline std::string feedbackToString(const FeedbackSlot& slot, uint8_t opcode) {
+    std::stringstream ss;
+    if (slot.lhs != 0) {
+        ss << feedbackKinds(slot.lhs) << ", " << feedbackKinds(slot.rhs);
+    }
+    if (slot.callee != nullptr) {
+        if (slot.polymorphic) {
+            ss << "polymorphic";
+        } else if (slot.callee->type == ObjectType::FUNCTION) {
+            ss << "calls " << ((FunctionObject*)slot.callee)->co->name;
+        } else if (slot.callee->type == ObjectType::NATIVE) {
+            ss << "calls " << ((NativeObject*)slot.callee)->name;
+        } else {
+            ss << "calls a non-function";
+        }
+    }
+    if (isBranchOpcode(opcode)) {
+        ss << (slot.lhs != 0 ? "; " : "") << "taken " << slot.taken * 100 / slot.count
+           << "% of " << slot.count;
+    } else {
+        ss << " x" << slot.count;
+    }
+    return ss.str();
+}
+
+/**
+ *  TypeFeedback
+ *
+ *  Fills CodeObject::feedback, one slot per bytecode offset, allocated
+ *  the first time a code object records anything.  Sites:
+ *
+ *    - arithmetic, OP_COMPARE and their quickened forms: operand kinds
+ *    - OP_CALL, OP_TAIL_CALL: the callee, or polymorphic
+ *    - OP_JMP_IF_FALSE, OP_JMP_IF_*: how often the branch was taken,
+ *      known at the next instruction
+ */
+struct TypeFeedback {
+    /**
+     * Branch waiting for its outcome, and its target
+     */
+    FeedbackSlot* branch = nullptr;
+    const uint8_t* target = nullptr;
+
+    /**
+     * Instruction recorded last: a deoptimized instruction dispatches
+     * again and is counted once
+     */
+    const uint8_t* last = nullptr;
+
+    /**
+     * Records the instruction at `ip` in `co`, about to run
+     */
+    void record(CodeObject* co, const uint8_t* ip, const EvaValue* sp) {
+        if (ip == last) {
+            return;
+        }
+        last = ip;
+
+        if (branch != nullptr) {
+            if (ip == target) {
+                branch->taken++;
+            }
+            branch = nullptr;
+        }
+
+        auto opcode = *ip;
+        switch (opcode) {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+            case OP_COMPARE:
+            case OP_LT_NUM:
+            case OP_GT_NUM:
+            case OP_EQ_NUM:
+            case OP_GE_NUM:
+            case OP_LE_NUM:
+            case OP_NE_NUM: {
+                auto& slot = slotAt(co, ip);
+                slot.count++;
+                slot.lhs |= feedbackBit(sp[-2]);
+                slot.rhs |= feedbackBit(sp[-1]);
+                break;
+            }
+
+            case OP_JMP_IF_LT:
+            case OP_JMP_IF_GT:
+            case OP_JMP_IF_EQ:
+            case OP_JMP_IF_GE:
+            case OP_JMP_IF_LE:
+            case OP_JMP_IF_NE:
+            case OP_JMP_IF_FALSE: {
+                auto& slot = slotAt(co, ip);
+                slot.count++;
+                if (opcode != OP_JMP_IF_FALSE) {
+                    slot.lhs |= feedbackBit(sp[-2]);
+                    slot.rhs |= feedbackBit(sp[-1]);
+                }
+                branch = &slot;
+                target = ip + opcodeSize(opcode) + readJumpOffset(ip + 1);
+                break;
+            }
+
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                auto& slot = slotAt(co, ip);
+                slot.count++;
+                auto callee = sp[-1 - ip[1]];
+                auto object = IS_OBJECT(callee) ? AS_OBJECT(callee) : nullptr;
+                if (slot.callee == nullptr) {
+                    slot.callee = object;
+                    writeBarrier(co, object);
+                } else if (slot.callee != object) {
+                    slot.polymorphic = true;
+                }
+                break;
+            }
+        }
+    }
+
+    /**
+     * Forgets the previous run
+     */
+    void reset() {
+        branch = nullptr;
+        last = nullptr;
+    }
+
+    /**
+     * Prints the recorded sites of `co`
+     */
+    static void dump(CodeObject* co) {
+        if (co->feedback.empty()) {
+            return;
+        }
+        std::cout << "\n----------------Feedback: " << co->name << " -----------------\n\n";
+        for (size_t offset = 0; offset < co->code.size(); offset += opcodeSize(co->code[offset])) {
+            auto& slot = co->feedback[offset];
+            if (slot.count == 0) {
+                continue;
+            }
+            std::ios_base::fmtflags f(std::cout.flags());
+            std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
+                      << std::setw(4) << offset << "  ";
+            std::cout.flags(f);
+            std::cout << std::left << std::setfill(' ') << std::setw(20)
+                      << opcodeToString(co->code[offset]) << feedbackToString(slot, co->code[offset])
+                      << "\n";
+            std::cout.flags(f);
+        }
+    }
+
+    /**
+     * Slot of the instruction at `ip`, the table allocated on first use
+     */
+    static FeedbackSlot& slotAt(CodeObject* co, const uint8_t* ip) {
+        if (co->feedback.empty()) {
+            co->feedback.resize(co->code.size());
+        }
+        return co->feedback[ip - co->code.data()];
+    }
+};
+
+#endif